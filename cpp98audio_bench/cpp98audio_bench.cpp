@@ -0,0 +1,569 @@
+/*/
+ * Throughput of every kernel, across buffer sizes and channel counts.
+ *
+ * Sizes go from one that sits in L1 to one well beyond any last level
+ * cache; channel counts are mono, stereo and 7.1. For each kernel, size
+ * and channel count, the best of a few timed runs, each long enough to
+ * be worth timing, gives ns per frame and million samples per second.
+ *
+ *   cpp98audio_bench [--quick] [--simd scalar|sse2|avx2]
+ *                    [--only <kernel>] [--out <results.tsv>]
+ *                    [--baseline <results.tsv>] [--tolerance 0.15]
+ *   cpp98audio_bench --io <file.wav> [--mb 256]
+ *
+ * --out writes the results tab-separated, one line each. Kept, that
+ * file is a baseline: --baseline compares this run with it, lists
+ * everything that's got more than --tolerance (a fraction) slower, and
+ * exits 1 if anything has. Only compare runs from the same machine,
+ * build and --simd.
+ *
+ * --io times reading a 16-bit WAV and enveloping it: one after the
+ * other on one thread, then with block_reader reading ahead. If the
+ * file isn't there, --mb megabytes of stereo noise are written to it
+ * first. Overlap efficiency is how much of the shorter of reading and
+ * processing the reader hid: 100% is all of it. Both passes start
+ * with the file dropped from the page cache (posix_fadvise()), so both
+ * read from the disk; where that can't be done, a warning says the
+ * numbers are mostly the cache's.
+/*/
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../include/cpp_98_audio_buffer.hpp"
+#include "../include/cpp_98_audio_envelope.hpp"
+#include "../include/cpp_98_audio_fixed.hpp"
+#include "../include/cpp_98_audio_frames.hpp"
+#include "../include/cpp_98_audio_graph.hpp"
+#include "../include/cpp_98_audio_loudness.hpp"
+#include "../include/cpp_98_audio_reader.hpp"
+#include "../include/cpp_98_audio_resample.hpp"
+#include "../include/cpp_98_audio_simd.hpp"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace audio = my::cpp98::audio;
+
+namespace {
+
+// Seconds, from some fixed point.
+double now() {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart / (double)f.QuadPart;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+// What every kernel gets: noise, in shorts and floats, and somewhere to
+// write each. Sized for the biggest run, and made once.
+struct buffers {
+    vector<short> shorts, shorts_out;
+    vector<float> floats, floats_out;
+    size_t n; // samples in this run
+    int nch;
+
+    explicit buffers(size_t max_samples)
+        : shorts(max_samples)
+        , shorts_out(max_samples)
+        , floats(max_samples)
+        , floats_out(max_samples)
+        , n(0)
+        , nch(1) {
+        unsigned int seed = 2024;
+        for (size_t i = 0; i < max_samples; ++i) {
+            seed = seed * 1103515245u + 12345u;
+            // under half scale, so normalize_buffer() has work to do
+            shorts[i] = (short)((short)(seed >> 16) >> 2);
+        }
+        audio::simd::shorts_to_floats(
+            &shorts[0], &shorts[0] + max_samples, &floats[0]);
+    }
+};
+
+// Stops the optimizer from throwing a result away.
+volatile float g_sink;
+
+void k_shorts_to_floats(buffers& b) {
+    audio::simd::shorts_to_floats(
+        &b.shorts[0], &b.shorts[0] + b.n, &b.floats_out[0]);
+}
+
+void k_floats_to_shorts(buffers& b) {
+    audio::simd::floats_to_shorts(
+        &b.floats[0], &b.floats[0] + b.n, &b.shorts_out[0]);
+}
+
+void k_envelope_update(buffers& b) {
+    audio::envelope env(44100, b.nch);
+    const float* p = &b.floats[0];
+    const float* const e = p + b.n;
+    while (p < e) env.update(*p++);
+    g_sink = env();
+}
+
+void k_envelope_shorts(buffers& b) {
+    audio::envelope env(44100, b.nch);
+    env.envelope_shorts(&b.shorts[0], &b.shorts[0] + b.n);
+    g_sink = env();
+}
+
+// Sentinels that never fire: the checking, not the early exit.
+void k_envelope_shorts_sentinels(buffers& b) {
+    audio::envelope env(44100, b.nch);
+    const float att = 2.0f;
+    const float rel = -1.0f;
+    env.envelope_shorts(&b.shorts[0], &b.shorts[0] + b.n, &att, &rel);
+    g_sink = env();
+}
+
+// No floats at all.
+void k_envelope_shorts_fixed(buffers& b) {
+    audio::fixed_envelope env(44100, b.nch);
+    env.envelope_shorts(&b.shorts[0], &b.shorts[0] + b.n);
+    g_sink = env();
+}
+
+// 48k -> 44.1k: downsampling, so the output fits where the input did.
+void k_resample(buffers& b) {
+    audio::resampler rs(48000, 44100, b.nch);
+    const size_t got = rs.process(
+        &b.shorts[0], b.n / (size_t)b.nch, &b.shorts_out[0]);
+    g_sink = (float)b.shorts_out[got / 2];
+}
+
+// Halving first, so there's always a gain to apply: that pass is
+// timed too.
+void k_normalize_buffer(buffers& b) {
+    short* const s = &b.shorts_out[0];
+    audio::simd::scale_shorts(s, s + b.n, 0.5f);
+    g_sink = audio::normalize_buffer(s, s + b.n, b.nch);
+}
+
+void k_reverse_samples(buffers& b) {
+    audio::reverse_samples(&b.shorts_out[0], &b.shorts_out[0] + b.n);
+}
+
+// convert -> envelope -> gain -> convert back, as four whole-buffer
+// passes...
+void k_chain_passes(buffers& b) {
+    float* const f = &b.floats_out[0];
+    audio::simd::shorts_to_floats(&b.shorts[0], &b.shorts[0] + b.n, f);
+    audio::envelope env(44100, b.nch);
+    env.envelope_samples(f, f + b.n);
+    audio::simd::scale_floats(f, f + b.n, 0.5f);
+    audio::simd::floats_to_shorts(f, f + b.n, &b.shorts_out[0], 32768.0f);
+    g_sink = env();
+}
+
+// ...and as one, a tile at a time.
+void k_chain_fused(buffers& b) {
+    audio::envelope env(44100, b.nch);
+    audio::envelope_stage level(env);
+    audio::gain_stage half(0.5f);
+    audio::block_graph g(b.nch);
+    g.add(level).add(half);
+    g.run(&b.shorts[0], &b.shorts[0] + b.n, &b.shorts_out[0]);
+    g_sink = env();
+}
+
+// K-weighting and block energies: the whole meter.
+void k_loudness(buffers& b) {
+    audio::loudness_meter m(44100, b.nch);
+    m.add(&b.shorts[0], &b.shorts[0] + b.n);
+    g_sink = (float)m.momentary();
+}
+
+// Interleaved -> planar, in one go.
+void k_deinterleave(buffers& b) {
+    const size_t frames = b.n / (size_t)b.nch;
+    audio::simd::deinterleave(
+        &b.shorts[0], frames, b.nch, &b.shorts_out[0], frames);
+}
+
+// Frame by frame, channels kept.
+void k_reverse_frames(buffers& b) {
+    audio::reverse_samples(
+        &b.shorts_out[0], &b.shorts_out[0] + b.n, b.nch);
+}
+
+// Pooled: after the first, each one is a buffer back off the free
+// list, zeroed.
+void k_make_buffer(buffers& b) {
+    audio::audio_buffer<short> buf;
+    size_t sz = 0;
+    audio::make_buffer(buf, short(0), sz, 1, (int)(b.n / b.nch), b.nch);
+    g_sink = (float)buf[sz - 1];
+}
+
+struct kernel {
+    const char* name;
+    void (*run)(buffers&);
+};
+
+const kernel g_kernels[] = {
+    { "shorts_to_floats", k_shorts_to_floats },
+    { "floats_to_shorts", k_floats_to_shorts },
+    { "envelope_update", k_envelope_update },
+    { "envelope_shorts", k_envelope_shorts },
+    { "envelope_shorts_sentinels", k_envelope_shorts_sentinels },
+    { "envelope_shorts_fixed", k_envelope_shorts_fixed },
+    { "resample", k_resample },
+    { "normalize_buffer", k_normalize_buffer },
+    { "reverse_samples", k_reverse_samples },
+    { "reverse_frames", k_reverse_frames },
+    { "deinterleave", k_deinterleave },
+    { "chain_passes", k_chain_passes },
+    { "chain_fused", k_chain_fused },
+    { "loudness", k_loudness },
+    { "make_buffer", k_make_buffer },
+};
+
+struct result {
+    string kernel;
+    int nch;
+    size_t frames;
+    double ns_per_frame;
+    double msamples_per_sec;
+
+    // What lines results up with a baseline.
+    string key() const {
+        char buf[64];
+        sprintf(buf, "\t%d\t%lu", nch, (unsigned long)frames);
+        return kernel + buf;
+    }
+};
+
+// Best of 'reps' runs, each of as many calls as take min_secs.
+result measure(const kernel& k, buffers& b, double min_secs, int reps) {
+    k.run(b); // warm: caches, pool, page faults
+    size_t calls = 1;
+    for (;;) {
+        const double t0 = now();
+        for (size_t i = 0; i < calls; ++i) k.run(b);
+        if (now() - t0 >= min_secs / 4 || calls >= ((size_t)1 << 30)) {
+            break;
+        }
+        calls *= 2;
+    }
+    calls *= 4;
+    double best = 1e300;
+    for (int r = 0; r < reps; ++r) {
+        const double t0 = now();
+        for (size_t i = 0; i < calls; ++i) k.run(b);
+        const double t = (now() - t0) / (double)calls;
+        if (t < best) best = t;
+    }
+    result res;
+    res.kernel = k.name;
+    res.nch = b.nch;
+    res.frames = b.n / (size_t)b.nch;
+    res.ns_per_frame = best * 1e9 / (double)res.frames;
+    res.msamples_per_sec = (double)b.n / best / 1e6;
+    return res;
+}
+
+const char* const g_header
+    = "kernel\tchannels\tframes\tns_per_frame\tmsamples_per_sec";
+
+bool write_results(const char* path, const vector<result>& results) {
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "%s\n", g_header);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const result& r = results[i];
+        fprintf(f, "%s\t%d\t%lu\t%.4f\t%.2f\n", r.kernel.c_str(), r.nch,
+            (unsigned long)r.frames, r.ns_per_frame, r.msamples_per_sec);
+    }
+    return fclose(f) == 0;
+}
+
+// key -> ns per frame.
+bool read_results(const char* path, map<string, double>& out) {
+    FILE* f = fopen(path, "r");
+    if (!f) return false;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char name[256];
+        int nch = 0;
+        unsigned long frames = 0;
+        double ns = 0, ms = 0;
+        if (sscanf(line, "%255s %d %lu %lf %lf", name, &nch, &frames, &ns,
+                &ms)
+            != 5) {
+            continue; // the header, or junk
+        }
+        result r;
+        r.kernel = name;
+        r.nch = nch;
+        r.frames = frames;
+        out[r.key()] = ns;
+    }
+    fclose(f);
+    return true;
+}
+
+// Noise, so the envelope has something to do.
+bool make_io_file(const char* path, size_t mb) {
+    audio::wav_file w;
+    const audio::u64_t frames = (audio::u64_t)mb * 1024 * 1024 / 4;
+    if (!w.create(path, 44100, 2, 16, frames)) return false;
+    my::iterator::ptrs<short> s = w.shorts();
+    unsigned int x = 1;
+    for (size_t i = 0; i < s.size(); ++i) {
+        x = x * 1664525u + 1013904223u;
+        s[i] = (short)(x >> 16);
+    }
+    return w.flush();
+}
+
+// Drops the file's pages from the page cache, so the next pass reads
+// the disk and not a copy the last pass left behind.
+bool evict(const char* path) {
+#if defined(_WIN32) || !defined(POSIX_FADV_DONTNEED)
+    (void)path;
+    return false;
+#else
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    fsync(fd); // dirty pages (a file just written) won't go
+    const bool ok = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+int run_io(const char* path, size_t mb) {
+    audio::wav_file w;
+    if (!w.open(path)) {
+        cout << "writing " << mb << "MB to " << path << "\n";
+        if (!make_io_file(path, mb) || !w.open(path)) {
+            cerr << "can't open or create " << path << "\n";
+            return 2;
+        }
+    }
+    if (w.bits_per_sample() != 16
+        || w.format() != audio::wav_file::FORMAT_PCM) {
+        cerr << path << ": not 16-bit PCM\n";
+        return 2;
+    }
+    const int nch = w.channels();
+    const int sr = w.samplerate();
+    const audio::u64_t offset = w.data_offset();
+    const audio::u64_t length = w.data_bytes();
+    w.close();
+
+    const size_t block = audio::block_reader::DEFAULT_BLOCK_BYTES;
+    vector<short> buf(block / sizeof(short));
+    FILE* f = fopen(path, "rb");
+    if (!f) return 2;
+
+    if (!evict(path)) {
+        cerr << "warning: can't drop " << path << " from the page cache:"
+                " the second pass will read it from memory\n";
+    }
+
+    // Sequential: read a block, envelope it, read the next.
+    double t0 = now();
+    double t_read = 0, t_proc = 0;
+    {
+        audio::envelope env(sr, nch);
+        fseek(f, (long)offset, SEEK_SET);
+        audio::u64_t left = length;
+        while (left) {
+            const size_t want = (size_t)my::min((audio::u64_t)block, left);
+            const double a = now();
+            const size_t got = fread(&buf[0], 1, want, f);
+            const double b = now();
+            if (!got) break;
+            env.envelope_shorts(&buf[0], &buf[0] + got / sizeof(short));
+            t_read += b - a;
+            t_proc += now() - b;
+            left -= got;
+        }
+        g_sink = env();
+    }
+    const double t_seq = now() - t0;
+    fclose(f);
+
+    // Overlapped: the same, with the reads on block_reader's thread.
+    // (block_reader's buffers are allocated before the clock starts,
+    // as buf was for the sequential pass.)
+    evict(path);
+    audio::block_reader r(block);
+    t0 = now();
+    audio::u64_t frames = 0;
+    if (r.open(path, offset, length)) {
+        audio::envelope env(sr, nch);
+        frames = audio::envelope_reader(env, r);
+        g_sink = env();
+    }
+    const double t_async = now() - t0;
+    if (*r.error()) {
+        cerr << path << ": " << r.error() << "\n";
+        return 2;
+    }
+    const audio::reader_stats st = r.stats();
+
+    // At best the overlap hides the shorter of reading and
+    // processing. When that's a few ms, the difference is noise.
+    const double hideable = my::min(t_read, t_proc);
+    const double eff = hideable > 0 ? (t_seq - t_async) / hideable : -1;
+    const bool measurable = hideable >= 0.005 && eff >= 0 && eff <= 1;
+    printf("%lu frames, %d channels, %.1f MB\n", (unsigned long)frames,
+        nch, (double)length / 1e6);
+    printf("sequential\t%.3f s (read %.3f s, process %.3f s)\n", t_seq,
+        t_read, t_proc);
+    printf("overlapped\t%.3f s (reader: read %.3f s, waited on full "
+           "buffers %.3f s; consumer waited %.3f s)\n",
+        t_async, st.read_secs, st.full_secs, st.wait_secs);
+    if (measurable) {
+        printf("overlap efficiency\t%.0f%%\n", eff * 100.0);
+    } else {
+        printf("overlap efficiency\tn/a (reads too short to measure)\n");
+    }
+    return 0;
+}
+
+void usage() {
+    cerr << "usage: cpp98audio_bench [--quick] [--simd scalar|sse2|avx2]"
+            " [--only <kernel>]\n"
+            "       [--out <results.tsv>] [--baseline <results.tsv>]"
+            " [--tolerance <fraction>]\n"
+            "       cpp98audio_bench --io <file.wav> [--mb <size>]\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool quick = false;
+    const char* only = NULL;
+    const char* out_path = NULL;
+    const char* baseline_path = NULL;
+    double tolerance = 0.15;
+    const char* io_path = NULL;
+    size_t io_mb = 256;
+
+    for (int i = 1; i < argc; ++i) {
+        const string a = argv[i];
+        const bool more = i + 1 < argc;
+        if (a == "--quick") {
+            quick = true;
+        } else if (a == "--only" && more) {
+            only = argv[++i];
+        } else if (a == "--out" && more) {
+            out_path = argv[++i];
+        } else if (a == "--baseline" && more) {
+            baseline_path = argv[++i];
+        } else if (a == "--tolerance" && more) {
+            tolerance = atof(argv[++i]);
+        } else if (a == "--io" && more) {
+            io_path = argv[++i];
+        } else if (a == "--mb" && more) {
+            io_mb = (size_t)atol(argv[++i]);
+        } else if (a == "--simd" && more) {
+            const string s = argv[++i];
+            const int level = s == "scalar" ? audio::simd::SIMD_SCALAR
+                : s == "sse2"               ? audio::simd::SIMD_SSE2
+                : s == "avx2"               ? audio::simd::SIMD_AVX2
+                                            : -1;
+            if (level < 0) {
+                usage();
+                return 2;
+            }
+            audio::simd::set_simd_level(level);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (io_path) return run_io(io_path, io_mb ? io_mb : 1);
+
+    // In samples: 2K shorts is 4KB (floats 8KB), at home in L1; 16M
+    // is 32MB of shorts and 64MB of floats, beyond any LLC.
+    const size_t sizes[] = { (size_t)2 << 10, (size_t)32 << 10,
+        (size_t)1 << 20, (size_t)16 << 20 };
+    const int channels[] = { 1, 2, 8 };
+    const size_t nsizes = quick ? 3 : 4;
+    const double min_secs = quick ? 0.01 : 0.1;
+    const int reps = quick ? 3 : 5;
+
+    buffers b(sizes[nsizes - 1]);
+    const char* const levels[] = { "scalar", "sse2", "avx2" };
+    cout << "simd: " << levels[audio::simd::simd_level()] << "\n";
+    cout << g_header << "\n";
+
+    vector<result> results;
+    const size_t nkernels = sizeof(g_kernels) / sizeof(g_kernels[0]);
+    for (size_t k = 0; k < nkernels; ++k) {
+        if (only && strcmp(only, g_kernels[k].name) != 0) continue;
+        for (size_t s = 0; s < nsizes; ++s) {
+            for (size_t c = 0; c < sizeof(channels) / sizeof(int); ++c) {
+                b.nch = channels[c];
+                b.n = sizes[s] - sizes[s] % (size_t)b.nch;
+                const result r = measure(g_kernels[k], b, min_secs, reps);
+                results.push_back(r);
+                printf("%s\t%d\t%lu\t%.4f\t%.2f\n", r.kernel.c_str(), r.nch,
+                    (unsigned long)r.frames, r.ns_per_frame,
+                    r.msamples_per_sec);
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (out_path && !write_results(out_path, results)) {
+        cerr << "can't write " << out_path << "\n";
+        return 2;
+    }
+
+    if (baseline_path) {
+        map<string, double> base;
+        if (!read_results(baseline_path, base)) {
+            cerr << "can't read " << baseline_path << "\n";
+            return 2;
+        }
+        int slower = 0;
+        for (size_t i = 0; i < results.size(); ++i) {
+            const result& r = results[i];
+            const map<string, double>::const_iterator it
+                = base.find(r.key());
+            if (it == base.end() || it->second <= 0) continue;
+            const double change = r.ns_per_frame / it->second - 1.0;
+            if (change > tolerance) {
+                printf("REGRESSION %s\t%d\t%lu\t%.4f -> %.4f ns/frame "
+                       "(+%.0f%%)\n",
+                    r.kernel.c_str(), r.nch, (unsigned long)r.frames,
+                    it->second, r.ns_per_frame, change * 100.0);
+                ++slower;
+            }
+        }
+        printf("%d of %lu slower than the baseline by more than %.0f%%\n",
+            slower, (unsigned long)results.size(), tolerance * 100.0);
+        if (slower) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG -= qt
+CONFIG += release
+
+QMAKE_CXXFLAGS +=   -std=c++98
+unix:LIBS += -lpthread -lrt
+
+
+SOURCES += \
+    cpp98audio_bench.cpp
+
+HEADERS += \
+    ../include/cpp_98_audio_envelope.hpp \
+    ../include/cpp_98_audio_fixed.hpp \
+    ../include/cpp_98_audio_simd.hpp \
+    ../include/cpp_98_audio_buffer.hpp \
+    ../include/cpp_98_audio_thread.hpp \
+    ../include/cpp_98_audio_dynamics.hpp \
+    ../include/cpp_98_audio_wav.hpp \
+    ../include/cpp_98_audio_resample.hpp \
+    ../include/cpp_98_audio_frames.hpp \
+    ../include/cpp_98_audio_graph.hpp \
+    ../include/cpp_98_audio_reader.hpp \
+    ../include/cpp_98_audio_loudness.hpp \
+    ../include/my_iterator.h
@@ -1,5 +1,20 @@
 #include <iostream>
+#include "../include/cpp_98_audio_buffer.hpp"
+#include "../include/cpp_98_audio_dynamics.hpp"
 #include "../include/cpp_98_audio_envelope.hpp"
+#include "../include/cpp_98_audio_envelope_bank.hpp"
+#include "../include/cpp_98_audio_fixed.hpp"
+#include "../include/cpp_98_audio_frames.hpp"
+#include "../include/cpp_98_audio_graph.hpp"
+#include "../include/cpp_98_audio_overview.hpp"
+#include "../include/cpp_98_audio_parallel.hpp"
+#include "../include/cpp_98_audio_loudness.hpp"
+#include "../include/cpp_98_audio_reader.hpp"
+#include "../include/cpp_98_audio_ring.hpp"
+#include "../include/cpp_98_audio_resample.hpp"
+#include "../include/cpp_98_audio_rms.hpp"
+#include "../include/cpp_98_audio_segment.hpp"
+#include "../include/cpp_98_audio_wav.hpp"
 using namespace std;
 
 void check_release_accuracy(
@@ -65,42 +80,36 @@ int main() {
     const size_t sz = samplerate * secs * nch;
     size_t actual_sz = 0;
 
-    short* const shortbuf = my::cpp98::audio::make_buffer(
-        short(0), actual_sz, 30);
+    my::cpp98::audio::audio_buffer<short> shorts;
+    my::cpp98::audio::make_buffer(shorts, short(0), actual_sz, 30);
     assert(actual_sz == sz);
+    short* const shortbuf = shorts.data();
 
-    float* const floatbuf = my::cpp98::audio::make_buffer(
-        float(0), actual_sz, 30);
+    my::cpp98::audio::audio_buffer<float> floats;
+    my::cpp98::audio::make_buffer(floats, float(0), actual_sz, 30);
 
     short* shortbuf_raw = const_cast<short*>(shortbuf);
     short* shortbuf_raw_end
         = const_cast<short*>(shortbuf + sz);
 
-    std::fill(shortbuf_raw, shortbuf_raw_end, 0);
-
-    typedef my::cpp98::audio::envelope::history_t hist_t;
-    typedef hist_t::const_iterator hist_it;
+    typedef my::cpp98::audio::envelope_history hist_t;
 
     my::cpp98::audio::envelope env(44100, 2, 20.0, 500.0);
-    hist_t& history = env.history();
-    history.resize(sz);
+    env.set_history(1024, 4096);
     env.envelope_shorts(shortbuf, shortbuf + sz);
     float env_value = env();
     assert(my::float_equal(env_value, 0.0f));
     env.envelope_shorts(shortbuf, shortbuf + sz);
 
-    const hist_t& hist = env.history_const();
-    hist_it hit
-        = std::max_element(hist.begin(), hist.end());
-    assert(my::float_equal(*hit, 0.0f)
-        && (hit == hist.begin()));
-
-    my::cpp98::audio::floats_to_shorts(hist.begin(),
-        hist.end(), shortbuf_raw, shortbuf_raw_end, nch);
+    const hist_t& hist = env.history();
+    assert(hist.total_blocks() == 2 * sz / nch / 1024);
+    for (size_t i = 0; i < hist.size(); ++i) {
+        assert(my::float_equal(hist[i].hi, 0.0f));
+    }
 
-    hit = std::max_element(hist.begin(), hist.end());
-    assert(
-        my::float_equal(*hit, 0.0f) && hit == hist.begin());
+    my::cpp98::audio::floats_to_shorts(floats.begin(),
+        floats.end(), shortbuf_raw, shortbuf_raw_end, nch);
+    assert(*std::max_element(shortbuf_raw, shortbuf_raw_end) == 0);
 
     my::cpp98::audio::test::reverse_vector();
     my::cpp98::audio::test::reverse_array(
@@ -113,9 +122,33 @@ int main() {
     check_attack_accuracy(
         const_cast<short* const>(shortbuf),
         shortbuf + actual_sz);
-
-    delete[] shortbuf;
-    delete[] floatbuf;
+    my::cpp98::audio::test::check_simd_conversions_bit_exact();
+    my::iterator::test::check_ptrs_iterators();
+    my::cpp98::audio::test::check_frame_views();
+    my::cpp98::audio::test::check_envelope_bank();
+    my::cpp98::audio::test::check_channel_specializations();
+    my::cpp98::audio::test::check_envelope_modes();
+    my::cpp98::audio::test::check_silence_fast_forward();
+    my::cpp98::audio::test::check_envelope_history();
+    my::cpp98::audio::test::check_envelope_stats();
+    my::cpp98::audio::test::check_fixed_envelope();
+    my::cpp98::audio::test::check_resampler();
+    my::cpp98::audio::test::check_rms_envelope();
+    my::cpp98::audio::test::check_dynamics();
+    my::cpp98::audio::test::check_block_graph();
+    my::cpp98::audio::test::check_loudness();
+    my::cpp98::audio::test::check_segmenter();
+    my::cpp98::audio::test::check_spsc_ring();
+    my::cpp98::audio::test::check_parallel_envelope();
+    my::cpp98::audio::test::check_normalize_buffer();
+    my::cpp98::audio::test::check_parallel_normalize();
+    my::cpp98::audio::test::check_buffer_pool();
+    my::cpp98::audio::test::check_wav_file("cpp98audio_test.wav");
+    my::cpp98::audio::test::check_block_reader("cpp98audio_test.wav");
+    my::cpp98::audio::test::check_overview("cpp98audio_test.wav");
+    my::cpp98::audio::test::check_streaming_matches_whole(
+        const_cast<short* const>(shortbuf),
+        shortbuf + actual_sz);
 
     return 0;
 }
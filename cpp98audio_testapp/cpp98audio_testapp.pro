@@ -4,11 +4,30 @@ CONFIG -= app_bundle
 CONFIG -= qt
 
 QMAKE_CXXFLAGS +=   -std=c++98
+unix:LIBS += -lpthread
 
 
 SOURCES += \
     cpp98audio_test.cpp
 
 HEADERS += \
-    ../include/cpp_98_audio_envelope.hpp
+    ../include/cpp_98_audio_envelope.hpp \
+    ../include/cpp_98_audio_simd.hpp \
+    ../include/cpp_98_audio_envelope_bank.hpp \
+    ../include/cpp_98_audio_thread.hpp \
+    ../include/cpp_98_audio_parallel.hpp \
+    ../include/cpp_98_audio_wav.hpp \
+    ../include/cpp_98_audio_buffer.hpp \
+    ../include/cpp_98_audio_history.hpp \
+    ../include/cpp_98_audio_overview.hpp \
+    ../include/cpp_98_audio_segment.hpp \
+    ../include/cpp_98_audio_ring.hpp \
+    ../include/cpp_98_audio_dynamics.hpp \
+    ../include/cpp_98_audio_rms.hpp \
+    ../include/cpp_98_audio_fixed.hpp \
+    ../include/cpp_98_audio_resample.hpp \
+    ../include/cpp_98_audio_frames.hpp \
+    ../include/cpp_98_audio_graph.hpp \
+    ../include/cpp_98_audio_reader.hpp \
+    ../include/cpp_98_audio_loudness.hpp
 
@@ -0,0 +1,386 @@
+/*/
+ * Audio buffers from a pool: 64-byte aligned (a cache line, and as much
+ * as any SIMD load wants), recycled rather than freed, and zeroed for
+ * free where the OS allows.
+ *
+ * Batch jobs that make and drop thousands of same-sized buffers a minute
+ * pay for it three times over with new[] / delete[]: the allocator, the
+ * page faults on fresh memory, and the std::fill that zeroes it. Here:
+ *
+ *  - a released buffer goes on a free list keyed by its (rounded) size,
+ *    and the next request for that size gets it back;
+ *  - big buffers (MAP_THRESHOLD and up) come straight from the OS
+ *    (mmap / VirtualAlloc), which hands out zero pages. Asking for one
+ *    zero-filled costs nothing at all when it's new, and when it's
+ *    recycled its pages are given back to the OS (MADV_DONTNEED /
+ *    MEM_DECOMMIT) to come back as zero pages when touched, rather than
+ *    written to;
+ *  - small ones are aligned heap blocks, memset as usual.
+ *
+ * audio_buffer<T> owns one, and gives it back to its pool when it goes:
+ *
+    my::cpp98::audio::audio_buffer<short> buf;
+    size_t n = 0;
+    my::cpp98::audio::make_buffer(buf, short(0), n, 30);
+    env.envelope_shorts(buf.begin(), buf.end());
+    // no delete[]
+ *
+ * The pool must outlive its buffers. default_buffer_pool() lives until
+ * the program ends. Pools are thread-safe.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_BUFFER_HPP
+#define CPP_98_AUDIO_BUFFER_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "cpp_98_audio_thread.hpp"
+#include "my_iterator.h"
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        class buffer_pool {
+            public:
+            enum {
+                ALIGNMENT = 64,
+                // From here up, buffers are whole pages from the OS.
+                MAP_THRESHOLD = 128 * 1024,
+                PAGE_ROUNDING = 4096
+            };
+
+            struct stats_t {
+                size_t allocations; // got from the OS / heap
+                size_t reuses; // handed back out from the free list
+                size_t cached_bytes; // sitting on the free lists now
+            };
+
+            // Keeps at most max_cached_bytes on its free lists; beyond
+            // that, released buffers are really freed.
+            explicit buffer_pool(size_t max_cached_bytes = 256 * 1024 * 1024)
+                : m_max_cached(max_cached_bytes)
+                , m_cached(0)
+                , m_allocations(0)
+                , m_reuses(0) {}
+
+            ~buffer_pool() { trim(); }
+
+            // A block of at least bytes bytes, ALIGNMENT-aligned. If
+            // zero_fill, every byte of it reads as 0.
+            inline void* acquire(size_t bytes, bool zero_fill) {
+                const size_t sz = rounded(bytes);
+                void* p = NULL;
+                {
+                    threads::scoped_lock lock(m_mutex);
+                    free_map_t::iterator it = m_free.find(sz);
+                    if (it != m_free.end() && !it->second.empty()) {
+                        p = it->second.back();
+                        it->second.pop_back();
+                        m_cached -= sz;
+                        ++m_reuses;
+                    } else {
+                        ++m_allocations;
+                    }
+                }
+                if (p) {
+                    if (zero_fill) rezero(p, sz);
+                    return p;
+                }
+                p = allocate(sz);
+                if (p && zero_fill && !is_mapped(sz)) memset(p, 0, sz);
+                return p;
+            }
+
+            // Gives back a block from acquire(bytes, ...).
+            inline void release(void* p, size_t bytes) {
+                if (!p) return;
+                const size_t sz = rounded(bytes);
+                {
+                    threads::scoped_lock lock(m_mutex);
+                    if (m_cached + sz <= m_max_cached) {
+                        m_free[sz].push_back(p);
+                        m_cached += sz;
+                        return;
+                    }
+                }
+                deallocate(p, sz);
+            }
+
+            // Frees everything on the free lists.
+            inline void trim() {
+                threads::scoped_lock lock(m_mutex);
+                for (free_map_t::iterator it = m_free.begin();
+                     it != m_free.end(); ++it) {
+                    for (size_t i = 0; i < it->second.size(); ++i) {
+                        deallocate(it->second[i], it->first);
+                    }
+                }
+                m_free.clear();
+                m_cached = 0;
+            }
+
+            inline stats_t stats() {
+                threads::scoped_lock lock(m_mutex);
+                stats_t s;
+                s.allocations = m_allocations;
+                s.reuses = m_reuses;
+                s.cached_bytes = m_cached;
+                return s;
+            }
+
+            private:
+            typedef std::map<size_t, std::vector<void*> > free_map_t;
+
+            buffer_pool(const buffer_pool&);
+            buffer_pool& operator=(const buffer_pool&);
+
+            // Sizes are rounded up so that near-enough requests share
+            // a free list: to the alignment when small, pages when big.
+            static inline size_t rounded(size_t bytes) {
+                if (bytes == 0) bytes = 1;
+                const size_t r = is_mapped(bytes) ? (size_t)PAGE_ROUNDING
+                                                  : (size_t)ALIGNMENT;
+                return (bytes + r - 1) / r * r;
+            }
+
+            static inline bool is_mapped(size_t sz) {
+                return sz >= (size_t)MAP_THRESHOLD;
+            }
+
+            static inline void* allocate(size_t sz) {
+                void* p = NULL;
+#if defined(_WIN32)
+                if (is_mapped(sz)) {
+                    p = VirtualAlloc(
+                        NULL, sz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+                } else {
+                    p = _aligned_malloc(sz, ALIGNMENT);
+                }
+#else
+                if (is_mapped(sz)) {
+                    p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if (p == MAP_FAILED) p = NULL;
+                } else if (posix_memalign(&p, ALIGNMENT, sz) != 0) {
+                    p = NULL;
+                }
+#endif
+                return p;
+            }
+
+            static inline void deallocate(void* p, size_t sz) {
+#if defined(_WIN32)
+                if (is_mapped(sz)) {
+                    VirtualFree(p, 0, MEM_RELEASE);
+                } else {
+                    _aligned_free(p);
+                }
+#else
+                if (is_mapped(sz)) {
+                    munmap(p, sz);
+                } else {
+                    free(p);
+                }
+#endif
+            }
+
+            // Zeroes a recycled block: by handing its pages back (they
+            // then fault back in as zero pages) when it's big enough
+            // to have pages of its own, else by writing zeroes.
+            static inline void rezero(void* p, size_t sz) {
+                if (is_mapped(sz)) {
+#if defined(_WIN32)
+                    if (VirtualFree(p, sz, MEM_DECOMMIT)
+                        && VirtualAlloc(p, sz, MEM_COMMIT, PAGE_READWRITE)) {
+                        return;
+                    }
+#elif defined(__linux__)
+                    // Linux (only) guarantees zero pages after this, for
+                    // private anonymous memory.
+                    if (madvise(p, sz, MADV_DONTNEED) == 0) return;
+#endif
+                }
+                memset(p, 0, sz);
+            }
+
+            threads::mutex m_mutex;
+            free_map_t m_free;
+            size_t m_max_cached;
+            size_t m_cached;
+            size_t m_allocations;
+            size_t m_reuses;
+        };
+
+        // The pool audio_buffer uses unless told otherwise.
+        inline buffer_pool& default_buffer_pool() {
+            static buffer_pool pool;
+            return pool;
+        }
+
+        // Owns a pooled, aligned array of T, and gives it back on
+        // destruction. Not copyable: swap() them, or release() one.
+        template <typename T> class audio_buffer {
+            public:
+            typedef T value_type;
+            typedef T* iterator;
+            typedef const T* const_iterator;
+
+            explicit audio_buffer(buffer_pool& pool = default_buffer_pool())
+                : m_pool(&pool), m_data(NULL), m_size(0) {}
+
+            audio_buffer(size_t n, const T fill_with,
+                buffer_pool& pool = default_buffer_pool())
+                : m_pool(&pool), m_data(NULL), m_size(0) {
+                reset(n, fill_with);
+            }
+
+            ~audio_buffer() { reset(); }
+
+            // n elements, all fill_with. A zero fill is free for big
+            // buffers (see top of file). The old contents are gone.
+            inline void reset(size_t n, const T fill_with) {
+                reset();
+                if (n == 0) return;
+                const bool zero = is_zero(fill_with);
+                m_data = static_cast<T*>(m_pool->acquire(n * sizeof(T), zero));
+                assert(m_data);
+                m_size = m_data ? n : 0;
+                if (!zero) std::fill(m_data, m_data + m_size, fill_with);
+            }
+
+            // Back to empty; the memory goes back to the pool.
+            inline void reset() {
+                if (m_data) m_pool->release(m_data, m_size * sizeof(T));
+                m_data = NULL;
+                m_size = 0;
+            }
+
+            // Gives up ownership without freeing: hand the result back
+            // with pool().release(p, size * sizeof(T)).
+            inline T* release() {
+                T* p = m_data;
+                m_data = NULL;
+                m_size = 0;
+                return p;
+            }
+
+            inline void swap(audio_buffer& other) {
+                std::swap(m_pool, other.m_pool);
+                std::swap(m_data, other.m_data);
+                std::swap(m_size, other.m_size);
+            }
+
+            inline T* data() { return m_data; }
+            inline const T* data() const { return m_data; }
+            inline size_t size() const { return m_size; }
+            inline bool empty() const { return m_size == 0; }
+            inline buffer_pool& pool() const { return *m_pool; }
+
+            inline T* begin() { return m_data; }
+            inline T* end() { return m_data + m_size; }
+            inline const T* begin() const { return m_data; }
+            inline const T* end() const { return m_data + m_size; }
+
+            inline T& operator[](size_t i) { return m_data[i]; }
+            inline const T& operator[](size_t i) const { return m_data[i]; }
+
+            inline my::iterator::ptrs<T> ptrs() {
+                return my::iterator::ptrs<T>(m_data, m_data + m_size);
+            }
+
+            private:
+            audio_buffer(const audio_buffer&);
+            audio_buffer& operator=(const audio_buffer&);
+
+            // All bits zero (so -0.0f isn't, which is what we want).
+            static inline bool is_zero(const T& v) {
+                const unsigned char* p
+                    = reinterpret_cast<const unsigned char*>(&v);
+                for (size_t i = 0; i < sizeof(T); ++i) {
+                    if (p[i]) return false;
+                }
+                return true;
+            }
+
+            buffer_pool* m_pool;
+            T* m_data;
+            size_t m_size;
+        };
+
+        // make_buffer(), into a pooled buffer.
+        template <typename T>
+        inline void make_buffer(audio_buffer<T>& buf, const T fill_with,
+            size_t& actual_sz, const int nsecs, const int samplerate = 44100,
+            const int nch = 2) {
+
+            actual_sz = size_t(samplerate * nch * nsecs);
+            buf.reset(actual_sz, fill_with);
+        }
+
+        namespace test {
+
+            // Alignment, fills, and that freed buffers come back, zeroed
+            // when asked for, whichever way they were zeroed.
+            inline void check_buffer_pool() {
+                buffer_pool pool;
+                const size_t small_n = 1000;
+                const size_t big_n = 44100 * 2 * 5;
+                short* first_big = NULL;
+                for (int round = 0; round < 3; ++round) {
+                    audio_buffer<short> big(big_n, short(0), pool);
+                    audio_buffer<float> small(small_n, 0.5f, pool);
+                    assert(big.size() == big_n && small.size() == small_n);
+                    assert(((size_t)big.data() % buffer_pool::ALIGNMENT) == 0);
+                    assert(
+                        ((size_t)small.data() % buffer_pool::ALIGNMENT) == 0);
+                    if (round == 0) first_big = big.data();
+                    assert(big.data() == first_big);
+                    for (size_t i = 0; i < big_n; i += 997) {
+                        assert(big[i] == 0);
+                    }
+                    assert(big[big_n - 1] == 0);
+                    for (size_t i = 0; i < small_n; ++i) {
+                        assert(small[i] == 0.5f);
+                    }
+                    // dirty them, for the next round to clean up
+                    std::fill(big.begin(), big.end(), (short)1234);
+                    small.reset(small_n, 0.0f);
+                    assert(*std::max_element(small.begin(), small.end())
+                        == 0.0f);
+                    std::fill(small.begin(), small.end(), 7.0f);
+                }
+                const buffer_pool::stats_t s = pool.stats();
+                assert(s.allocations == 2 && s.reuses == 7);
+                assert(s.cached_bytes > 0);
+                pool.trim();
+                assert(pool.stats().cached_bytes == 0);
+
+                audio_buffer<short> a(100, short(3), pool);
+                audio_buffer<short> b(pool);
+                a.swap(b);
+                assert(a.empty() && b.size() == 100 && b[99] == 3);
+                (void)s;
+                (void)first_big;
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_BUFFER_HPP
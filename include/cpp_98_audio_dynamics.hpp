@@ -0,0 +1,418 @@
+/*/
+ * A compressor, and a brickwall limiter that looks ahead, working in
+ * place on interleaved shorts or floats.
+ *
+ * Both turn the level down when it goes over a threshold: the
+ * compressor by a ratio (4:1 lets 1dB out for every 4dB in over the
+ * threshold), the limiter all the way, so nothing gets out above it.
+ *
+ * To see a peak coming, the audio is delayed by lookahead_ms (that's
+ * latency(), in frames) while the level is taken from what's just come
+ * in: the highest peak over the lookahead, from a sliding maximum (a
+ * deque of falling peaks, so each frame costs a push and the odd pop,
+ * however long the window). The delay line is a ring too, so nothing
+ * is moved along it: a frame costs the same whatever the lookahead.
+ * The target gain comes from that maximum, and is worked out again
+ * only when it changes, which is seldom: a peak holds it for the
+ * whole lookahead. The gain follows the target
+ * frame by frame, falling at the attack rate and rising at the release
+ * rate, just as an envelope does. The limiter's attack is a fifth of
+ * its lookahead, so the gain is down (to within 1%) before the peak
+ * gets there. What's left over is caught by the final clamp at the
+ * ceiling: nothing gets over it.
+ *
+ * The gains go out to every sample of the frame, and one SIMD pass
+ * multiplies, clamps and (for shorts) converts back, straight into the
+ * caller's buffer: no floats_to_shorts() pass after. How the stream is
+ * chunked into process() calls makes no difference to what comes out.
+ *
+    my::cpp98::audio::dynamics lim(44100, 2,
+        my::cpp98::audio::dynamics_settings::limiter(0.9f));
+    lim.process(buf.begin(), buf.end()); // latency() frames late
+ *
+ * Below the threshold (and with no makeup gain), shorts come out
+ * exactly as they went in, latency() frames later.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_DYNAMICS_HPP
+#define CPP_98_AUDIO_DYNAMICS_HPP
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "cpp_98_audio_buffer.hpp"
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        struct dynamics_settings {
+            enum mode_t { COMPRESSOR, LIMITER };
+
+            // A brickwall limiter: nothing gets out above ceiling (of
+            // full scale).
+            static dynamics_settings limiter(float ceiling = 0.98f,
+                float release_ms = 100.0f, float lookahead_ms = 5.0f) {
+                dynamics_settings s;
+                s.mode = LIMITER;
+                s.threshold = ceiling;
+                s.ratio = 0;
+                s.attack_ms = lookahead_ms / 5.0f;
+                s.release_ms = release_ms;
+                s.lookahead_ms = lookahead_ms;
+                s.makeup = 1.0f;
+                return s;
+            }
+
+            static dynamics_settings compressor(float threshold,
+                float ratio, float attack_ms = 10.0f,
+                float release_ms = 100.0f, float lookahead_ms = 0.0f,
+                float makeup = 1.0f) {
+                dynamics_settings s;
+                s.mode = COMPRESSOR;
+                s.threshold = threshold;
+                s.ratio = ratio;
+                s.attack_ms = attack_ms;
+                s.release_ms = release_ms;
+                s.lookahead_ms = lookahead_ms;
+                s.makeup = makeup;
+                return s;
+            }
+
+            mode_t mode;
+            float threshold; // of full scale: the limiter's ceiling
+            float ratio; // compressor only: 4 is 4:1
+            float attack_ms;
+            float release_ms;
+            float lookahead_ms;
+            float makeup; // gain after, compressor only
+        };
+
+        class dynamics {
+            public:
+            enum { TILE = 256 }; // frames per pass
+
+            dynamics(int samplerate, int nch, const dynamics_settings& s)
+                : m_nch(nch), m_settings(s) {
+                assert(nch > 0 && samplerate > 0);
+                assert(s.threshold > 0);
+                assert(s.mode == dynamics_settings::LIMITER || s.ratio >= 1);
+                m_latency = (size_t)((double)s.lookahead_ms
+                        * (double)samplerate / 1000.0
+                    + 0.5);
+                m_ga = envelope::time_coef(
+                    (float)samplerate, my::max(s.attack_ms, 0.001f));
+                m_gr = envelope::time_coef(
+                    (float)samplerate, my::max(s.release_ms, 0.001f));
+                if (s.mode == dynamics_settings::LIMITER) {
+                    m_settings.makeup = 1.0f;
+                    m_exponent = 1.0;
+                } else {
+                    m_exponent = 1.0 - 1.0 / (double)s.ratio;
+                }
+                const size_t n = (size_t)nch;
+                m_buf.reset((m_latency + TILE) * n, 0.0f);
+                m_gains.reset(TILE * n, 0.0f);
+                m_peaks.resize(m_latency + 1);
+                reset();
+            }
+
+            // Back to silence: the delay line empties, and the gain
+            // goes back to the makeup gain.
+            inline void reset() {
+                std::fill(m_buf.begin(), m_buf.end(), 0.0f);
+                m_pos = 0;
+                m_gain = m_settings.makeup;
+                m_frame = 0;
+                m_head = m_count = 0;
+                m_level = 0;
+                m_target = m_settings.makeup;
+            }
+
+            // How many frames late the audio comes out.
+            inline size_t latency() const { return m_latency; }
+            inline int channels() const { return m_nch; }
+            // The gain the last frame got.
+            inline float gain() const { return m_gain; }
+            inline const dynamics_settings& settings() const {
+                return m_settings;
+            }
+
+            // In place, whole frames.
+            inline void process(short* begin, short* end) {
+                if (limiter()) {
+                    const float hi
+                        = my::min(m_settings.threshold * 32768.0f, 32767.0f);
+                    run(begin, end, 32768.0f, -hi, hi);
+                } else {
+                    run(begin, end, 32768.0f, -32768.0f, 32767.0f);
+                }
+            }
+
+            inline void process(float* begin, float* end) {
+                const float hi = limiter() ? m_settings.threshold : 1e30f;
+                run(begin, end, 1.0f, -hi, hi);
+            }
+
+            private:
+            inline bool limiter() const {
+                return m_settings.mode == dynamics_settings::LIMITER;
+            }
+
+            struct peak {
+                u64_t frame;
+                float level;
+            };
+
+            static inline void load(
+                const short* s, const short* e, float* d) {
+                simd::shorts_to_floats(s, e, d);
+            }
+            static inline void load(
+                const float* s, const float* e, float* d) {
+                memcpy(d, s, (size_t)(e - s) * sizeof(float));
+            }
+
+            template <typename T>
+            inline void run(T* begin, T* const end, const float scale,
+                const float lo, const float hi) {
+                const size_t nch = (size_t)m_nch;
+                assert((size_t)(end - begin) % nch == 0);
+                float* const ring = m_buf.data();
+                const size_t cap = m_buf.size() / nch; // frames
+                float* const g = m_gains.data();
+                while (begin < end) {
+                    const size_t n = my::min(
+                        (size_t)(end - begin) / nch, (size_t)TILE);
+                    // in: behind the latency() frames still to go out
+                    // (cap is latency() + TILE: there's always room)
+                    const size_t in = (m_pos + m_latency) % cap;
+                    size_t n1 = my::min(n, cap - in);
+                    load(begin, begin + n1 * nch, ring + in * nch);
+                    gains(ring + in * nch, n1, g);
+                    if (n1 < n) {
+                        load(begin + n1 * nch, begin + n * nch, ring);
+                        gains(ring, n - n1, g + n1 * nch);
+                    }
+                    // out: the oldest n, wrapping round the same way
+                    n1 = my::min(n, cap - m_pos);
+                    simd::apply_gains(ring + m_pos * nch,
+                        ring + (m_pos + n1) * nch, g, scale, lo, hi, begin);
+                    if (n1 < n) {
+                        simd::apply_gains(ring, ring + (n - n1) * nch,
+                            g + n1 * nch, scale, lo, hi, begin + n1 * nch);
+                    }
+                    m_pos = (m_pos + n) % cap;
+                    begin += n * nch;
+                }
+            }
+
+            // n frames just in (at 'in'); gains for the n frames going
+            // out.
+            inline void gains(const float* in, const size_t n,
+                float* out) {
+                const size_t nch = (size_t)m_nch;
+                float g = m_gain;
+                for (size_t j = 0; j < n; ++j) {
+                    float p = 0;
+                    for (size_t c = 0; c < nch; ++c) {
+                        const float x = std::fabs(*in++);
+                        if (x > p) p = x;
+                    }
+                    push(p);
+                    const float level = m_peaks[m_head].level;
+                    if (level != m_level) {
+                        m_level = level;
+                        m_target = target_gain(level);
+                    }
+                    const float k = m_target < g ? m_ga : m_gr;
+                    g = m_target + k * (g - m_target);
+                    for (size_t c = 0; c < nch; ++c) *out++ = g;
+                }
+                m_gain = g;
+            }
+
+            // The sliding maximum over the last latency() + 1 frames
+            // (the one going out, and those behind it): a ring of
+            // peaks, each lower than the one before.
+            inline void push(const float level) {
+                const size_t cap = m_peaks.size();
+                // out of the window once this frame's in
+                while (m_count && m_peaks[m_head].frame + (cap - 1) < m_frame) {
+                    m_head = (m_head + 1) % cap;
+                    --m_count;
+                }
+                while (m_count
+                    && m_peaks[(m_head + m_count - 1) % cap].level <= level) {
+                    --m_count;
+                }
+                peak& p = m_peaks[(m_head + m_count) % cap];
+                p.frame = m_frame++;
+                p.level = level;
+                ++m_count;
+            }
+
+            inline float target_gain(const float level) const {
+                const float t = m_settings.threshold;
+                if (level <= t) return m_settings.makeup;
+                const double g = m_exponent == 1.0
+                    ? (double)t / (double)level
+                    : pow((double)t / (double)level, m_exponent);
+                return (float)g * m_settings.makeup;
+            }
+
+            int m_nch;
+            dynamics_settings m_settings;
+            size_t m_latency;
+            float m_ga, m_gr;
+            double m_exponent;
+            float m_gain;
+            float m_level, m_target; // the maximum, and its gain
+            // the delay line: a ring of latency() + TILE frames, the
+            // oldest (next out) at m_pos
+            audio_buffer<float> m_buf;
+            size_t m_pos;
+            audio_buffer<float> m_gains;
+            std::vector<peak> m_peaks;
+            size_t m_head, m_count;
+            u64_t m_frame;
+
+            dynamics(const dynamics&);
+            dynamics& operator=(const dynamics&);
+        };
+
+        namespace test {
+
+            inline void check_dynamics() {
+                const int nch = 2;
+                const int sr = 44100;
+                // quiet, then loud noise, then a tone
+                std::vector<short> in(sr * nch);
+                unsigned int seed = 1234;
+                for (size_t i = 0; i < in.size(); ++i) {
+                    seed = seed * 1103515245u + 12345u;
+                    const short r = (short)(seed >> 16);
+                    if (i < in.size() / 4) {
+                        in[i] = (short)(r >> 6);
+                    } else if (i < in.size() / 2) {
+                        in[i] = r;
+                    } else {
+                        in[i] = (short)(20000.0
+                            * sin((double)(i / nch) * 0.05));
+                    }
+                }
+
+                // Below the threshold: delayed, and otherwise untouched.
+                {
+                    dynamics d(sr, nch,
+                        dynamics_settings::compressor(
+                            0.99f, 4.0f, 1.0f, 50.0f, 2.0f));
+                    std::vector<short> q(in.begin(), in.begin() + 8000);
+                    d.process(&q[0], &q[0] + q.size());
+                    const size_t lat = d.latency() * nch;
+                    assert(lat == 88 * 2);
+                    for (size_t i = 0; i < q.size(); ++i) {
+                        assert(q[i] == (i < lat ? 0 : in[i - lat]));
+                    }
+                    std::vector<float> f(1000), g;
+                    for (size_t i = 0; i < f.size(); ++i) {
+                        f[i] = (float)in[i] / 32768.0f;
+                    }
+                    g = f;
+                    d.reset();
+                    d.process(&g[0], &g[0] + g.size());
+                    for (size_t i = lat; i < g.size(); ++i) {
+                        assert(g[i] == f[i - lat]);
+                    }
+                }
+
+                // A lookahead many tiles long, fed in odd chunks: the
+                // ring wraps part way through a tile, and still only
+                // delays.
+                {
+                    dynamics d(sr, nch,
+                        dynamics_settings::compressor(
+                            0.99f, 4.0f, 1.0f, 50.0f, 100.0f));
+                    const size_t lat = d.latency() * nch;
+                    assert(d.latency() == 4410);
+                    std::vector<short> q(in);
+                    short* p = &q[0];
+                    short* const e = p + q.size();
+                    while (p < e) {
+                        seed = seed * 1103515245u + 12345u;
+                        const size_t n = my::min((size_t)(e - p),
+                            (1 + (size_t)(seed >> 22)) * nch);
+                        d.process(p, p + n);
+                        p += n;
+                    }
+                    for (size_t i = 0; i < q.size() / 4; ++i) {
+                        assert(q[i] == (i < lat ? 0 : in[i - lat]));
+                    }
+                    (void)lat;
+                }
+
+                // The limiter: nothing over the ceiling, and not much
+                // of it hard up against it; the same whatever the SIMD
+                // level, and however it's chunked.
+                std::vector<short> ref;
+                const int was = simd::simd_level();
+                for (int level = simd::SIMD_SCALAR;
+                     level <= simd::detected_simd_level(); ++level) {
+                    simd::set_simd_level(level);
+                    dynamics lim(sr, nch, dynamics_settings::limiter(0.5f));
+                    std::vector<short> out(in);
+                    short* p = &out[0];
+                    short* const e = p + out.size();
+                    while (p < e) {
+                        seed = seed * 1103515245u + 12345u;
+                        const size_t n = my::min(
+                            (size_t)(e - p), (1 + (size_t)(seed >> 20)) * nch);
+                        lim.process(p, p + n);
+                        p += n;
+                    }
+                    size_t at_ceiling = 0;
+                    for (size_t i = 0; i < out.size(); ++i) {
+                        assert(out[i] <= 16384 && out[i] >= -16384);
+                        if (out[i] >= 16384 || out[i] <= -16384) {
+                            ++at_ceiling;
+                        }
+                    }
+                    assert(at_ceiling < out.size() / 1000);
+                    if (ref.empty()) {
+                        ref = out;
+                    } else {
+                        assert(out == ref);
+                    }
+                    (void)at_ceiling;
+                }
+                simd::set_simd_level(was);
+
+                // The compressor, held at a steady level: 1dB out for
+                // every 'ratio' dB in over the threshold.
+                {
+                    const float t = 0.25f;
+                    const float r = 4.0f;
+                    dynamics c(sr, 1,
+                        dynamics_settings::compressor(t, r, 5.0f, 50.0f));
+                    std::vector<float> f(sr / 2, 0.5f);
+                    c.process(&f[0], &f[0] + f.size());
+                    const double want
+                        = t * pow(0.5 / (double)t, 1.0 / (double)r);
+                    assert(std::fabs(f.back() - want) < 1e-4);
+                    (void)want;
+                }
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_DYNAMICS_HPP
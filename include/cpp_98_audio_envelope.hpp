@@ -3,11 +3,29 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <vector>
 #include <limits>
 
+#include "cpp_98_audio_history.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+#if defined(CPP98AUDIO_STATS)
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define CPP98AUDIO_HAVE_RDTSC 1
+#elif (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define CPP98AUDIO_HAVE_RDTSC 1
+#elif !defined(_WIN32)
+#include <time.h>
+#else
+#include <ctime>
+#endif
+#endif
 
 namespace my {
 template <typename T>
@@ -36,6 +54,13 @@ const T& max(const T& a, const T& b)
 }
 namespace cpp98 {
     namespace audio {
+        // Frame counts and file sizes that can outgrow 32 bits.
+#if defined(_MSC_VER)
+        typedef unsigned __int64 u64_t;
+#else
+        typedef unsigned long long u64_t;
+#endif
+
 #ifndef TAU
 #define TAU 0.632f
 #endif
@@ -61,12 +86,33 @@ namespace cpp98 {
             return std::numeric_limits<T>::epsilon();
         }
 
+        // Sample by sample: on anything but mono that swaps the
+        // channels round too. See the next one.
         template <typename T>
         inline static void reverse_samples(T begin, T end) {
             std::reverse(begin, end);
             return;
         }
 
+        // Frame by frame: the frames go in reverse, each one's samples
+        // stay in order (so left is still left).
+        template <typename T>
+        inline static void reverse_samples(T begin, T end, const int nch) {
+            if (nch <= 1) {
+                std::reverse(begin, end);
+                return;
+            }
+            assert((end - begin) % nch == 0);
+            if (end - begin < 2 * nch) return;
+            T a = begin;
+            T b = end - nch;
+            while (a < b) {
+                std::swap_ranges(a, a + nch, b);
+                a += nch;
+                b -= nch;
+            }
+        }
+
         inline static short clip_short(float val) {
 
             if ((val) > tiny_value<float>()) {
@@ -78,30 +124,78 @@ namespace cpp98 {
             return (short)val;
         }
 
+        // clip_short() for a whole buffer, vectorized where the CPU
+        // allows.
+        inline static void clip_shorts(const float* begin,
+            const float* end, short* const pdest) {
+            simd::clip_shorts(begin, end, pdest);
+        }
+
+        // Contiguous floats: no need to walk them one at a time.
+        static inline void floats_to_shorts(const float* begin,
+            const float* end, short* const pdest,
+            short* const pdest_end, const int nch) {
+
+            (void)nch;
+            assert(end - begin == pdest_end - pdest);
+            if (end - begin != pdest_end - pdest) return;
+            simd::floats_to_shorts(begin, end, pdest, 32767.0f);
+        }
+
+        static inline void floats_to_shorts(float* begin,
+            float* end, short* const pdest,
+            short* const pdest_end, const int nch) {
+            floats_to_shorts((const float*)begin,
+                (const float*)end, pdest, pdest_end, nch);
+        }
+
+        namespace detail {
+            // NCH == 0 means "use nch".
+            template <int NCH, typename I>
+            static inline void floats_to_shorts_n(
+                I sptr, const I s_end, short* dptr, const int nch_) {
+
+                const int nch = NCH ? NCH : nch_;
+                const float mult = 32767.0f;
+                while (sptr < s_end) {
+                    for (int ch = 0; ch < nch; ++ch) {
+                        float fval = (float)*sptr;
+                        ++sptr;
+                        fval *= mult;
+                        *dptr = clip_short(fval);
+                        ++dptr;
+                    }
+                }
+            }
+        } // namespace detail
+
         template <typename I>
         static inline void floats_to_shorts(const I begin,
             const I end, short* const pdest,
             short* const pdest_end, const int nch) {
 
-            const float mult = 32767.0f;
             int nsamps_src = (end - begin);
             int nsamps_dst = (pdest_end - pdest);
             assert(nsamps_src == nsamps_dst);
             if (nsamps_dst != nsamps_src) return;
 
-            short* dptr = pdest;
-            I sptr = begin;
-            I s_end = end;
-            while (sptr < s_end) {
-                int ch = 0;
-                while (ch < nch) {
-                    float fval = (float)*sptr;
-                    ++sptr;
-                    ++ch;
-                    fval *= mult;
-                    *dptr = clip_short(fval);
-                    ++dptr;
-                };
+            switch (nch) {
+                case 1:
+                    detail::floats_to_shorts_n<1>(begin, end, pdest, 1);
+                    break;
+                case 2:
+                    detail::floats_to_shorts_n<2>(begin, end, pdest, 2);
+                    break;
+                case 6:
+                    detail::floats_to_shorts_n<6>(begin, end, pdest, 6);
+                    break;
+                case 8:
+                    detail::floats_to_shorts_n<8>(begin, end, pdest, 8);
+                    break;
+                default:
+                    detail::floats_to_shorts_n<0>(
+                        begin, end, pdest, nch);
+                    break;
             }
         }
 
@@ -144,69 +238,232 @@ namespace cpp98 {
 		return 32767.0f;
 	}
 
+	template <>
+	inline float min_audio_val<int>(int){
+		return -2147483648.0f;
+	}
 
+	inline float max_audio_val(int){
+		return 2147483647.0f;
+	}
 
-	
-	template <typename T>
-	static inline void normalize_buffer(T* begin, T* end, int nch)
-	{
-		T* ptr = begin;
-		float fnorm = 1.0;
-		int peak = 0;
-		static const float MAX_AMP_FACTOR = 10.0f;
-		int the_peak = 500;
-		float amp_factor = 1.0f;
-				
-		const float max_val = max_audio_val(T());
-		const float min_val = min_audio_val(T());
-		const float abs_max_val = my::min<float> (max_val, fabs(min_val));
-
-		while (ptr < end)
-		{
-			for (int ch = 0; ch < nch; ch++){
-				short pk = abs(*ptr);
-				if (pk > the_peak){
-					the_peak = pk;
-					amp_factor = abs_max_val/ (float)the_peak;
-				}
-				
+	template <>
+	inline float min_audio_val<float>(float){
+		return -1.0f;
+	}
+
+	inline float max_audio_val(float){
+		return 1.0f;
+	}
+
+	// 24-bit samples, in the low 24 bits of an int (as WAV readers hand
+	// them over). Use these with the _24 functions below.
+	inline float min_audio_val_24(){ return -8388608.0f; }
+	inline float max_audio_val_24(){ return 8388607.0f; }
+
+	namespace detail {
+		// Largest |sample|, in the sample's own units. Generic: the
+		// compiler can vectorize this one itself (ints).
+		template <typename T>
+		inline double peak_abs(const T* b, const T* e){
+			double hi = 0;
+			double lo = 0;
+			while (b < e){
+				const double v = (double)*b++;
+				hi = v > hi ? v : hi;
+				lo = v < lo ? v : lo;
 			}
-			ptr += nch;
+			return my::max(hi, -lo);
 		}
 
-		ptr = begin;
-		
-		while (ptr < end)
-		{
-			for (int ch = 0; ch < nch; ch++){
-				float f = (float)*ptr;
-				f *= amp_factor;
-				
-				if (f >=0){
-					if (f > max_val) f = max_val;
-				}else{
-					if (f < min_val) f  = min_val;
-				}
-				*ptr = (T)f;
+		inline double peak_abs(const short* b, const short* e){
+			return (double)simd::peak_abs(b, e);
+		}
+
+		inline double peak_abs(const float* b, const float* e){
+			return (double)simd::peak_abs(b, e);
+		}
+
+		// x * gain, clamped to [lo, hi], truncated. In double for
+		// ints: a float can't hold an int32 sample exactly.
+		template <typename T>
+		inline void apply_gain(T* b, T* e, double gain, double lo,
+			double hi){
+			while (b < e){
+				double f = (double)*b * gain;
+				if (f > hi) f = hi;
+				if (f < lo) f = lo;
+				*b++ = (T)f;
 			}
-			 ptr += nch;
 		}
 
+		inline void apply_gain(short* b, short* e, double gain, double,
+			double){
+			simd::scale_shorts(b, e, (float)gain);
+		}
+
+		inline void apply_gain(float* b, float* e, double gain,
+			double lo, double hi){
+			simd::scale_floats(b, e, (float)gain, (float)lo, (float)hi);
+		}
+
+		// Normalizing near-silence just makes loud noise: anything
+		// that doesn't peak above 500/32767 of full scale (about
+		// -36dB) is left alone.
+		inline double normalize_gain(double peak, double lo, double hi){
+			const double abs_max_val = my::min(hi, -lo);
+			const double floor = abs_max_val * (500.0 / 32767.0);
+			if (!(peak > floor)) return 1.0;
+			return abs_max_val / peak;
+		}
+
+		// Full scale, exactly: (double)max_audio_val(int()) is 2^31,
+		// which doesn't fit back in an int.
+		inline void full_scale(short, double& lo, double& hi){
+			lo = -32768.0; hi = 32767.0;
+		}
+		inline void full_scale(int, double& lo, double& hi){
+			lo = -2147483648.0; hi = 2147483647.0;
+		}
+		inline void full_scale(float, double& lo, double& hi){
+			lo = -1.0; hi = 1.0;
+		}
+
+		// Shorts have always had their gain worked out in float.
+		inline double normalize_gain(short, double peak){
+			const float g = max_audio_val(short())
+				/ (float)peak;
+			return peak > 500.0 ? (double)g : 1.0;
+		}
+		template <typename T>
+		inline double normalize_gain(T, double peak){
+			double lo, hi;
+			full_scale(T(), lo, hi);
+			return normalize_gain(peak, lo, hi);
+		}
+	} // namespace detail
+
+	// Scales the buffer so its loudest sample (on any channel) hits
+	// full scale, saturating rather than wrapping. One (SIMD, for
+	// short and float) pass to find the peak, one to apply the gain.
+	// Works for short, int (int32) and float (+/-1.0) samples: for
+	// 24-bit samples in ints, use normalize_buffer_24(). Channels
+	// don't matter here; nch is only kept for compatibility.
+	// Returns the gain applied (1.0 if the peak was too low to
+	// bother, see detail::normalize_gain()).
+	template <typename T>
+	static inline float normalize_buffer(T* begin, T* end, int nch)
+	{
+		(void)nch;
+		const double peak = detail::peak_abs(
+			(const T*)begin, (const T*)end);
+		const double gain = detail::normalize_gain(T(), peak);
+		if (gain != 1.0){
+			double lo, hi;
+			detail::full_scale(T(), lo, hi);
+			detail::apply_gain(begin, end, gain, lo, hi);
+		}
+		return (float)gain;
+	}
 
+	static inline float normalize_buffer_24(int* begin, int* end, int nch)
+	{
+		(void)nch;
+		const double lo = min_audio_val_24();
+		const double hi = max_audio_val_24();
+		const double peak = detail::peak_abs(
+			(const int*)begin, (const int*)end);
+		const double gain = detail::normalize_gain(peak, lo, hi);
+		if (gain != 1.0){
+			detail::apply_gain(begin, end, gain, lo, hi);
+		}
+		return (float)gain;
 	}
 
 
 
+        // What envelope_shorts() (and crossings_shorts()) did, and
+        // where the time went: see envelope::stats(). Ticks are CPU
+        // cycles (rdtsc) on x86, nanoseconds elsewhere.
+        struct envelope_stats {
+            envelope_stats() { clear(); }
+
+            u64_t calls;
+            u64_t samples_converted; // shorts -> floats
+            u64_t samples_enveloped;
+            u64_t samples_fast_forwarded; // skipped, in closed form
+            u64_t sentinel_hits;
+            // The conversion buffer's (re)allocations, in bytes.
+            u64_t conversion_bytes_allocated;
+            u64_t convert_ticks;
+            u64_t envelope_ticks;
+            u64_t fast_forward_ticks;
+
+            inline void clear() {
+                calls = samples_converted = samples_enveloped = 0;
+                samples_fast_forwarded = sentinel_hits = 0;
+                conversion_bytes_allocated = 0;
+                convert_ticks = envelope_ticks = fast_forward_ticks = 0;
+            }
+
+            // Converted, then never enveloped: what stopping at a
+            // sentinel part way through a block threw away.
+            inline u64_t samples_wasted() const {
+                return samples_converted - samples_enveloped;
+            }
+
+            // For totting up many envelopes' worth.
+            inline envelope_stats& operator+=(const envelope_stats& o) {
+                calls += o.calls;
+                samples_converted += o.samples_converted;
+                samples_enveloped += o.samples_enveloped;
+                samples_fast_forwarded += o.samples_fast_forwarded;
+                sentinel_hits += o.sentinel_hits;
+                conversion_bytes_allocated += o.conversion_bytes_allocated;
+                convert_ticks += o.convert_ticks;
+                envelope_ticks += o.envelope_ticks;
+                fast_forward_ticks += o.fast_forward_ticks;
+                return *this;
+            }
+
+            // A clock for the *_ticks counters. Only there when
+            // they're compiled in.
+#if defined(CPP98AUDIO_STATS)
+            static inline u64_t ticks() {
+#if defined(CPP98AUDIO_HAVE_RDTSC)
+                return (u64_t)__rdtsc();
+#elif !defined(_WIN32)
+                timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return (u64_t)ts.tv_sec * 1000000000u
+                    + (u64_t)ts.tv_nsec;
+#else
+                return (u64_t)std::clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+            }
+#endif
+        };
+
         class envelope {
             public:
+            // (A float vector: the name is from when the envelope
+            // kept one of these as a full-rate history.)
             typedef std::vector<float> history_t;
             typedef std::vector<float> floatvec_t;
-            const history_t& history_const() const {
-                return m_history;
+
+            // Records a point (lowest, highest and last level) every
+            // block_frames frames that envelope_shorts(),
+            // envelope_floats() or update_frame() go through, keeping
+            // the latest capacity points: see
+            // cpp_98_audio_history.hpp. 0 for either turns it off,
+            // which is how it starts. Starts the history over.
+            inline void set_history(size_t block_frames, size_t capacity) {
+                m_history.configure(block_frames, capacity);
             }
-            inline history_t& history() {
+            inline const envelope_history& history() const {
                 return m_history;
             }
+            inline void clear_history() { m_history.clear(); }
 
 
 
@@ -253,38 +510,189 @@ namespace cpp98 {
 				return update ( (float)value / 32768.0f);
 			}
 
+            // One whole frame (channels() samples), in any mode.
+            // Returns what operator()() would.
+            inline float update_frame(const float* frame) {
+                if (m_mode == MIXED) {
+                    for (int ch = 0; ch < m_nch; ++ch) {
+                        update(frame[ch]);
+                    }
+                    if (m_history.enabled()) m_history.add(m_env);
+                    return m_env;
+                }
+                if (m_mode == LINKED) {
+                    float pk = 0;
+                    for (int ch = 0; ch < m_nch; ++ch) {
+                        pk = my::max(pk, fabsf(frame[ch]));
+                    }
+                    m_env = step(m_env, pk, m_ga, m_gr);
+                    if (m_history.enabled()) m_history.add(m_env);
+                    return m_env;
+                }
+                float loudest = 0;
+                for (int ch = 0; ch < m_nch; ++ch) {
+                    m_chan_env[ch]
+                        = step(m_chan_env[ch], frame[ch], m_ga, m_gr);
+                    loudest = my::max(loudest, m_chan_env[ch]);
+                }
+                if (m_history.enabled()) m_history.add(loudest);
+                return loudest;
+            }
+
+            // How interleaved channels feed the detector:
+            // MIXED       : (the original) one level, fed every sample
+            //               in turn. Times are stretched by the channel
+            //               count to make up for it.
+            // PER_CHANNEL : one level per channel. operator()() and
+            //               the sentinels see the loudest of them.
+            // LINKED      : one level, fed the peak of each frame.
+            // PER_CHANNEL and LINKED take attack/release as real
+            // times, whatever the channel count.
+            enum channel_mode_t { MIXED, PER_CHANNEL, LINKED };
+
+            // envelope_shorts() converts and envelopes this many
+            // frames at a time, so m_conversion_buffer never grows
+            // beyond one block, however long the input is.
+            // 2048 stereo frames of float is 16K: comfortably L2.
+            enum { DEFAULT_STREAM_BLOCK_FRAMES = 2048 };
+            // Runs of identical samples at least this long are
+            // skipped over in closed form (see set_fast_forward()).
+            enum { MIN_FAST_FORWARD_FRAMES = 64 };
+
             private:
             float m_samplerate;
             int m_nch;
+            channel_mode_t m_mode;
 
             float m_env, m_attms, m_relms, m_ga, m_gr;
-            history_t m_history;
+            floatvec_t m_chan_env; // PER_CHANNEL only
+            envelope_history m_history;
             floatvec_t m_conversion_buffer;
+            size_t m_stream_block_frames;
+            bool m_fast_forward;
+#if defined(CPP98AUDIO_STATS)
+            envelope_stats m_stats;
+#endif
+
+            // The instrumentation's hooks: empty (and gone, once
+            // inlined) unless CPP98AUDIO_STATS is defined.
+            inline u64_t stat_clock() const {
+#if defined(CPP98AUDIO_STATS)
+                return envelope_stats::ticks();
+#else
+                return 0;
+#endif
+            }
+            inline void stat_call() {
+#if defined(CPP98AUDIO_STATS)
+                ++m_stats.calls;
+#endif
+            }
+            inline void stat_fast_forward(const u64_t t0, size_t frames) {
+#if defined(CPP98AUDIO_STATS)
+                m_stats.fast_forward_ticks += stat_clock() - t0;
+                m_stats.samples_fast_forwarded += (u64_t)frames * m_nch;
+#else
+                (void)t0;
+                (void)frames;
+#endif
+            }
+            // t: when converting started; on return, when it ended.
+            inline void stat_converted(
+                u64_t& t, const size_t nsamps, const size_t old_capacity) {
+#if defined(CPP98AUDIO_STATS)
+                const u64_t t1 = stat_clock();
+                m_stats.convert_ticks += t1 - t;
+                t = t1;
+                m_stats.samples_converted += nsamps;
+                if (m_conversion_buffer.capacity() != old_capacity) {
+                    m_stats.conversion_bytes_allocated
+                        += m_conversion_buffer.capacity() * sizeof(float);
+                }
+#else
+                (void)t;
+                (void)nsamps;
+                (void)old_capacity;
+#endif
+            }
+            inline void stat_enveloped(
+                u64_t& t, const size_t nsamps, const bool hit) {
+#if defined(CPP98AUDIO_STATS)
+                const u64_t t1 = stat_clock();
+                m_stats.envelope_ticks += t1 - t;
+                t = t1;
+                m_stats.samples_enveloped += nsamps;
+                if (hit) ++m_stats.sentinel_hits;
+#else
+                (void)t;
+                (void)nsamps;
+                (void)hit;
+#endif
+            }
 
             inline float attack_coef(float att_ms) {
                 assert(m_nch);
-                att_ms *= m_nch;
-                // float ga =
-                // exp(-1.0f/(sampleRate*attTime));
-                const double att_secs
-                    = (double)att_ms / 1000.0;
-                const double ga = exp(-1.0
-                    / ((double)m_samplerate * att_secs));
-                return (float)ga;
+                if (m_mode == MIXED) att_ms *= m_nch;
+                return time_coef(m_samplerate, att_ms);
             }
             inline float release_coef(float rel_ms) {
                 assert(m_nch);
-                rel_ms *= m_nch;
-                const double rel_secs
-                    = (double)rel_ms / 1000.0;
-
-                const double gr = exp(-1.0
-                    / ((double)m_samplerate * rel_secs));
-                return (float)gr;
+                if (m_mode == MIXED) rel_ms *= m_nch;
+                return time_coef(m_samplerate, rel_ms);
             }
 
             public:
-            inline float operator()() { return m_env; }
+            // The one-pole coefficient for a time constant of 'ms'
+            // (per sample, at 'samplerate'). Anything that wants to
+            // track exactly what an envelope does should use this.
+            static inline float time_coef(float samplerate, float ms) {
+                // float ga =
+                // exp(-1.0f/(sampleRate*attTime));
+                const double secs = (double)ms / 1000.0;
+                const double g
+                    = exp(-1.0 / ((double)samplerate * secs));
+                return (float)g;
+            }
+
+            // How many frames it takes two of these envelopes, fed
+            // the same samples, to agree to within 'tolerance'
+            // (relative to full scale) however far apart they
+            // started. Each step shrinks any difference by at least
+            // max(ga, gr), so the release time sets this: about 6.9
+            // release times for SIXTY_DB_DOWN().
+            inline size_t settle_frames(
+                float tolerance = SIXTY_DB_DOWN()) const {
+                const double g = my::max(m_ga, m_gr);
+                if (g <= 0.0) return 1;
+                if (g >= 1.0 || tolerance <= 0) return size_t(-1);
+                const double steps
+                    = ceil(log((double)tolerance) / log(g));
+                const double per_frame
+                    = (m_mode == MIXED) ? (double)m_nch : 1.0;
+                return (size_t)ceil(steps / per_frame);
+            }
+
+            inline float operator()() {
+                if (m_mode == PER_CHANNEL) {
+                    return *std::max_element(
+                        m_chan_env.begin(), m_chan_env.end());
+                }
+                return m_env;
+            }
+            // The level of one channel. Only PER_CHANNEL keeps them
+            // apart: in the other modes they're all the same level.
+            inline float channel_level(int ch) const {
+                if (m_mode == PER_CHANNEL) return m_chan_env[ch];
+                return m_env;
+            }
+            inline channel_mode_t mode() const { return m_mode; }
+            // Changes the mode keeping the attack and release times
+            // (so the coefficients change, in and out of MIXED).
+            inline void set_mode(channel_mode_t mode) {
+                m_mode = mode;
+                m_ga = attack_coef(m_attms);
+                m_gr = release_coef(m_relms);
+            }
             inline float attack_ms() const {
                 return m_attms;
             }
@@ -292,9 +700,11 @@ namespace cpp98 {
                 return m_relms;
             }
             inline void set_attack_ms(float millisecs) {
+                m_attms = millisecs;
                 m_ga = attack_coef(millisecs);
             }
             inline void set_release_ms(float millisecs) {
+                m_relms = millisecs;
                 m_gr = release_coef(millisecs);
             }
             inline int channels() const { return m_nch; }
@@ -308,17 +718,88 @@ namespace cpp98 {
             // gating, tests and friends.
             inline void set_envelope_to(const float f) {
                 m_env = f;
+                std::fill(m_chan_env.begin(), m_chan_env.end(), f);
+            }
+
+            // Number of frames envelope_shorts() converts per
+            // block. 0 means "convert the whole input up front",
+            // which is how this class used to behave: only use
+            // it if you need it, as memory then grows with the
+            // input.
+            inline void set_stream_block_frames(size_t frames) {
+                m_stream_block_frames = frames;
+            }
+            inline size_t stream_block_frames() const {
+                return m_stream_block_frames;
+            }
+            // When on (the default), envelope_shorts() jumps straight
+            // over runs of identical samples (digital silence, DC)
+            // instead of stepping through them: after n steps of a
+            // constant input c, the level is c + g^n * (level - c).
+            // Levels and sentinel positions then agree with
+            // stepping to within float rounding (a sample, at
+            // worst, on a sentinel). Turn it off if you need
+            // results bit-identical to update().
+            inline void set_fast_forward(bool on) {
+                m_fast_forward = on;
+            }
+            inline bool fast_forward() const { return m_fast_forward; }
+
+            // Instrumentation: counters kept by envelope_shorts() and
+            // crossings_shorts(), compiled in only when
+            // CPP98AUDIO_STATS is defined (for the whole program: it
+            // changes the class). Otherwise stats() is all zeros, and
+            // keeping them costs nothing at all.
+            static inline bool stats_enabled() {
+#if defined(CPP98AUDIO_STATS)
+                return true;
+#else
+                return false;
+#endif
+            }
+            // A copy of the counters so far.
+            inline envelope_stats stats() const {
+#if defined(CPP98AUDIO_STATS)
+                return m_stats;
+#else
+                return envelope_stats();
+#endif
+            }
+            inline void reset_stats() {
+#if defined(CPP98AUDIO_STATS)
+                m_stats.clear();
+#endif
+            }
+            // stats(), then reset_stats(): what's happened since
+            // the last call, for a metrics system to add up.
+            inline envelope_stats take_stats() {
+                const envelope_stats s = stats();
+                reset_stats();
+                return s;
+            }
+
+            // What the conversion buffer is actually holding on
+            // to, in bytes.
+            inline size_t conversion_buffer_bytes() const {
+                return m_conversion_buffer.capacity()
+                    * sizeof(float);
             }
 
             envelope(int samplerate, int nch,
-                float attms = 10.0f, float relms = 100.0f)
+                float attms = 10.0f, float relms = 100.0f,
+                channel_mode_t mode = MIXED)
                 : m_samplerate((float)samplerate)
                 , m_nch(nch)
+                , m_mode(mode)
                 , m_env(0)
                 , m_attms(attms)
                 , m_relms(relms)
                 , m_ga(attack_coef(m_attms))
-                , m_gr(release_coef(m_relms)) {
+                , m_gr(release_coef(m_relms))
+                , m_chan_env(size_t(nch > 0 ? nch : 1), 0.0f)
+                , m_stream_block_frames(
+                      DEFAULT_STREAM_BLOCK_FRAMES)
+                , m_fast_forward(true) {
                 (void)m_nch;
             }
 
@@ -345,42 +826,15 @@ namespace cpp98 {
                 const short* begin, const short* end,
                 const int nch, history_t* pvhist = 0) {
 
-                const float div = 32768.0f;
-                int nsamps = end - begin;
-                float* vptr = 0;
-                if (pvhist) {
-
-                    pvhist->resize(size_t(nsamps));
-                    vptr = &pvhist->operator[](0);
-                }
-
-                const short* sptr = begin;
-                int ctr = 0;
-
-                while (sptr < end) {
-
-                    int ch = 0;
-                    while (ch < nch) {
-                        float val = (float)*sptr;
-                        ++sptr;
-                        val /= div;
-                        if (vptr) {
-                            *vptr = val;
-                            ++vptr;
-                        }
-                        ++ctr;
-                        ++ch;
-                    };
-                };
-
-                if (pvhist) {
-                    float* vbeg = &pvhist->operator[](0);
-                    float* pvhist_end
-                        = vbeg + pvhist->size();
-                    int hist_remain = pvhist_end - vptr;
-                    assert(hist_remain == 0);
-                    // fprintf(stdout, "%d\n", hist_remain);
-                }
+                // Every sample gets the same scale, so channels
+                // don't matter here: one flat (SIMD) pass.
+                (void)nch;
+                if (!pvhist) return;
+                const ptrdiff_t nsamps = end - begin;
+                pvhist->resize(size_t(nsamps));
+                if (nsamps <= 0) return;
+                simd::shorts_to_floats(
+                    begin, end, &pvhist->operator[](0));
             }
 
             float sample_pos_in_secs(int sample_position) {
@@ -395,66 +849,520 @@ namespace cpp98 {
             }
             typedef floatvec_t::const_iterator cit_t;
 
+            // If phit is given, it is set to whether a sentinel
+            // fired: a hit on the very last frame returns end() too.
+            // The common channel counts get their own (unrolled)
+            // loop; anything else takes the runtime one.
             inline cit_t envelope_floats(
                 const float* const sentinel_attack,
-                const float* const sentinel_release) {
+                const float* const sentinel_release,
+                bool* const phit = NULL) {
 
-                cit_t bit = m_conversion_buffer.begin();
-                cit_t eit = m_conversion_buffer.end();
-                cit_t it;
-                int ctr = 0;
-                bool done = false;
+                return envelope_floats_from(
+                    0, sentinel_attack, sentinel_release, phit);
+            }
 
-                for (it = bit; it < eit;) {
-                    int ch = 0;
-                    while (ch++ < m_nch) {
-                        float val = *it;
-                        ++it;
-                        float e = this->update(val);
+            // The same, on floats of the caller's (in [-1, 1), as
+            // shorts_to_floats() makes them): no conversion, and no
+            // copy. Returns where a sentinel fired, as
+            // envelope_shorts() does.
+            inline const float* envelope_samples(const float* begin,
+                const float* end, const float* const sentinel_attack = NULL,
+                const float* const sentinel_release = NULL,
+                bool* const phit = NULL) {
+
+                assert(m_nch > 0);
+                stat_call();
+                u64_t t = stat_clock();
+                bool hit = false;
+                const float* at = envelope_range(begin,
+                    (size_t)(end - begin), 0, sentinel_attack,
+                    sentinel_release, &hit);
+                stat_enveloped(t, (size_t)(at - begin), hit);
+                if (phit) *phit = hit;
+                return at;
+            }
+
+            private:
+            // envelope_floats(), starting 'from' samples (a whole
+            // number of frames) into the conversion buffer.
+            inline cit_t envelope_floats_from(const size_t from,
+                const float* const sentinel_attack,
+                const float* const sentinel_release,
+                bool* const phit) {
+
+                if (m_conversion_buffer.empty()) {
+                    if (phit) *phit = false;
+                    return m_conversion_buffer.end();
+                }
+                const float* const base = &m_conversion_buffer[0];
+                const float* const at = envelope_range(base,
+                    m_conversion_buffer.size(), from, sentinel_attack,
+                    sentinel_release, phit);
+                return m_conversion_buffer.begin() + (at - base);
+            }
+
+            // The nsamps samples from base, starting 'from' samples in
+            // (a whole number of frames).
+            inline const float* envelope_range(const float* const base,
+                const size_t nsamps, const size_t from,
+                const float* const sentinel_attack,
+                const float* const sentinel_release, bool* const phit) {
 
-                        if (sentinel_attack) {
-                            if (e >= *sentinel_attack) {
-                                done = true;
+                if (m_history.enabled()) {
+                    return envelope_floats_as<true>(base, nsamps, from,
+                        sentinel_attack, sentinel_release, phit);
+                }
+                return envelope_floats_as<false>(base, nsamps, from,
+                    sentinel_attack, sentinel_release, phit);
+            }
+
+            // HIST: record history. A template parameter so that
+            // not recording it costs nothing at all.
+            template <bool HIST>
+            inline const float* envelope_floats_as(const float* const base,
+                const size_t nsamps, const size_t from,
+                const float* const sentinel_attack,
+                const float* const sentinel_release,
+                bool* const phit) {
+
+                switch (m_nch) {
+                    case 1:
+                        return envelope_frames<1, HIST>(base, nsamps, from,
+                            sentinel_attack, sentinel_release, phit);
+                    case 2:
+                        return envelope_frames<2, HIST>(base, nsamps, from,
+                            sentinel_attack, sentinel_release, phit);
+                    case 6:
+                        return envelope_frames<6, HIST>(base, nsamps, from,
+                            sentinel_attack, sentinel_release, phit);
+                    case 8:
+                        return envelope_frames<8, HIST>(base, nsamps, from,
+                            sentinel_attack, sentinel_release, phit);
+                    default:
+                        return envelope_frames<0, HIST>(base, nsamps, from,
+                            sentinel_attack, sentinel_release, phit);
+                }
+            }
+
+            // The body of update(), on locals. The conversion buffer
+            // is floats too, so working on m_env directly would make
+            // the compiler store and reload it every sample.
+            static inline float step(
+                float env, const float value, const float ga,
+                const float gr) {
+                const float env_in = fabsf(value);
+                if (env < env_in) {
+                    return env_in + ga * (env - env_in);
+                }
+                return env_in + gr * (env - env_in);
+            }
+
+            // NCH == 0 means "use m_nch". Ragged last frames aren't
+            // recorded in the history.
+            template <int NCH, bool HIST>
+            inline const float* envelope_frames(const float* const base,
+                const size_t nsamps, const size_t from,
+                const float* const sentinel_attack,
+                const float* const sentinel_release,
+                bool* const phit) {
+
+                const int nch = NCH ? NCH : m_nch;
+                if (phit) *phit = false;
+                if (from >= nsamps) return base + nsamps;
+
+                const float* p = base + from;
+                const float* const frames_end
+                    = base + (nsamps - nsamps % (size_t)nch);
+                const float* const e = base + nsamps;
+                const float ga = m_ga;
+                const float gr = m_gr;
+                const bool sentinels
+                    = sentinel_attack || sentinel_release;
+                const float inf = std::numeric_limits<float>::infinity();
+                const float att
+                    = sentinel_attack ? *sentinel_attack : inf;
+                const float rel
+                    = sentinel_release ? *sentinel_release : -inf;
+                bool done = false;
+                envelope_history::block_state hs = m_history.state();
+
+                if (m_mode == PER_CHANNEL) {
+                    // A fixed channel count keeps the levels in
+                    // registers; otherwise work on the member.
+                    float local[NCH ? NCH : 1];
+                    float* const chan = NCH ? local : &m_chan_env[0];
+                    if (NCH) std::copy(m_chan_env.begin(),
+                        m_chan_env.begin() + nch, chan);
+
+                    if (!sentinels) {
+                        while (p < frames_end) {
+                            for (int ch = 0; ch < nch; ++ch) {
+                                chan[ch] = step(chan[ch], p[ch], ga, gr);
                             }
+                            if (HIST) {
+                                float loudest = chan[0];
+                                for (int ch = 1; ch < nch; ++ch) {
+                                    loudest = my::max(loudest, chan[ch]);
+                                }
+                                m_history.track(hs, loudest);
+                            }
+                            p += nch;
                         }
-                        if (sentinel_release) {
-
-                            if (e <= *sentinel_release) {
-                                done = true;
+                    } else {
+                        while (p < frames_end && !done) {
+                            float loudest = 0;
+                            for (int ch = 0; ch < nch; ++ch) {
+                                chan[ch] = step(chan[ch], p[ch], ga, gr);
+                                loudest = my::max(loudest, chan[ch]);
                             }
+                            if (HIST) m_history.track(hs, loudest);
+                            p += nch;
+                            done = (loudest >= att) | (loudest <= rel);
                         }
+                    }
+                    // A ragged last frame only updates the channels
+                    // it has.
+                    for (int ch = 0; !done && p < e; ++ch) {
+                        chan[ch] = step(chan[ch], *p++, ga, gr);
+                    }
+                    if (NCH) std::copy(chan, chan + nch,
+                        m_chan_env.begin());
+
+                } else if (m_mode == LINKED) {
+                    float env = m_env;
+                    while (p < frames_end && !done) {
+                        float pk = fabsf(p[0]);
+                        for (int ch = 1; ch < nch; ++ch) {
+                            pk = my::max(pk, fabsf(p[ch]));
+                        }
+                        p += nch;
+                        env = step(env, pk, ga, gr);
+                        if (HIST) m_history.track(hs, env);
+                        done = (env >= att) | (env <= rel);
+                    }
+                    if (!done && p < e) {
+                        float pk = 0;
+                        while (p < e) pk = my::max(pk, fabsf(*p++));
+                        env = step(env, pk, ga, gr);
+                    }
+                    m_env = env;
 
-                        ++ctr;
-                    };
-                    if (done) {
-                        return it;
+                } else {
+                    float env = m_env;
+                    if (!sentinels) {
+                        while (p < frames_end) {
+                            for (int ch = 0; ch < nch; ++ch) {
+                                env = step(env, p[ch], ga, gr);
+                            }
+                            if (HIST) m_history.track(hs, env);
+                            p += nch;
+                        }
+                    } else {
+                        while (p < frames_end && !done) {
+                            for (int ch = 0; ch < nch; ++ch) {
+                                env = step(env, p[ch], ga, gr);
+                                done |= (env >= att) | (env <= rel);
+                            }
+                            if (HIST) m_history.track(hs, env);
+                            p += nch;
+                        }
                     }
-                };
-                return eit;
+                    // A ragged last frame (the caller didn't give us
+                    // whole frames) is enveloped, but can't fire a
+                    // sentinel.
+                    while (!done && p < e) {
+                        env = step(env, *p++, ga, gr);
+                    }
+                    m_env = env;
+                }
+                if (HIST) m_history.set_state(hs);
+
+                if (done) {
+                    if (phit) *phit = true;
+                    return p;
+                }
+                return base + nsamps;
+            }
+
+            // A one-pole level after n steps of the constant |input| c.
+            // It heads straight for c, so the branch taken on the
+            // first step is the one taken on every step.
+            static inline float level_after(const float e0,
+                const float c, const float ga, const float gr,
+                const double n) {
+                const double g = (e0 < c) ? ga : gr;
+                return (float)((double)c
+                    + pow(g, n) * ((double)e0 - (double)c));
+            }
+
+            // The first step (from 1) after which a level starting at
+            // e0, fed c, is >= thr (up) or <= thr (!up); 0 if that
+            // doesn't happen within nmax steps. The level only moves
+            // towards c, so either it's true after the first step,
+            // or it happens where the closed form says (give or
+            // take rounding, which the nudging below takes care of).
+            static inline double first_crossing(const float e0,
+                const float c, const float ga, const float gr,
+                const float thr, const bool up, const double nmax) {
+
+                if (nmax < 1) return 0;
+                const float e1 = level_after(e0, c, ga, gr, 1);
+                if (up ? (e1 >= thr) : (e1 <= thr)) return 1;
+                // moving the wrong way, or stopping short of thr?
+                if (up ? (e0 >= c || c < thr) : (e0 < c || c > thr)) {
+                    return 0;
+                }
+                const double g = (e0 < c) ? ga : gr;
+                if (g <= 0.0) return 0; // it was c after 1 step
+                double n = ceil(log(((double)c - thr)
+                                    / ((double)c - e0))
+                    / log(g));
+                if (n < 1) n = 1;
+                // the log can be out by an ulp or so: nudge n to the
+                // first step that actually crosses.
+                for (int i = 0; i < 4 && n > 1; ++i) {
+                    const float prev = level_after(e0, c, ga, gr, n - 1);
+                    if (!(up ? (prev >= thr) : (prev <= thr))) break;
+                    n -= 1;
+                }
+                for (int i = 0; i < 4; ++i) {
+                    const float at = level_after(e0, c, ga, gr, n);
+                    if (up ? (at >= thr) : (at <= thr)) break;
+                    n += 1;
+                }
+                return (n <= nmax) ? n : 0;
+            }
+
+            // The loudest level after k frames of a run (for the
+            // history).
+            struct ff_level {
+                float e0, c, ga, gr;
+                double steps_per_frame;
+                inline float operator()(size_t k) const {
+                    return level_after(
+                        e0, c, ga, gr, (double)k * steps_per_frame);
+                }
+            };
+
+            // Envelopes nframes frames of the sample value v, in
+            // closed form. Returns the frames consumed: all of them,
+            // unless a sentinel fires (*phit), when it's up to and
+            // including the frame it fired in.
+            inline size_t fast_forward_frames(const short v,
+                const size_t nframes, const float* const sentinel_attack,
+                const float* const sentinel_release, bool* const phit) {
+
+                *phit = false;
+                const float c = fabsf(short_to_float(v));
+                // In MIXED mode every sample is a step; otherwise
+                // every frame is.
+                const double steps_per_frame
+                    = (m_mode == MIXED) ? (double)m_nch : 1.0;
+                // Every level heads for the same c, so they never
+                // cross: the loudest now is the loudest all the way.
+                const float e0 = (*this)();
+
+                size_t frames = nframes;
+                const double nmax = (double)nframes * steps_per_frame;
+                double n = 0;
+                if (sentinel_attack) {
+                    n = first_crossing(
+                        e0, c, m_ga, m_gr, *sentinel_attack, true, nmax);
+                }
+                if (sentinel_release) {
+                    const double nr = first_crossing(e0, c, m_ga, m_gr,
+                        *sentinel_release, false, nmax);
+                    if (nr > 0 && (n == 0 || nr < n)) n = nr;
+                }
+                if (n > 0) {
+                    *phit = true;
+                    frames = (size_t)ceil(n / steps_per_frame);
+                }
+
+                if (m_history.enabled()) {
+                    const ff_level level = { e0, c, m_ga, m_gr,
+                        steps_per_frame };
+                    m_history.track_monotonic(frames, level);
+                }
+
+                const double steps = (double)frames * steps_per_frame;
+                m_env = level_after(m_env, c, m_ga, m_gr, steps);
+                for (size_t ch = 0; ch < m_chan_env.size(); ++ch) {
+                    m_chan_env[ch] = level_after(
+                        m_chan_env[ch], c, m_ga, m_gr, steps);
+                }
+                return frames;
             }
 
+            public:
+            // Returns where a sentinel fired (just past the frame it
+            // fired in), or end if none did. As a sentinel firing in
+            // the last frame returns end too, pass phit if you need
+            // to tell the two apart.
             const short* envelope_shorts(const short* begin,
                 const short* end,
                 const float* const sentinel_attack = NULL,
                 const float* const sentinel_release
-                = NULL) {
+                = NULL, bool* const phit = NULL) {
 
-                assert(m_nch > 0 && m_nch <= 2);
+                assert(m_nch > 0);
                 assert(m_samplerate > 0
                     && m_samplerate < 192000);
 
-                int nsamples = end - begin;
-                (void)nsamples;
-                shorts_to_floats(begin, end, m_nch,
-                    &m_conversion_buffer);
+                // Convert and envelope one block at a time: the
+                // converted floats are still in cache when we walk
+                // them, and once a sentinel fires we stop, rather
+                // than having converted the whole input for
+                // nothing. Blocks are whole frames, so the sentinel
+                // checks see exactly what they did before.
+                const ptrdiff_t nsamples = end - begin;
+                ptrdiff_t block = (ptrdiff_t)m_stream_block_frames
+                    * m_nch;
+                if (block <= 0 || block > nsamples) {
+                    block = nsamples;
+                }
 
-                cit_t fiter = envelope_floats(
-                    sentinel_attack, sentinel_release);
+                const ptrdiff_t min_run
+                    = (ptrdiff_t)MIN_FAST_FORWARD_FRAMES * m_nch;
+                const ptrdiff_t max_scan = (ptrdiff_t)65536 * m_nch;
+                if (phit) *phit = false;
+                stat_call();
+                const short* blk = begin;
+                while (blk < end) {
+                    if (m_fast_forward && end - blk >= min_run) {
+                        // Look a bounded distance ahead: a sentinel
+                        // may well fire long before the run ends.
+                        const short* scan_end = end - blk > max_scan
+                            ? blk + max_scan
+                            : end;
+                        ptrdiff_t run = (ptrdiff_t)simd::constant_run(
+                            blk, scan_end);
+                        run -= run % m_nch;
+                        if (run >= min_run) {
+                            bool hit = false;
+                            const u64_t t0 = stat_clock();
+                            const size_t frames = fast_forward_frames(
+                                *blk, (size_t)(run / m_nch),
+                                sentinel_attack, sentinel_release, &hit);
+                            stat_fast_forward(t0, frames);
+                            blk += (ptrdiff_t)frames * m_nch;
+                            if (hit) {
+                                if (phit) *phit = true;
+                                return blk;
+                            }
+                            continue;
+                        }
+                    }
 
-                ptrdiff_t nsamps_from_end
-                    = m_conversion_buffer.end() - fiter;
-                const short* retval = end - nsamps_from_end;
-                return retval;
+                    const short* blk_end
+                        = (end - blk > block) ? blk + block : end;
+
+                    u64_t t = stat_clock();
+                    const size_t cap = m_conversion_buffer.capacity();
+                    shorts_to_floats(blk, blk_end, m_nch,
+                        &m_conversion_buffer);
+                    stat_converted(t, (size_t)(blk_end - blk), cap);
+
+                    bool hit = false;
+                    cit_t fiter = envelope_floats(
+                        sentinel_attack, sentinel_release, &hit);
+                    stat_enveloped(t,
+                        (size_t)(fiter - m_conversion_buffer.begin()), hit);
+
+                    if (hit) {
+                        if (phit) *phit = true;
+                        ptrdiff_t nsamps_from_end
+                            = m_conversion_buffer.end() - fiter;
+                        return blk_end - nsamps_from_end;
+                    }
+                    blk = blk_end;
+                }
+                return end;
+            }
+
+            // envelope_shorts() that doesn't stop at a sentinel: every
+            // time the level goes up to 'up' (while !above) or down
+            // to 'down' (while above), 'above' flips and
+            // on_cross(where, above) is called, 'where' being just
+            // past the frame it happened in. If on_cross returns
+            // false it stops there, and returns where; else it
+            // carries on, in the same single pass, to end. down must
+            // be below up: the gap between them is the hysteresis.
+            template <typename F>
+            const short* crossings_shorts(const short* begin,
+                const short* end, const float up, const float down,
+                bool& above, F& on_cross) {
+
+                assert(m_nch > 0);
+                assert(down < up);
+                const ptrdiff_t nsamples = end - begin;
+                ptrdiff_t block = (ptrdiff_t)m_stream_block_frames
+                    * m_nch;
+                if (block <= 0 || block > nsamples) {
+                    block = nsamples;
+                }
+                const ptrdiff_t min_run
+                    = (ptrdiff_t)MIN_FAST_FORWARD_FRAMES * m_nch;
+                const ptrdiff_t max_scan = (ptrdiff_t)65536 * m_nch;
+                stat_call();
+
+                const short* blk = begin;
+                while (blk < end) {
+                    if (m_fast_forward && end - blk >= min_run) {
+                        const short* scan_end = end - blk > max_scan
+                            ? blk + max_scan
+                            : end;
+                        ptrdiff_t run = (ptrdiff_t)simd::constant_run(
+                            blk, scan_end);
+                        run -= run % m_nch;
+                        if (run >= min_run) {
+                            const short v = *blk;
+                            size_t left = (size_t)(run / m_nch);
+                            while (left) {
+                                bool hit = false;
+                                const u64_t t0 = stat_clock();
+                                const size_t frames = fast_forward_frames(
+                                    v, left, above ? NULL : &up,
+                                    above ? &down : NULL, &hit);
+                                stat_fast_forward(t0, frames);
+                                blk += (ptrdiff_t)frames * m_nch;
+                                left -= frames;
+                                if (hit) {
+                                    above = !above;
+                                    if (!on_cross(blk, above)) return blk;
+                                }
+                            }
+                            continue;
+                        }
+                    }
+
+                    const short* blk_end
+                        = (end - blk > block) ? blk + block : end;
+                    u64_t t = stat_clock();
+                    const size_t cap = m_conversion_buffer.capacity();
+                    shorts_to_floats(blk, blk_end, m_nch,
+                        &m_conversion_buffer);
+                    stat_converted(t, (size_t)(blk_end - blk), cap);
+
+                    size_t from = 0;
+                    const size_t n = m_conversion_buffer.size();
+                    while (from < n) {
+                        bool hit = false;
+                        const cit_t it = envelope_floats_from(from,
+                            above ? NULL : &up, above ? &down : NULL, &hit);
+                        const size_t to
+                            = (size_t)(it - m_conversion_buffer.begin());
+                        stat_enveloped(t, to - from, hit);
+                        if (!hit) break;
+                        from = to;
+                        above = !above;
+                        const short* where = blk + from;
+                        if (!on_cross(where, above)) return where;
+                    }
+                    blk = blk_end;
+                }
+                return end;
             }
         };
 
@@ -616,6 +1524,531 @@ namespace cpp98 {
                 return actual_release_time;
             }
 
+            // The blocked envelope_shorts() must land on exactly the
+            // same sample, with exactly the same state, as the old
+            // convert-everything-first behaviour (block frames 0),
+            // and must not hang on to more than one block.
+            inline void check_streaming_matches_whole(
+                short* const samps, const short* const samps_end) {
+
+                const size_t sz = (size_t)(samps_end - samps);
+                short* p = samps;
+                unsigned int seed = 12345;
+                while (p < samps_end) {
+                    seed = seed * 1103515245u + 12345u;
+                    *p++ = (short)((seed >> 16) & 0x1fff);
+                }
+                // A loud burst well past the first block, so the
+                // attack sentinel fires somewhere in the middle.
+                const size_t burst = sz / 3 - 1;
+                std::fill(samps + burst, samps + burst + 4410,
+                    (short)30000);
+                // ... and silence at the end for the release one.
+                std::fill(samps + 2 * (sz / 3), samps + sz,
+                    (short)0);
+
+                const float att = TAU;
+                const float rel = SIXTY_DB_DOWN();
+                const short* const cend = samps_end;
+                const float* sentinels[3][2]
+                    = { { NULL, NULL }, { &att, NULL },
+                          { NULL, &rel } };
+
+                for (int i = 0; i < 3; ++i) {
+                    envelope whole(44100, 2, 5.0f, 50.0f);
+                    whole.set_stream_block_frames(0);
+                    envelope blocked(44100, 2, 5.0f, 50.0f);
+                    blocked.set_stream_block_frames(1000);
+                    whole.set_envelope_to(1.0f);
+                    blocked.set_envelope_to(1.0f);
+                    // stepping through the constant stretches both
+                    // ways keeps the comparison bit-exact.
+                    whole.set_fast_forward(false);
+                    blocked.set_fast_forward(false);
+
+                    const short* pw = whole.envelope_shorts(
+                        samps, cend, sentinels[i][0],
+                        sentinels[i][1]);
+                    const short* pb = blocked.envelope_shorts(
+                        samps, cend, sentinels[i][0],
+                        sentinels[i][1]);
+                    assert(pw == pb);
+                    assert(pw != cend || i == 0);
+                    assert(whole() == blocked());
+                    (void)pw;
+                    (void)pb;
+                    assert(blocked.conversion_buffer_bytes()
+                        <= 2000 * sizeof(float));
+                }
+            }
+
+            // Every SIMD level this machine has must give exactly the
+            // bits the scalar clip_short() / short_to_float() path
+            // does: all 65536 shorts one way, and a spread of floats
+            // (including out-of-range ones) the other. Odd lengths
+            // and odd start addresses exercise the scalar tails.
+            inline void check_simd_conversions_bit_exact() {
+                std::vector<short> shorts(65536);
+                for (int i = 0; i < 65536; ++i) {
+                    shorts[i] = (short)(i - 32768);
+                }
+                std::vector<float> ref_f(shorts.size());
+                for (size_t i = 0; i < shorts.size(); ++i) {
+                    ref_f[i] = envelope::short_to_float(shorts[i]);
+                }
+
+                std::vector<float> floats;
+                for (size_t i = 0; i < ref_f.size(); ++i) {
+                    floats.push_back(ref_f[i]);
+                    floats.push_back(ref_f[i] * 1.5f);
+                    floats.push_back(-ref_f[i] * 3.0f + 1e-7f);
+                }
+                const float edges[] = { 0.0f, -0.0f, 1.0f, -1.0f,
+                    1.00001f, -1.00004f, 0.99999f, -0.99999f,
+                    1e-30f, -1e-30f, 1e30f, -1e30f,
+                    0.5f / 32767.0f, -0.5f / 32767.0f,
+                    1.0f / 32767.0f, 32767.5f / 32767.0f };
+                floats.insert(floats.end(), edges,
+                    edges + sizeof(edges) / sizeof(edges[0]));
+
+                std::vector<short> ref_s(floats.size());
+                std::vector<short> ref_clip(floats.size());
+                for (size_t i = 0; i < floats.size(); ++i) {
+                    ref_s[i] = clip_short(floats[i] * 32767.0f);
+                    ref_clip[i] = clip_short(floats[i] * 1000.0f);
+                }
+                std::vector<float> scaled(floats.size());
+                for (size_t i = 0; i < floats.size(); ++i) {
+                    scaled[i] = floats[i] * 1000.0f;
+                }
+
+                const int was = simd::simd_level();
+                for (int level = simd::SIMD_SCALAR;
+                     level <= simd::detected_simd_level(); ++level) {
+                    simd::set_simd_level(level);
+                    for (int off = 0; off < 3; ++off) {
+                        const size_t n = shorts.size() - off * 5;
+                        std::vector<float> f(n);
+                        envelope::history_t h;
+                        envelope::shorts_to_floats(&shorts[off],
+                            &shorts[off] + n, 2, &h);
+                        assert(h.size() == n);
+                        assert(memcmp(&h[0], &ref_f[off],
+                                   n * sizeof(float))
+                            == 0);
+
+                        const size_t m = floats.size() - off * 7;
+                        std::vector<short> out(m);
+                        floats_to_shorts(&floats[off],
+                            &floats[off] + m, &out[0], &out[0] + m, 2);
+                        assert(memcmp(&out[0], &ref_s[off],
+                                   m * sizeof(short))
+                            == 0);
+
+                        clip_shorts(&scaled[off], &scaled[off] + m,
+                            &out[0]);
+                        assert(memcmp(&out[0], &ref_clip[off],
+                                   m * sizeof(short))
+                            == 0);
+                    }
+                }
+                simd::set_simd_level(was);
+            }
+
+            // The unrolled 1/2/6/8 channel loops and the runtime one
+            // (3 channels here) must all do exactly what calling
+            // update() sample by sample does.
+            inline void check_channel_specializations() {
+                const int counts[] = { 1, 2, 3, 6, 8 };
+                for (int c = 0; c < 5; ++c) {
+                    const int nch = counts[c];
+                    std::vector<short> in(4410 * nch);
+                    unsigned int seed = 99;
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        const short v = (short)(seed >> 16);
+                        in[i] = (i < in.size() / 2) ? (short)(v / 256)
+                                                    : v;
+                    }
+                    const short* const b = &in[0];
+                    const short* const e = b + in.size();
+                    const float att = 0.3f;
+
+                    envelope ref(44100, nch, 2.0f, 50.0f);
+                    const short* ref_hit = e;
+                    for (const short* p = b; p < e;) {
+                        bool done = false;
+                        for (int ch = 0; ch < nch; ++ch) {
+                            done |= ref.update(*p++) >= att;
+                        }
+                        if (done) {
+                            ref_hit = p;
+                            break;
+                        }
+                    }
+                    assert(ref_hit != e);
+
+                    envelope env(44100, nch, 2.0f, 50.0f);
+                    const short* hit = env.envelope_shorts(b, e, &att);
+                    assert(hit == ref_hit);
+                    assert(env() == ref());
+
+                    envelope ref_all(44100, nch, 2.0f, 50.0f);
+                    envelope env_all(44100, nch, 2.0f, 50.0f);
+                    for (const short* p = b; p < e; ++p) {
+                        ref_all.update(*p);
+                    }
+                    env_all.envelope_shorts(b, e);
+                    assert(env_all() == ref_all());
+                    (void)hit;
+
+                    std::vector<float> f(in.size());
+                    envelope::floatvec_t fv(in.size());
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        fv[i] = envelope::short_to_float(in[i]) * 1.7f;
+                    }
+                    std::vector<short> out(in.size());
+                    floats_to_shorts(fv.begin(), fv.end(), &out[0],
+                        &out[0] + out.size(), nch);
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        assert(out[i] == clip_short(fv[i] * 32767.0f));
+                    }
+                }
+            }
+
+            // PER_CHANNEL and LINKED take real times whatever the
+            // channel count: one loud channel out of six (or eight)
+            // must cross TAU at the attack time, and TAU_DECAY at the
+            // release time, as a mono envelope would.
+            inline void check_envelope_modes() {
+                const envelope::channel_mode_t modes[]
+                    = { envelope::PER_CHANNEL, envelope::LINKED };
+                const int counts[] = { 6, 8 };
+                for (int m = 0; m < 2; ++m) {
+                    for (int c = 0; c < 2; ++c) {
+                        const int nch = counts[c];
+                        const int loud_ch = nch - 2;
+                        std::vector<short> in(44100 * 2 * nch, 0);
+                        for (size_t i = loud_ch; i < in.size() / 2;
+                             i += nch) {
+                            in[i] = 32767;
+                        }
+                        const short* const b = &in[0];
+                        const short* const e = b + in.size();
+                        const float att_ms = 10.0f;
+                        const float rel_ms = 200.0f;
+
+                        envelope env(
+                            44100, nch, att_ms, rel_ms, modes[m]);
+                        const float tau = TAU;
+                        const short* hit
+                            = env.envelope_shorts(b, e, &tau);
+                        float ms = env.sample_pos_in_msecs(
+                            (int)(hit - b));
+                        assert(fabsf(ms - att_ms) <= 0.1f * att_ms);
+                        if (modes[m] == envelope::PER_CHANNEL) {
+                            assert(env.channel_level(0) == 0.0f);
+                            assert(env.channel_level(loud_ch)
+                                == env());
+                        }
+
+                        // finish the loud second, then let it go
+                        env.envelope_shorts(hit, b + in.size() / 2);
+                        assert(my::float_equal(env(), 1.0f, 0.01f));
+                        const float decay = TAU_DECAY;
+                        hit = env.envelope_shorts(
+                            b + in.size() / 2, e, NULL, &decay);
+                        assert(hit != e);
+                        ms = env.sample_pos_in_msecs(
+                                 (int)(hit - b))
+                            - 1000.0f;
+                        assert(fabsf(ms - rel_ms) <= 0.1f * rel_ms);
+                        (void)ms;
+
+                        // and the block path is the frame-at-a-time
+                        // path.
+                        envelope a(44100, nch, 3.0f, 30.0f, modes[m]);
+                        envelope f(44100, nch, 3.0f, 30.0f, modes[m]);
+                        a.set_fast_forward(false);
+                        envelope::history_t fl;
+                        envelope::shorts_to_floats(b, e, nch, &fl);
+                        for (size_t i = 0; i < fl.size(); i += nch) {
+                            f.update_frame(&fl[i]);
+                        }
+                        a.envelope_shorts(b, e);
+                        for (int ch = 0; ch < nch; ++ch) {
+                            assert(a.channel_level(ch)
+                                == f.channel_level(ch));
+                        }
+                    }
+                }
+            }
+
+            // Jumping over silence and DC in closed form must land
+            // where stepping through them does: same level (to float
+            // rounding) and sentinels within a frame.
+            inline void check_silence_fast_forward() {
+                const envelope::channel_mode_t modes[]
+                    = { envelope::MIXED, envelope::LINKED,
+                          envelope::PER_CHANNEL };
+                const int counts[] = { 2, 2, 6 };
+                for (int m = 0; m < 3; ++m) {
+                    const int nch = counts[m];
+                    const size_t sec = 44100 * (size_t)nch;
+                    std::vector<short> in(5 * sec, 0);
+                    unsigned int seed = 777;
+                    for (size_t i = 0; i < sec / 2; ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        in[i] = (short)(seed >> 16);
+                    }
+                    std::fill(in.begin() + 3 * sec + sec / 2,
+                        in.begin() + 4 * sec, (short)-12000);
+                    const short* const b = &in[0];
+                    const short* const e = b + in.size();
+
+                    const float att = 0.3f;
+                    const float rel = FORTY_DB_DOWN();
+                    const float deep = 1e-7f;
+                    const float* sentinels[4][2]
+                        = { { NULL, NULL }, { NULL, &rel },
+                              { &att, NULL }, { NULL, &deep } };
+                    for (int i = 0; i < 4; ++i) {
+                        envelope fast(44100, nch, 5.0f, 50.0f, modes[m]);
+                        envelope slow(44100, nch, 5.0f, 50.0f, modes[m]);
+                        slow.set_fast_forward(false);
+                        // skip the noise: the sentinels are for the
+                        // constant stretches
+                        fast.envelope_shorts(b, b + sec / 2);
+                        slow.envelope_shorts(b, b + sec / 2);
+                        const short* pf = fast.envelope_shorts(b + sec / 2,
+                            e, sentinels[i][0], sentinels[i][1]);
+                        const short* ps = slow.envelope_shorts(b + sec / 2,
+                            e, sentinels[i][0], sentinels[i][1]);
+                        assert(i == 0 || ps != e);
+                        assert(pf - ps <= nch && ps - pf <= nch);
+                        const float lf = fast();
+                        const float ls = slow();
+                        assert(fabsf(lf - ls) <= 1e-4f * ls + 1e-9f);
+                        (void)pf;
+                        (void)ps;
+                        (void)lf;
+                        (void)ls;
+                    }
+                }
+            }
+
+            // The history must be exactly the per-frame levels, taken
+            // in blocks, whichever loop (or the fast-forward) made them,
+            // and however the input was split into calls.
+            inline void check_envelope_history() {
+                const envelope::channel_mode_t modes[]
+                    = { envelope::MIXED, envelope::LINKED,
+                          envelope::PER_CHANNEL };
+                const int counts[] = { 2, 1, 6 };
+                const size_t block = 100;
+                const size_t capacity = 40;
+                for (int m = 0; m < 3; ++m) {
+                    const int nch = counts[m];
+                    const size_t nframes = 10037;
+                    std::vector<short> in(nframes * nch);
+                    unsigned int seed = 99;
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        const bool loud = ((i / nch / 700) % 2) == 0;
+                        in[i] = (short)((short)(seed >> 16) >> (loud ? 1 : 6));
+                    }
+                    // a constant stretch, for the fast-forward
+                    std::fill(in.begin() + 3000 * nch,
+                        in.begin() + 5500 * nch, (short)16000);
+                    const short* const b = &in[0];
+                    const short* const e = b + in.size();
+
+                    // what it should be: every frame's level...
+                    envelope ref(44100, nch, 2.0f, 20.0f, modes[m]);
+                    envelope::history_t fl;
+                    envelope::shorts_to_floats(b, e, nch, &fl);
+                    std::vector<float> levels(nframes);
+                    for (size_t f = 0; f < nframes; ++f) {
+                        levels[f] = ref.update_frame(&fl[f * nch]);
+                    }
+
+                    for (int ff = 0; ff < 2; ++ff) {
+                        envelope env(44100, nch, 2.0f, 20.0f, modes[m]);
+                        env.set_fast_forward(ff != 0);
+                        env.set_stream_block_frames(333);
+                        env.set_history(block, capacity);
+                        // in three goes, one of them stopped by a
+                        // sentinel
+                        const short* p = env.envelope_shorts(b, b + 1234 * nch);
+                        const float att = 0.45f;
+                        bool hit = false;
+                        p = env.envelope_shorts(p, e, &att, NULL, &hit);
+                        assert(hit);
+                        env.envelope_shorts(p, e);
+
+                        const envelope_history& h = env.history();
+                        assert(h.total_blocks() == nframes / block);
+                        assert(h.size() == capacity);
+                        const float tol = ff ? 1e-5f : 0.0f;
+                        for (size_t i = 0; i < h.size(); ++i) {
+                            const size_t f0 = (h.first_block() + i) * block;
+                            const float lo = *std::min_element(
+                                &levels[f0], &levels[f0] + block);
+                            const float hi = *std::max_element(
+                                &levels[f0], &levels[f0] + block);
+                            const float last = levels[f0 + block - 1];
+                            assert(fabsf(h[i].lo - lo) <= tol);
+                            assert(fabsf(h[i].hi - hi) <= tol);
+                            assert(fabsf(h[i].last - last) <= tol);
+                            (void)lo;
+                            (void)hi;
+                            (void)last;
+                        }
+                        (void)tol;
+                    }
+                }
+            }
+
+            // The counters add up to what was asked for, and say where
+            // a sentinel left converted samples unused. Compiled out,
+            // they're all nothing.
+            inline void check_envelope_stats() {
+                envelope env(44100, 2, 1.0f, 100.0f);
+                if (!envelope::stats_enabled()) {
+                    std::vector<short> v(10000, 1000);
+                    env.envelope_shorts(&v[0], &v[0] + v.size());
+                    const envelope_stats s = env.stats();
+                    assert(s.calls == 0 && s.samples_converted == 0
+                        && s.samples_fast_forwarded == 0);
+                    (void)s;
+                    return;
+                }
+                const size_t block = env.stream_block_frames() * 2;
+                std::vector<short> v(block * 3 + 100);
+                for (size_t i = 0; i < v.size(); ++i) {
+                    v[i] = (short)((i * 7919) % 2000 - 1000);
+                }
+                // silence up front, to be fast-forwarded
+                std::fill(v.begin(), v.begin() + 1000, (short)0);
+                env.envelope_shorts(&v[0], &v[0] + v.size());
+                envelope_stats s = env.take_stats();
+                assert(s.calls == 1 && s.sentinel_hits == 0);
+                assert(s.samples_fast_forwarded == 1000);
+                assert(s.samples_converted == v.size() - 1000);
+                assert(s.samples_enveloped == s.samples_converted);
+                assert(s.samples_wasted() == 0);
+                assert(s.conversion_bytes_allocated
+                    == env.conversion_buffer_bytes());
+                assert(env.stats().calls == 0);
+
+                // a sentinel part way into the second block (stepped
+                // through, not fast-forwarded to)
+                std::fill(v.begin() + (ptrdiff_t)block + 500, v.end(),
+                    (short)30000);
+                env.reset_stats();
+                env.set_envelope_to(0);
+                env.set_fast_forward(false);
+                const float att = 0.5f;
+                const short* at = env.envelope_shorts(
+                    &v[0], &v[0] + v.size(), &att);
+                s = env.stats();
+                const size_t used = (size_t)(at - &v[0]);
+                assert(s.sentinel_hits == 1);
+                assert(s.samples_enveloped == used);
+                assert(s.samples_wasted() == 2 * block - used);
+                assert(s.conversion_bytes_allocated == 0);
+
+                envelope_stats total;
+                total += s;
+                total += s;
+                assert(total.samples_enveloped == 2 * s.samples_enveloped);
+                (void)used;
+            }
+
+            namespace detail {
+                // A stereo buffer whose loudest sample is on the right
+                // channel, at 'peak', with the left channel quieter.
+                template <typename T>
+                inline void fill_for_normalize(
+                    std::vector<T>& v, double peak) {
+                    unsigned int seed = 31337;
+                    for (size_t i = 0; i < v.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        const double r
+                            = (double)((seed >> 8) & 0xffff) / 65536.0
+                            - 0.5;
+                        v[i] = (T)(r * peak * ((i % 2) ? 1.0 : 0.5));
+                    }
+                    v[v.size() - 1001] = (T)(-peak);
+                }
+
+                template <typename T>
+                inline void check_normalize_type(
+                    double full_scale, bool is_24 = false) {
+                    std::vector<T> v(20011);
+                    fill_for_normalize(v, full_scale / 4);
+                    const std::vector<T> orig(v);
+                    T* const b = &v[0];
+                    T* const e = b + v.size();
+                    const float gain = is_24
+                        ? normalize_buffer_24((int*)b, (int*)e, 2)
+                        : normalize_buffer(b, e, 2);
+                    assert(my::float_equal(gain, 4.0f, 0.01f));
+                    // the peak is now full scale...
+                    assert(fabs((double)v[v.size() - 1001] + full_scale)
+                        <= full_scale * 1e-6 + 1.0);
+                    // ...and every sample, both channels, was scaled.
+                    for (size_t i = 0; i < v.size(); i += 97) {
+                        const double want = (double)orig[i] * gain;
+                        assert(fabs((double)v[i] - want)
+                            <= fabs(want) * 1e-6 + 1.0);
+                        (void)want;
+                    }
+                    (void)gain;
+
+                    // Near-silence is left alone.
+                    fill_for_normalize(v, full_scale / 1000);
+                    const std::vector<T> quiet(v);
+                    const float g2 = is_24
+                        ? normalize_buffer_24((int*)b, (int*)e, 2)
+                        : normalize_buffer(b, e, 2);
+                    assert(g2 == 1.0f && v == quiet);
+                    (void)g2;
+                }
+
+                // The SIMD levels must give exactly the scalar bits.
+                template <typename T>
+                inline void check_normalize_levels(double full_scale) {
+                    std::vector<T> ref(40013);
+                    fill_for_normalize(ref, full_scale / 3);
+                    const std::vector<T> orig(ref);
+                    const int was = simd::simd_level();
+                    simd::set_simd_level(simd::SIMD_SCALAR);
+                    normalize_buffer(&ref[0], &ref[0] + ref.size(), 2);
+                    for (int level = simd::SIMD_SSE2;
+                         level <= simd::detected_simd_level(); ++level) {
+                        simd::set_simd_level(level);
+                        std::vector<T> v(orig);
+                        normalize_buffer(&v[0], &v[0] + v.size(), 2);
+                        assert(memcmp(&v[0], &ref[0],
+                                   v.size() * sizeof(T))
+                            == 0);
+                    }
+                    simd::set_simd_level(was);
+                }
+            } // namespace detail
+
+            // Every channel found and scaled (not just the first
+            // sample of each frame), for every sample type.
+            inline void check_normalize_buffer() {
+                detail::check_normalize_type<short>(32767.0);
+                detail::check_normalize_type<int>(2147483647.0);
+                detail::check_normalize_type<int>(8388607.0, true);
+                detail::check_normalize_type<float>(1.0);
+                detail::check_normalize_levels<short>(32767.0);
+                detail::check_normalize_levels<float>(1.0);
+            }
+
             void reverse_vector() {
                 std::vector<short> v;
                 v.push_back(1);
@@ -640,7 +2073,9 @@ namespace cpp98 {
                 ps = b;
                 i = 0;
                 while (ps < ps_end) {
-                    assert(*ps++ == i++);
+                    const bool same = *ps++ == i++;
+                    assert(same);
+                    (void)same;
                 }
 
                 my::cpp98::audio::reverse_samples(b, e);
@@ -0,0 +1,284 @@
+/*/
+ * Lots of independent envelopes, updated in lockstep.
+ *
+ * One envelope per stream costs a function call and a data-dependent
+ * branch (attack or release?) per sample, per stream. envelope_bank keeps
+ * the state of N envelopes in structure-of-arrays form (all the levels
+ * together, all the attack coefficients together, ...) so that 4 (SSE2)
+ * or 8 (AVX2) streams are updated by one instruction, and the attack /
+ * release choice becomes a compare-and-select instead of a branch.
+ *
+ * Each lane tracks exactly what a my::cpp98::audio::envelope with the
+ * same settings would do, given the same samples.
+ *
+ * Input is "step-major": for each step (sample time), one value per
+ * stream, streams adjacent:
+ *
+ *      in[step * size() + stream]
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_ENVELOPE_BANK_HPP
+#define CPP_98_AUDIO_ENVELOPE_BANK_HPP
+
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        namespace detail {
+
+            // The envelope::update() recurrence, for lanes [i, n) of
+            // nsteps steps. Each lane's level stays in a register
+            // across all the steps.
+            inline void scalar_bank_update(float* env, const float* ga,
+                const float* gr, const float* in, size_t i,
+                const size_t n, const size_t stride,
+                const size_t nsteps, float* out) {
+                for (; i < n; ++i) {
+                    float e = env[i];
+                    const float a = ga[i];
+                    const float r = gr[i];
+                    for (size_t t = 0; t < nsteps; ++t) {
+                        const float x = fabsf(in[t * stride + i]);
+                        const float g = (e < x) ? a : r;
+                        e = x + g * (e - x);
+                        if (out) out[t * stride + i] = e;
+                    }
+                    env[i] = e;
+                }
+            }
+
+#if defined(CPP98AUDIO_HAVE_SSE2)
+            inline size_t sse2_bank_update(float* env, const float* ga,
+                const float* gr, const float* in, const size_t n,
+                const size_t stride, const size_t nsteps, float* out) {
+                const __m128 sign = _mm_set1_ps(-0.0f);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m128 e = _mm_loadu_ps(env + i);
+                    const __m128 a = _mm_loadu_ps(ga + i);
+                    const __m128 r = _mm_loadu_ps(gr + i);
+                    for (size_t t = 0; t < nsteps; ++t) {
+                        const __m128 x = _mm_andnot_ps(
+                            sign, _mm_loadu_ps(in + t * stride + i));
+                        const __m128 m = _mm_cmplt_ps(e, x);
+                        const __m128 g = _mm_or_ps(
+                            _mm_and_ps(m, a), _mm_andnot_ps(m, r));
+                        e = _mm_add_ps(
+                            x, _mm_mul_ps(g, _mm_sub_ps(e, x)));
+                        if (out) _mm_storeu_ps(out + t * stride + i, e);
+                    }
+                    _mm_storeu_ps(env + i, e);
+                }
+                return i;
+            }
+#endif
+
+#if defined(CPP98AUDIO_HAVE_AVX2)
+            CPP98AUDIO_TARGET_AVX2
+            inline size_t avx2_bank_update(float* env, const float* ga,
+                const float* gr, const float* in, const size_t n,
+                const size_t stride, const size_t nsteps, float* out) {
+                const __m256 sign = _mm256_set1_ps(-0.0f);
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256 e = _mm256_loadu_ps(env + i);
+                    const __m256 a = _mm256_loadu_ps(ga + i);
+                    const __m256 r = _mm256_loadu_ps(gr + i);
+                    for (size_t t = 0; t < nsteps; ++t) {
+                        const __m256 x = _mm256_andnot_ps(
+                            sign, _mm256_loadu_ps(in + t * stride + i));
+                        const __m256 m = _mm256_cmp_ps(e, x, _CMP_LT_OQ);
+                        const __m256 g = _mm256_blendv_ps(r, a, m);
+                        e = _mm256_add_ps(
+                            x, _mm256_mul_ps(g, _mm256_sub_ps(e, x)));
+                        if (out)
+                            _mm256_storeu_ps(out + t * stride + i, e);
+                    }
+                    _mm256_storeu_ps(env + i, e);
+                }
+                return i;
+            }
+#endif
+        } // namespace detail
+
+        class envelope_bank {
+            public:
+            typedef std::vector<float> floatvec_t;
+
+            // nch is what each stream's envelope would have been
+            // constructed with: it scales the times the same way.
+            envelope_bank(size_t nstreams, int samplerate, int nch = 1,
+                float attms = 10.0f, float relms = 100.0f)
+                : m_samplerate((float)samplerate)
+                , m_nch(nch)
+                , m_env(nstreams, 0.0f)
+                , m_ga(nstreams, coef(attms))
+                , m_gr(nstreams, coef(relms)) {
+                assert(m_nch > 0);
+                assert(m_samplerate > 0 && m_samplerate < 192000);
+            }
+
+            inline size_t size() const { return m_env.size(); }
+            inline int channels() const { return m_nch; }
+            inline int samplerate() const { return (int)m_samplerate; }
+
+            // The current level of stream i.
+            inline float operator[](size_t i) const { return m_env[i]; }
+            inline const float* levels() const {
+                return m_env.empty() ? NULL : &m_env[0];
+            }
+            inline void set_envelope_to(size_t i, const float f) {
+                m_env[i] = f;
+            }
+
+            inline void set_attack_ms(size_t i, float millisecs) {
+                m_ga[i] = coef(millisecs);
+            }
+            inline void set_release_ms(size_t i, float millisecs) {
+                m_gr[i] = coef(millisecs);
+            }
+            inline void set_attack_ms(float millisecs) {
+                std::fill(m_ga.begin(), m_ga.end(), coef(millisecs));
+            }
+            inline void set_release_ms(float millisecs) {
+                std::fill(m_gr.begin(), m_gr.end(), coef(millisecs));
+            }
+
+            // One sample for each stream: in[0 .. size()).
+            inline void update(const float* in) { update(in, 1); }
+
+            // nsteps samples for each stream, step-major (see top of
+            // file). If out is given, it gets every level, laid out
+            // the same way as in.
+            inline void update(
+                const float* in, size_t nsteps, float* out = NULL) {
+                const size_t n = size();
+                if (n == 0 || nsteps == 0) return;
+                float* env = &m_env[0];
+                const float* ga = &m_ga[0];
+                const float* gr = &m_gr[0];
+                size_t done = 0;
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd::simd_level() >= simd::SIMD_AVX2) {
+                    done = detail::avx2_bank_update(
+                        env, ga, gr, in, n, n, nsteps, out);
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (done == 0 && simd::simd_level() >= simd::SIMD_SSE2) {
+                    done = detail::sse2_bank_update(
+                        env, ga, gr, in, n, n, nsteps, out);
+                }
+#endif
+                detail::scalar_bank_update(
+                    env, ga, gr, in, done, n, n, nsteps, out);
+            }
+
+            // As above, for shorts. They are converted (as
+            // envelope::update(short) would) a few steps at a time.
+            inline void update(
+                const short* in, size_t nsteps, float* out = NULL) {
+                const size_t n = size();
+                if (n == 0 || nsteps == 0) return;
+                size_t steps_per_block = BLOCK_SAMPLES / n;
+                if (steps_per_block == 0) steps_per_block = 1;
+                m_conversion_buffer.resize(steps_per_block * n);
+
+                while (nsteps) {
+                    const size_t steps
+                        = nsteps < steps_per_block ? nsteps
+                                                   : steps_per_block;
+                    simd::shorts_to_floats(
+                        in, in + steps * n, &m_conversion_buffer[0]);
+                    update(&m_conversion_buffer[0], steps, out);
+                    in += steps * n;
+                    if (out) out += steps * n;
+                    nsteps -= steps;
+                }
+            }
+
+            private:
+            enum { BLOCK_SAMPLES = 4096 };
+
+            float m_samplerate;
+            int m_nch;
+            floatvec_t m_env, m_ga, m_gr;
+            floatvec_t m_conversion_buffer;
+
+            inline float coef(float ms) const {
+                return envelope::time_coef(m_samplerate, ms * m_nch);
+            }
+        };
+
+        namespace test {
+
+            // Every lane of a bank must follow its own envelope. 37
+            // streams: a few full vectors and a ragged tail.
+            inline void check_envelope_bank() {
+                const size_t nstreams = 37;
+                const size_t nsteps = 3000;
+                std::vector<envelope*> envs;
+                envelope_bank bank(nstreams, 44100, 1, 10.0f, 100.0f);
+                for (size_t i = 0; i < nstreams; ++i) {
+                    const float att = 1.0f + (float)i;
+                    const float rel = 20.0f + 10.0f * (float)i;
+                    envs.push_back(new envelope(44100, 1, att, rel));
+                    bank.set_attack_ms(i, att);
+                    bank.set_release_ms(i, rel);
+                }
+
+                std::vector<short> in(nsteps * nstreams);
+                unsigned int seed = 4321;
+                for (size_t t = 0; t < nsteps; ++t) {
+                    // bursts and gaps, so lanes go both ways
+                    const bool loud = ((t / 200) % 2) == 0;
+                    for (size_t i = 0; i < nstreams; ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        short v = (short)(seed >> 16);
+                        if (!loud) v = (short)(v / 64);
+                        in[t * nstreams + i] = v;
+                    }
+                }
+
+                std::vector<float> out(in.size());
+                const int was = simd::simd_level();
+                for (int level = simd::SIMD_SCALAR;
+                     level <= simd::detected_simd_level(); ++level) {
+                    simd::set_simd_level(level);
+                    for (size_t i = 0; i < nstreams; ++i) {
+                        envs[i]->set_envelope_to(0);
+                        bank.set_envelope_to(i, 0);
+                    }
+                    bank.update(&in[0], nsteps, &out[0]);
+                    for (size_t t = 0; t < nsteps; ++t) {
+                        for (size_t i = 0; i < nstreams; ++i) {
+                            const float e = envs[i]->update(
+                                in[t * nstreams + i]);
+                            assert(my::float_equal(
+                                e, out[t * nstreams + i], 1e-6f));
+                            (void)e;
+                        }
+                    }
+                    for (size_t i = 0; i < nstreams; ++i) {
+                        assert(my::float_equal(
+                            (*envs[i])(), bank[i], 1e-6f));
+                    }
+                }
+                simd::set_simd_level(was);
+
+                for (size_t i = 0; i < nstreams; ++i) {
+                    delete envs[i];
+                }
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_ENVELOPE_BANK_HPP
@@ -0,0 +1,345 @@
+/*/
+ * The envelope in fixed point, straight off shorts: no floats at all.
+ *
+ * envelope_shorts() spends about half its time turning shorts into
+ * floats, and on a box with a weak (or no) FPU the float steps after
+ * cost more again. fixed_envelope does the same one-pole follower in
+ * integers:
+ *
+ *  - a sample is Q15 already; |x| << 16 makes it Q31 (full scale,
+ *    -32768, is clamped to just under 1);
+ *  - the level is Q31, in an int;
+ *  - the attack and release coefficients are Q31 too, not Q15: a
+ *    release of seconds needs a coefficient within 2^-20 of 1, and
+ *    Q15 can't get nearer 1 than 2^-15 (0.74s at 44.1kHz, at most);
+ *  - a step is one 32 x 32 -> 64 bit multiply and a shift.
+ *
+ * Sentinels are Q31 too: to_q31(TAU) and so on.
+ *
+ * Accuracy: the coefficients are the float envelope's (time_coef()),
+ * so the two follow the same curve, and differ only by rounding: the
+ * float level carries 24 bits, the Q31 one 31. test::check_fixed_
+ * envelope() holds them to:
+ *  - every level within 5e-6 (of full scale) of the float envelope's,
+ *    on noise, in every channel mode (about 3e-6 is typical: most of
+ *    it the float's rounding);
+ *  - sentinels firing within a frame, or 0.05% of the time taken,
+ *    of where the float envelope's do, over the attack and release
+ *    times check_envelope_attack() / check_envelope_release() try;
+ *    and those times themselves within 10%, as there.
+ * The shift rounds down, so a level heading down ends at exactly 0,
+ * and one heading up stops a few LSBs (of 2^-31) short.
+ *
+ * There's no fast-forward over constant runs and no history: this is
+ * the lean one.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_FIXED_HPP
+#define CPP_98_AUDIO_FIXED_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+#include "cpp_98_audio_envelope.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        // Q31: [0, 1) in 32 bits, a sign and 31 of fraction.
+        typedef int q31_t;
+#if defined(_MSC_VER)
+        typedef __int64 s64_t;
+#else
+        typedef long long s64_t;
+#endif
+
+        // Clamped to [0, 1 - 2^-31].
+        inline q31_t to_q31(double f) {
+            if (f <= 0) return 0;
+            const double q = f * 2147483648.0 + 0.5;
+            return q >= 2147483647.0 ? 0x7FFFFFFF : (q31_t)q;
+        }
+        inline float q31_to_float(q31_t q) {
+            return (float)((double)q / 2147483648.0);
+        }
+        // |s| in Q31.
+        inline q31_t short_to_q31(short s) {
+            const int a = s < 0 ? -(int)s : (int)s;
+            return a == 32768 ? 0x7FFFFFFF : a << 16;
+        }
+
+        class fixed_envelope {
+            public:
+            typedef envelope::channel_mode_t channel_mode_t;
+
+            fixed_envelope(int samplerate, int nch, float attms = 10.0f,
+                float relms = 100.0f,
+                channel_mode_t mode = envelope::MIXED)
+                : m_samplerate((float)samplerate)
+                , m_nch(nch)
+                , m_mode(mode)
+                , m_env(0)
+                , m_chan_env(size_t(nch > 0 ? nch : 1), 0) {
+                assert(nch > 0 && samplerate > 0);
+                set_attack_ms(attms);
+                set_release_ms(relms);
+            }
+
+            // The level (the loudest channel's, in PER_CHANNEL).
+            inline q31_t level() const {
+                if (m_mode == envelope::PER_CHANNEL) {
+                    return *std::max_element(
+                        m_chan_env.begin(), m_chan_env.end());
+                }
+                return m_env;
+            }
+            inline float operator()() const {
+                return q31_to_float(level());
+            }
+            inline q31_t channel_level(int ch) const {
+                return m_mode == envelope::PER_CHANNEL
+                    ? m_chan_env[(size_t)ch]
+                    : m_env;
+            }
+            inline void set_envelope_to(q31_t q) {
+                m_env = q;
+                std::fill(m_chan_env.begin(), m_chan_env.end(), q);
+            }
+
+            inline channel_mode_t mode() const { return m_mode; }
+            inline int channels() const { return m_nch; }
+            inline int samplerate() const { return (int)m_samplerate; }
+            inline float attack_ms() const { return m_attms; }
+            inline float release_ms() const { return m_relms; }
+            // Times as envelope takes them: MIXED stretches them by
+            // the channel count, as it steps once a sample.
+            inline void set_attack_ms(float ms) {
+                m_attms = ms;
+                m_ga = coef(ms);
+            }
+            inline void set_release_ms(float ms) {
+                m_relms = ms;
+                m_gr = coef(ms);
+            }
+
+            // update(), in Q31: one sample.
+            inline q31_t update(short value) {
+                m_env = step(m_env, short_to_q31(value), m_ga, m_gr);
+                return m_env;
+            }
+
+            // As envelope::envelope_shorts(): whole frames; returns
+            // just past the frame a sentinel fired in, or end (phit
+            // tells the two apart).
+            const short* envelope_shorts(const short* begin,
+                const short* end,
+                const q31_t* const sentinel_attack = NULL,
+                const q31_t* const sentinel_release = NULL,
+                bool* const phit = NULL) {
+                assert((end - begin) % m_nch == 0);
+                // Out of reach, where there's no sentinel.
+                const s64_t att = sentinel_attack
+                    ? (s64_t)*sentinel_attack
+                    : (s64_t)1 << 32;
+                const s64_t rel
+                    = sentinel_release ? (s64_t)*sentinel_release : -1;
+                bool hit = false;
+                const short* at;
+                switch (m_nch) {
+                    case 1:
+                        at = frames<1>(begin, end, att, rel, hit);
+                        break;
+                    case 2:
+                        at = frames<2>(begin, end, att, rel, hit);
+                        break;
+                    case 6:
+                        at = frames<6>(begin, end, att, rel, hit);
+                        break;
+                    case 8:
+                        at = frames<8>(begin, end, att, rel, hit);
+                        break;
+                    default:
+                        at = frames<0>(begin, end, att, rel, hit);
+                        break;
+                }
+                if (phit) *phit = hit;
+                return at;
+            }
+
+            private:
+            inline q31_t coef(float ms) const {
+                if (m_mode == envelope::MIXED) ms *= (float)m_nch;
+                return to_q31(envelope::time_coef(m_samplerate, ms));
+            }
+
+            // envelope::step(), in Q31. The difference of two levels
+            // in [0, 1) fits in an int; the shift of a negative
+            // product is arithmetic on every compiler we build with.
+            static inline q31_t step(const q31_t env, const q31_t in,
+                const q31_t ga, const q31_t gr) {
+                const q31_t g = env < in ? ga : gr;
+                return in + (q31_t)(((s64_t)g * (s64_t)(env - in)) >> 31);
+            }
+
+            // NCH == 0 means "use m_nch".
+            template <int NCH>
+            inline const short* frames(const short* p, const short* e,
+                const s64_t att, const s64_t rel, bool& hit) {
+                const int nch = NCH ? NCH : m_nch;
+                const q31_t ga = m_ga;
+                const q31_t gr = m_gr;
+                if (m_mode == envelope::PER_CHANNEL) {
+                    q31_t local[NCH ? NCH : 1];
+                    q31_t* const chan = NCH ? local : &m_chan_env[0];
+                    if (NCH) {
+                        std::copy(m_chan_env.begin(),
+                            m_chan_env.begin() + nch, chan);
+                    }
+                    while (p < e && !hit) {
+                        q31_t loudest = 0;
+                        for (int ch = 0; ch < nch; ++ch) {
+                            chan[ch] = step(
+                                chan[ch], short_to_q31(p[ch]), ga, gr);
+                            loudest = my::max(loudest, chan[ch]);
+                        }
+                        p += nch;
+                        hit = loudest >= att || loudest <= rel;
+                    }
+                    if (NCH) {
+                        std::copy(chan, chan + nch, m_chan_env.begin());
+                    }
+                } else if (m_mode == envelope::LINKED) {
+                    q31_t env = m_env;
+                    while (p < e && !hit) {
+                        q31_t pk = short_to_q31(p[0]);
+                        for (int ch = 1; ch < nch; ++ch) {
+                            pk = my::max(pk, short_to_q31(p[ch]));
+                        }
+                        p += nch;
+                        env = step(env, pk, ga, gr);
+                        hit = env >= att || env <= rel;
+                    }
+                    m_env = env;
+                } else {
+                    q31_t env = m_env;
+                    while (p < e && !hit) {
+                        for (int ch = 0; ch < nch; ++ch) {
+                            env = step(env, short_to_q31(p[ch]), ga, gr);
+                            hit |= env >= att || env <= rel;
+                        }
+                        p += nch;
+                    }
+                    m_env = env;
+                }
+                return p;
+            }
+
+            float m_samplerate;
+            int m_nch;
+            channel_mode_t m_mode;
+            float m_attms, m_relms;
+            q31_t m_ga, m_gr;
+            q31_t m_env;
+            std::vector<q31_t> m_chan_env; // PER_CHANNEL only
+        };
+
+        namespace test {
+
+            // The accuracy promised above.
+            inline void check_fixed_envelope() {
+                const int nch = 2;
+                const int sr = 44100;
+
+                // Levels, on noise that comes and goes.
+                std::vector<short> noise(sr * nch);
+                unsigned int seed = 31;
+                for (size_t i = 0; i < noise.size(); ++i) {
+                    seed = seed * 1103515245u + 12345u;
+                    const int shift = (i / 10000) % 3 * 4;
+                    noise[i] = (short)((short)(seed >> 16) >> shift);
+                }
+                const envelope::channel_mode_t modes[]
+                    = { envelope::MIXED, envelope::PER_CHANNEL,
+                          envelope::LINKED };
+                for (int m = 0; m < 3; ++m) {
+                    envelope fl(sr, nch, 5.0f, 200.0f, modes[m]);
+                    fl.set_fast_forward(false);
+                    fixed_envelope fx(sr, nch, 5.0f, 200.0f, modes[m]);
+                    double worst = 0;
+                    for (size_t i = 0; i < noise.size(); i += 512) {
+                        const short* b = &noise[i];
+                        const short* e = b + my::min(
+                            (size_t)512, noise.size() - i);
+                        fl.envelope_shorts(b, e);
+                        fx.envelope_shorts(b, e);
+                        worst = my::max(worst, fabs((double)fl() - fx()));
+                    }
+                    assert(worst < 5e-6);
+                    (void)worst;
+                }
+
+                // Sentinels, over check_envelope_attack() / _release()'s
+                // times.
+                const float times[][2] = { { 1.0f, 100.0f },
+                    { 100.0f, 1000.0f }, { 10.0f, 500.0f },
+                    { 50.0f, 2000.0f }, { 0.1f, 1000.0f },
+                    { 50.0f, 10000.0f } };
+                std::vector<short> loud(sr * nch * 12, 32767);
+                std::vector<short> quiet(sr * nch * 12, 0);
+                for (int t = 0; t < 6; ++t) {
+                    const float a = times[t][0];
+                    const float r = times[t][1];
+                    envelope fl(sr, nch, a, r);
+                    fl.set_fast_forward(false);
+                    fixed_envelope fx(sr, nch, a, r);
+                    const float up = TAU;
+                    const q31_t qup = to_q31(TAU);
+                    const short* lb = &loud[0];
+                    const short* le = lb + loud.size();
+                    const long pf
+                        = (long)(fl.envelope_shorts(lb, le, &up) - lb);
+                    const long px
+                        = (long)(fx.envelope_shorts(lb, le, &qup) - lb);
+                    assert(std::labs(px - pf) <= nch + pf / 2000);
+
+                    const float att_ms = (float)px / nch * 1000.0f / sr;
+                    assert(fabs(att_ms - a) <= 0.1 * a + 1000.0 / sr);
+
+                    fl.set_envelope_to(1.0f);
+                    fx.set_envelope_to(to_q31(1.0));
+                    const float down = TAU_DECAY;
+                    const q31_t qdown = to_q31(TAU_DECAY);
+                    const short* qb = &quiet[0];
+                    const short* qe = qb + quiet.size();
+                    const long rf
+                        = (long)(fl.envelope_shorts(qb, qe, NULL, &down) - qb);
+                    const long rx
+                        = (long)(fx.envelope_shorts(qb, qe, NULL, &qdown) - qb);
+                    assert(std::labs(rx - rf) <= nch + rf / 2000);
+                    const float rel_ms = (float)rx / nch * 1000.0f / sr;
+                    assert(fabs(rel_ms - r) <= 0.1 * r);
+                    (void)pf;
+                    (void)att_ms;
+                    (void)rf;
+                    (void)rel_ms;
+                }
+
+                // Heading down, it gets to exactly nothing.
+                fixed_envelope fx(sr, 1, 1.0f, 1.0f);
+                fx.set_envelope_to(to_q31(0.9));
+                fx.envelope_shorts(&quiet[0], &quiet[0] + sr);
+                assert(fx.level() == 0);
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_FIXED_HPP
@@ -0,0 +1,311 @@
+/*/
+ * Frame-aware views of a multichannel buffer.
+ *
+ * Everywhere else here a buffer is a run of samples plus a channel
+ * count, interleaved: L R L R ... That's how files and sound cards
+ * have it, and it's what the envelopes take. It is not what per-
+ * channel work wants: one channel is every nch'th sample, and a loop
+ * over that won't vectorize. Planar (all of L, then all of R) will.
+ *
+ * frame_view says which a buffer is, and hands out what either layout
+ * needs: a sample by frame and channel, a channel as a random-access
+ * (my::iterator::strided) range, a plane, a frame. copy_frames()
+ * converts between the layouts (simd::interleave() /
+ * deinterleave(): shuffles, for stereo), reverse_frames() reverses in
+ * time without swapping channels, channel_peaks() is the per-channel
+ * pattern: deinterleave a tile, then run the (SIMD) kernel plane by
+ * plane.
+ *
+    short* s = ...; // interleaved stereo, n frames
+    std::vector<short> planes(n * 2);
+    frame_view<short> in(s, s + n * 2, 2);
+    frame_view<short> out(&planes[0], &planes[0] + n * 2, 2, PLANAR);
+    copy_frames(in, out);
+    short* right = out.plane(1);
+ *
+ * A view doesn't own anything: it's a pointer pair and a layout, cheap
+ * to copy, valid as long as the buffer is.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_FRAMES_HPP
+#define CPP_98_AUDIO_FRAMES_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+#include "my_iterator.h"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        enum sample_layout {
+            INTERLEAVED, // frame by frame: L R L R ...
+            PLANAR // channel by channel: L L ... R R ...
+        };
+
+        namespace detail {
+            template <typename T> struct unconst { typedef T type; };
+            template <typename T> struct unconst<const T> {
+                typedef T type;
+            };
+        } // namespace detail
+
+        template <typename T> class frame_view {
+            public:
+            typedef T value_type;
+            typedef my::iterator::ptrs<T> samples_type;
+            typedef my::iterator::strided<T> channel_iterator;
+
+            frame_view(T* begin, T* end, int nch,
+                sample_layout layout = INTERLEAVED)
+                : m_samples(begin, end), m_nch(nch), m_layout(layout) {
+                assert(nch > 0);
+                assert((size_t)(end - begin) % (size_t)nch == 0);
+            }
+
+            frame_view(const samples_type& samples, int nch,
+                sample_layout layout = INTERLEAVED)
+                : m_samples(samples), m_nch(nch), m_layout(layout) {
+                assert(nch > 0);
+                assert(samples.size() % (size_t)nch == 0);
+            }
+
+            inline int channels() const { return m_nch; }
+            inline size_t frames() const {
+                return m_samples.size() / (size_t)m_nch;
+            }
+            inline size_t size() const { return m_samples.size(); }
+            inline sample_layout layout() const { return m_layout; }
+            inline bool interleaved() const {
+                return m_layout == INTERLEAVED || m_nch == 1;
+            }
+            inline const samples_type& samples() const { return m_samples; }
+            inline T* data() const { return m_samples.data(); }
+
+            inline T& operator()(size_t frame, int ch) const {
+                assert(frame < frames() && ch >= 0 && ch < m_nch);
+                return m_layout == INTERLEAVED
+                    ? data()[frame * (size_t)m_nch + (size_t)ch]
+                    : data()[(size_t)ch * frames() + frame];
+            }
+
+            // One channel, frames() long, whichever the layout.
+            inline channel_iterator channel_begin(int ch) const {
+                assert(ch >= 0 && ch < m_nch);
+                if (m_layout == INTERLEAVED) {
+                    return m_samples.strided_begin(m_nch, ch);
+                }
+                return channel_iterator(data() + (size_t)ch * frames(), 1);
+            }
+            inline channel_iterator channel_end(int ch) const {
+                return channel_begin(ch) + (ptrdiff_t)frames();
+            }
+
+            // Planar only: channel ch, contiguous.
+            inline T* plane(int ch) const {
+                assert(m_layout == PLANAR || m_nch == 1);
+                assert(ch >= 0 && ch < m_nch);
+                return data() + (size_t)ch * frames();
+            }
+            // Interleaved only: frame f's channels() samples.
+            inline T* frame(size_t f) const {
+                assert(interleaved());
+                assert(f < frames());
+                return data() + f * (size_t)m_nch;
+            }
+
+            private:
+            samples_type m_samples;
+            int m_nch;
+            sample_layout m_layout;
+        };
+
+        // to gets from's frames, in its own layout. Same channels, same
+        // frames, separate buffers.
+        template <typename S, typename T>
+        inline void copy_frames(
+            const frame_view<S>& from, const frame_view<T>& to) {
+            assert(from.channels() == to.channels());
+            assert(from.frames() == to.frames());
+            const size_t n = from.frames();
+            const int nch = from.channels();
+            if (n == 0) return;
+            if (from.interleaved() == to.interleaved()) {
+                std::copy(from.data(), from.data() + from.size(), to.data());
+            } else if (from.interleaved()) {
+                simd::deinterleave<T>(from.data(), n, nch, to.data(), n);
+            } else {
+                simd::interleave<T>(from.data(), n, nch, to.data(), n);
+            }
+        }
+
+        // Backwards in time, every channel still where it was.
+        template <typename T>
+        inline void reverse_frames(const frame_view<T>& v) {
+            if (v.interleaved()) {
+                reverse_samples(v.data(), v.data() + v.size(), v.channels());
+                return;
+            }
+            for (int ch = 0; ch < v.channels(); ++ch) {
+                std::reverse(v.plane(ch), v.plane(ch) + v.frames());
+            }
+        }
+
+        // Each channel's largest |sample| into peaks[ch]: an int
+        // (0 .. 32768) for shorts, a float for floats. Interleaved
+        // input is deinterleaved a tile at a time first, so the scan
+        // is always simd::peak_abs() over a contiguous run.
+        template <typename T, typename P>
+        inline void channel_peaks(const frame_view<T>& v, P* peaks) {
+            typedef typename detail::unconst<T>::type sample_t;
+            const int nch = v.channels();
+            for (int ch = 0; ch < nch; ++ch) peaks[ch] = 0;
+            if (nch == 1 || !v.interleaved()) {
+                for (int ch = 0; ch < nch; ++ch) {
+                    const sample_t* p = v.plane(ch);
+                    peaks[ch] = simd::peak_abs(p, p + v.frames());
+                }
+                return;
+            }
+            const size_t tile = 1024;
+            std::vector<sample_t> planes(tile * (size_t)nch);
+            const size_t n = v.frames();
+            for (size_t f = 0; f < n; f += tile) {
+                const size_t k = my::min(tile, n - f);
+                simd::deinterleave(v.frame(f), k, nch, &planes[0], tile);
+                for (int ch = 0; ch < nch; ++ch) {
+                    const sample_t* p = &planes[(size_t)ch * tile];
+                    peaks[ch] = my::max(peaks[ch], (P)simd::peak_abs(p, p + k));
+                }
+            }
+        }
+
+        namespace test {
+
+            namespace detail {
+                template <typename T>
+                inline void check_layouts(int nch, size_t n) {
+                    std::vector<T> in(n * (size_t)nch);
+                    unsigned int seed = 77 + (unsigned int)nch;
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        in[i] = (T)((short)(seed >> 16));
+                    }
+                    std::vector<T> planes(in.size()), back(in.size());
+                    const frame_view<const T> iv(
+                        &in[0], &in[0] + in.size(), nch);
+                    const frame_view<T> pv(
+                        &planes[0], &planes[0] + planes.size(), nch, PLANAR);
+                    const frame_view<T> bv(
+                        &back[0], &back[0] + back.size(), nch);
+
+                    const int was = simd::simd_level();
+                    for (int level = simd::SIMD_SCALAR;
+                         level <= simd::detected_simd_level(); ++level) {
+                        simd::set_simd_level(level);
+                        std::fill(planes.begin(), planes.end(), (T)0);
+                        std::fill(back.begin(), back.end(), (T)0);
+                        copy_frames(iv, pv);
+                        for (size_t f = 0; f < n; ++f) {
+                            for (int ch = 0; ch < nch; ++ch) {
+                                assert(pv(f, ch) == iv(f, ch));
+                                assert(planes[(size_t)ch * n + f]
+                                    == in[f * (size_t)nch + (size_t)ch]);
+                            }
+                        }
+                        copy_frames(pv, bv);
+                        assert(back == in);
+
+                        // planes further apart than frames()
+                        const size_t plane = n + 5;
+                        std::vector<T> wide(plane * (size_t)nch, (T)1);
+                        simd::deinterleave(&in[0], n, nch, &wide[0], plane);
+                        for (int ch = 0; ch < nch; ++ch) {
+                            assert(std::equal(pv.plane(ch),
+                                pv.plane(ch) + n, &wide[(size_t)ch * plane]));
+                            assert(wide[(size_t)ch * plane + n] == (T)1);
+                        }
+                        std::fill(back.begin(), back.end(), (T)0);
+                        simd::interleave(&wide[0], n, nch, &back[0], plane);
+                        assert(back == in);
+                    }
+                    simd::set_simd_level(was);
+
+                    // a channel, as a range, in either layout
+                    for (int ch = 0; ch < nch; ++ch) {
+                        typename frame_view<const T>::channel_iterator a
+                            = iv.channel_begin(ch);
+                        typename frame_view<T>::channel_iterator b
+                            = pv.channel_begin(ch);
+                        assert(iv.channel_end(ch) - a == (ptrdiff_t)n);
+                        assert(std::equal(a, iv.channel_end(ch), b));
+                        assert(*std::max_element(a, iv.channel_end(ch))
+                            == *std::max_element(pv.plane(ch),
+                                pv.plane(ch) + n));
+                        assert(a[(ptrdiff_t)n - 1] == pv(n - 1, ch));
+                    }
+
+                    // the same peaks from either layout
+                    assert(nch <= 8);
+                    float pi[8], pp[8];
+                    channel_peaks(iv, pi);
+                    channel_peaks(pv, pp);
+                    assert(std::equal(pi, pi + nch, pp));
+                    for (int ch = 0; ch < nch; ++ch) {
+                        float pk = 0;
+                        for (size_t f = 0; f < n; ++f) {
+                            pk = my::max(pk, (float)fabs((float)iv(f, ch)));
+                        }
+                        assert(pi[ch] == pk);
+                    }
+
+                    // backwards, channels kept
+                    std::vector<T> rev(in);
+                    const frame_view<T> rv(&rev[0], &rev[0] + rev.size(), nch);
+                    reverse_frames(rv);
+                    reverse_frames(pv);
+                    for (size_t f = 0; f < n; ++f) {
+                        for (int ch = 0; ch < nch; ++ch) {
+                            assert(rv(f, ch) == iv(n - 1 - f, ch));
+                            assert(pv(f, ch) == iv(n - 1 - f, ch));
+                        }
+                    }
+                }
+            } // namespace detail
+
+            inline void check_frame_views() {
+                const int chans[] = { 1, 2, 3, 6, 8 };
+                const size_t sizes[] = { 1, 2, 7, 1037 };
+                for (int c = 0; c < 5; ++c) {
+                    for (int s = 0; s < 4; ++s) {
+                        detail::check_layouts<short>(chans[c], sizes[s]);
+                        detail::check_layouts<float>(chans[c], sizes[s]);
+                    }
+                }
+
+                // reverse_samples() with a channel count: stereo stays
+                // stereo (and an odd number of frames leaves the
+                // middle one alone).
+                short lr[] = { 1, -1, 2, -2, 3, -3 };
+                reverse_samples(lr, lr + 6, 2);
+                const short want[] = { 3, -3, 2, -2, 1, -1 };
+                assert(std::equal(lr, lr + 6, want));
+                std::vector<short> v(lr, lr + 6);
+                reverse_samples(v.begin(), v.end(), 2);
+                assert(v[0] == 1 && v[1] == -1 && v[5] == -3);
+                (void)want;
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_FRAMES_HPP
@@ -0,0 +1,400 @@
+/*/
+ * A chain of processing stages, run a tile at a time.
+ *
+ * The usual job is shorts_to_floats(), then an envelope, then a gain,
+ * then floats_to_shorts(): four passes, each over the whole file, and
+ * each one reading (and most writing) a buffer far bigger than any
+ * cache. That's memory-bound, however quick the kernels are.
+ *
+ * block_graph runs the same stages on one tile of the input at a time
+ * instead: converted into a scratch tile of floats small enough to
+ * stay in L1 (tile_frames(), 4096 samples by default), through every
+ * stage in turn, then converted into the output. One read of the
+ * input, one write of the output, whatever the number of stages; the
+ * scratch is the same few KB throughout.
+ *
+    envelope env(44100, 2);
+    envelope_stage level(env);
+    gain_stage half(0.5f);
+    block_graph g(2);
+    g.add(level).add(half);
+    g.run(in, in + n, out); // in == out is fine
+ *
+ * A stage is a block_stage: process() gets the tile (interleaved
+ * floats, in [-1, 1) for short input) and works on it in place. Ready-
+ * made ones: envelope_stage (levels and sentinels; the samples go
+ * through untouched), gain_stage, clip_stage, dynamics_stage, and
+ * function_stage for a plain function or functor. The graph doesn't
+ * own its stages: they must outlive it.
+ *
+ * A stage can stop the run, as a sentinel does: it returns how many of
+ * the tile's frames it did, the stages after it get just those, and
+ * run() returns where that was. Up to there, the output is exactly
+ * what the separate passes would have made.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_GRAPH_HPP
+#define CPP_98_AUDIO_GRAPH_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cstddef>
+#include <vector>
+
+#include "cpp_98_audio_buffer.hpp"
+#include "cpp_98_audio_dynamics.hpp"
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        class block_stage {
+            public:
+            virtual ~block_stage() {}
+            // frames frames of nch interleaved floats, in place.
+            // Returns the frames done: all of them, unless it wants the
+            // run to stop after fewer.
+            virtual size_t process(float* tile, size_t frames, int nch) = 0;
+            // Back to the start of a stream.
+            virtual void reset() {}
+        };
+
+        // Runs an envelope over the tiles; the samples pass through.
+        // With sentinels, the run stops just past the frame one fired
+        // in (hit() says whether one did).
+        class envelope_stage : public block_stage {
+            public:
+            explicit envelope_stage(envelope& env,
+                const float* sentinel_attack = NULL,
+                const float* sentinel_release = NULL)
+                : m_env(env)
+                , m_att(sentinel_attack)
+                , m_rel(sentinel_release)
+                , m_hit(false) {}
+
+            size_t process(float* tile, size_t frames, int nch) {
+                const float* const e = tile + frames * (size_t)nch;
+                const float* at
+                    = m_env.envelope_samples(tile, e, m_att, m_rel, &m_hit);
+                return (size_t)(at - tile) / (size_t)nch;
+            }
+            void reset() { m_hit = false; }
+
+            inline bool hit() const { return m_hit; }
+            inline envelope& env() const { return m_env; }
+
+            private:
+            envelope& m_env;
+            const float* m_att;
+            const float* m_rel;
+            bool m_hit;
+        };
+
+        // x * gain. No clamping: that's clip_stage's (or the short
+        // output's) job.
+        class gain_stage : public block_stage {
+            public:
+            explicit gain_stage(float gain = 1.0f) : m_gain(gain) {}
+
+            size_t process(float* tile, size_t frames, int nch) {
+                float* const e = tile + frames * (size_t)nch;
+                if (m_gain != 1.0f) {
+                    simd::scale_floats(tile, e, m_gain, -FLT_MAX, FLT_MAX);
+                }
+                return frames;
+            }
+
+            inline float gain() const { return m_gain; }
+            inline void set_gain(float gain) { m_gain = gain; }
+
+            private:
+            float m_gain;
+        };
+
+        // Clamps to [lo, hi].
+        class clip_stage : public block_stage {
+            public:
+            explicit clip_stage(float lo = -1.0f, float hi = 1.0f)
+                : m_lo(lo), m_hi(hi) {
+                assert(lo <= hi);
+            }
+
+            size_t process(float* tile, size_t frames, int nch) {
+                simd::scale_floats(
+                    tile, tile + frames * (size_t)nch, 1.0f, m_lo, m_hi);
+                return frames;
+            }
+
+            private:
+            float m_lo, m_hi;
+        };
+
+        // A compressor or limiter (see cpp_98_audio_dynamics.hpp), in
+        // place: its latency() still applies.
+        class dynamics_stage : public block_stage {
+            public:
+            explicit dynamics_stage(dynamics& dyn) : m_dyn(dyn) {}
+
+            size_t process(float* tile, size_t frames, int nch) {
+                m_dyn.process(tile, tile + frames * (size_t)nch);
+                return frames;
+            }
+            void reset() { m_dyn.reset(); }
+
+            private:
+            dynamics& m_dyn;
+        };
+
+        // Anything callable as f(float* tile, size_t frames, int nch):
+        // a function, or a functor (held by reference).
+        template <typename F> class function_stage : public block_stage {
+            public:
+            explicit function_stage(F& f) : m_f(f) {}
+
+            size_t process(float* tile, size_t frames, int nch) {
+                m_f(tile, frames, nch);
+                return frames;
+            }
+
+            private:
+            F& m_f;
+        };
+
+        class block_graph {
+            public:
+            enum {
+                // 16KB of floats: the tile, the input and output tiles
+                // around it all stay in L1 / L2.
+                DEFAULT_TILE_SAMPLES = 4096
+            };
+
+            explicit block_graph(int nch, size_t tile_frames = 0)
+                : m_nch(nch), m_tile_frames(tile_frames) {
+                assert(nch > 0);
+                if (m_tile_frames == 0) {
+                    m_tile_frames = my::max((size_t)1,
+                        (size_t)DEFAULT_TILE_SAMPLES / (size_t)nch);
+                }
+                m_tile.reset(m_tile_frames * (size_t)nch, 0.0f);
+            }
+
+            // Appends a stage: they run in the order added.
+            inline block_graph& add(block_stage& stage) {
+                m_stages.push_back(&stage);
+                return *this;
+            }
+            inline size_t stages() const { return m_stages.size(); }
+            inline void clear() { m_stages.clear(); }
+
+            inline int channels() const { return m_nch; }
+            inline size_t tile_frames() const { return m_tile_frames; }
+
+            // Every stage back to the start of a stream.
+            inline void reset() {
+                for (size_t i = 0; i < m_stages.size(); ++i) {
+                    m_stages[i]->reset();
+                }
+            }
+
+            // [begin, end) through every stage into out (which may be
+            // begin, or NULL for stages that only look). Shorts are
+            // converted as shorts_to_floats() / floats_to_shorts() at
+            // 32768 do it; floats go as they are. Returns end, or
+            // where a stage stopped the run.
+            inline const short* run(
+                const short* begin, const short* end, short* out) {
+                return run_tiles(begin, end, out);
+            }
+            inline const short* run(
+                const short* begin, const short* end, float* out) {
+                return run_tiles(begin, end, out);
+            }
+            inline const float* run(
+                const float* begin, const float* end, float* out) {
+                return run_tiles(begin, end, out);
+            }
+            inline const float* run(
+                const float* begin, const float* end, short* out) {
+                return run_tiles(begin, end, out);
+            }
+
+            private:
+            block_graph(const block_graph&);
+            block_graph& operator=(const block_graph&);
+
+            static inline void load(
+                const short* s, const short* e, float* d) {
+                simd::shorts_to_floats(s, e, d);
+            }
+            static inline void load(
+                const float* s, const float* e, float* d) {
+                std::copy(s, e, d);
+            }
+            static inline void store(
+                const float* s, const float* e, short* d) {
+                simd::floats_to_shorts(s, e, d, 32768.0f);
+            }
+            static inline void store(
+                const float* s, const float* e, float* d) {
+                std::copy(s, e, d);
+            }
+
+            template <typename S, typename D>
+            const S* run_tiles(const S* begin, const S* end, D* out) {
+                const size_t nch = (size_t)m_nch;
+                assert((size_t)(end - begin) % nch == 0);
+                const size_t nstages = m_stages.size();
+                float* const tile = m_tile.data();
+                const S* p = begin;
+                while (p < end) {
+                    const size_t n
+                        = my::min((size_t)(end - p) / nch, m_tile_frames);
+                    if (n == 0) break;
+                    load(p, p + n * nch, tile);
+                    size_t done = n;
+                    for (size_t i = 0; i < nstages && done; ++i) {
+                        done = my::min(
+                            done, m_stages[i]->process(tile, done, m_nch));
+                    }
+                    if (out) {
+                        D* const d = out + (p - begin);
+                        store(tile, tile + done * nch, d);
+                    }
+                    p += done * nch;
+                    if (done < n) return p;
+                }
+                return end;
+            }
+
+            int m_nch;
+            size_t m_tile_frames;
+            audio_buffer<float> m_tile;
+            std::vector<block_stage*> m_stages;
+        };
+
+        namespace test {
+
+            namespace detail {
+                // A user stage: counts frames, and flips the sign.
+                struct count_and_negate {
+                    count_and_negate() : frames(0) {}
+                    void operator()(float* tile, size_t n, int nch) {
+                        frames += n;
+                        for (size_t i = 0; i < n * (size_t)nch; ++i) {
+                            tile[i] = -tile[i];
+                        }
+                    }
+                    size_t frames;
+                };
+            } // namespace detail
+
+            inline void check_block_graph() {
+                const int nch = 2;
+                const size_t frames = 44100;
+                std::vector<short> in(frames * nch);
+                unsigned int seed = 99;
+                for (size_t i = 0; i < in.size(); ++i) {
+                    seed = seed * 1103515245u + 12345u;
+                    in[i] = (short)(seed >> 16);
+                    // quiet until 3/4 of the way in: the sentinel below
+                    // fires after that
+                    if (i < frames * nch * 3 / 4) in[i] = (short)(in[i] / 8);
+                }
+
+                // The separate passes, over the whole buffer.
+                std::vector<float> f(in.size());
+                simd::shorts_to_floats(&in[0], &in[0] + in.size(), &f[0]);
+                envelope ref_env(44100, nch);
+                ref_env.set_fast_forward(false);
+                ref_env.envelope_samples(&f[0], &f[0] + f.size());
+                simd::scale_floats(&f[0], &f[0] + f.size(), 1.5f,
+                    -FLT_MAX, FLT_MAX);
+                simd::scale_floats(&f[0], &f[0] + f.size(), 1.0f, -0.9f,
+                    0.9f);
+                std::vector<short> ref(in.size());
+                simd::floats_to_shorts(
+                    &f[0], &f[0] + f.size(), &ref[0], 32768.0f);
+
+                // The same, fused, however it's tiled; and in place.
+                const size_t tiles[] = { 0, 1, 7, 1000, 100000 };
+                for (int t = 0; t < 5; ++t) {
+                    envelope env(44100, nch);
+                    env.set_fast_forward(false);
+                    envelope_stage level(env);
+                    gain_stage gain(1.5f);
+                    clip_stage clip(-0.9f, 0.9f);
+                    block_graph g(nch, tiles[t]);
+                    g.add(level).add(gain).add(clip);
+                    assert(g.stages() == 3);
+                    std::vector<short> out(in);
+                    const short* at = g.run(&out[0], &out[0] + out.size(),
+                        &out[0]);
+                    assert(at == &out[0] + out.size());
+                    assert(out == ref);
+                    assert(env() == ref_env());
+                    (void)at;
+                }
+
+                // A sentinel stops it where envelope_shorts() stops.
+                {
+                    envelope a(44100, nch, 1.0f, 50.0f);
+                    a.set_fast_forward(false);
+                    const float up = 0.5f;
+                    bool hit = false;
+                    const short* want = a.envelope_shorts(&in[0],
+                        &in[0] + in.size(), &up, NULL, &hit);
+                    assert(hit && want < &in[0] + in.size());
+
+                    envelope b(44100, nch, 1.0f, 50.0f);
+                    b.set_fast_forward(false);
+                    envelope_stage level(b, &up);
+                    detail::count_and_negate user;
+                    function_stage<detail::count_and_negate> neg(user);
+                    block_graph g(nch, 1000);
+                    g.add(level).add(neg);
+                    std::vector<float> out(in.size(), 2.0f);
+                    const short* at
+                        = g.run(&in[0], &in[0] + in.size(), &out[0]);
+                    assert(at == want && level.hit());
+                    const size_t k = (size_t)(at - &in[0]);
+                    // the user stage saw only what was done
+                    assert(user.frames == k / nch);
+                    assert(out[k - 1] == -(float)in[k - 1] / 32768.0f);
+                    assert(out[k] == 2.0f);
+                    assert(b() == a());
+                    (void)at;
+                }
+
+                // A limiter as a stage: what it does on its own.
+                {
+                    std::vector<float> whole(in.size());
+                    simd::shorts_to_floats(
+                        &in[0], &in[0] + in.size(), &whole[0]);
+                    std::vector<float> tiled(whole);
+                    const dynamics_settings ls
+                        = dynamics_settings::limiter(0.5f);
+                    dynamics lim_a(44100, nch, ls);
+                    lim_a.process(&whole[0], &whole[0] + whole.size());
+                    dynamics lim_b(44100, nch, ls);
+                    dynamics_stage stage(lim_b);
+                    block_graph g(nch);
+                    g.add(stage);
+                    g.run(&tiled[0], &tiled[0] + tiled.size(), &tiled[0]);
+                    assert(tiled == whole);
+                    // and with nowhere to put it, nothing but the stages
+                    g.reset();
+                    g.run(&in[0], &in[0] + in.size(), (short*)NULL);
+                }
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_GRAPH_HPP
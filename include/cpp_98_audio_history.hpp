@@ -0,0 +1,166 @@
+/*/
+ * A decimated record of an envelope's level, in constant memory.
+ *
+ * Every block_frames() frames, one point: the lowest and highest level
+ * reached in the block, and the level at its end. That's what a meter
+ * or a waveform overlay draws, and an hour of stereo at 44.1kHz in
+ * 1024-frame blocks is 155K points (1.9MB), not 635M floats.
+ *
+ * Points go into a ring of fixed capacity(): once it's full, each new
+ * point pushes out the oldest. Index 0 is the oldest point kept.
+ * Point i covers the frames from (first_block() + i) * block_frames().
+ *
+ * envelope::set_history() switches recording on. Doing it costs a min,
+ * a max and a count per frame.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_HISTORY_HPP
+#define CPP_98_AUDIO_HISTORY_HPP
+
+#include <cstddef>
+#include <vector>
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        class envelope_history {
+            public:
+            struct point {
+                float lo; // lowest level in the block
+                float hi; // highest
+                float last; // at the end of the block
+            };
+
+            // Where the block being filled in has got to. The envelope
+            // keeps this in locals while it runs (see track()).
+            struct block_state {
+                float lo, hi;
+                size_t count;
+            };
+
+            envelope_history(size_t block_frames = 0, size_t capacity = 0) {
+                configure(block_frames, capacity);
+            }
+
+            // Starts over, recording a point every block_frames frames
+            // and keeping the latest capacity of them. Either being 0
+            // switches recording off.
+            inline void configure(size_t block_frames, size_t capacity) {
+                m_block = block_frames;
+                m_ring.assign(block_frames ? capacity : 0, point());
+                clear();
+            }
+
+            // Forgets every point (and the block in progress).
+            inline void clear() {
+                m_head = 0;
+                m_size = 0;
+                m_total = 0;
+                reset(m_state);
+            }
+
+            inline bool enabled() const { return !m_ring.empty(); }
+            inline size_t block_frames() const { return m_block; }
+            inline size_t capacity() const { return m_ring.size(); }
+            inline size_t size() const { return m_size; }
+            inline bool empty() const { return m_size == 0; }
+            // Points recorded since configure() / clear(), including
+            // the ones since pushed out.
+            inline size_t total_blocks() const { return m_total; }
+            // The block number of point 0.
+            inline size_t first_block() const { return m_total - m_size; }
+
+            inline const point& operator[](size_t i) const {
+                size_t at = m_head + (m_ring.size() - m_size) + i;
+                if (at >= m_ring.size()) at -= m_ring.size();
+                return m_ring[at];
+            }
+            inline const point& back() const { return (*this)[m_size - 1]; }
+
+            // Copies up to n points, oldest first. Returns how many.
+            inline size_t copy_to(point* out, size_t n) const {
+                if (n > m_size) n = m_size;
+                for (size_t i = 0; i < n; ++i) {
+                    out[i] = (*this)[i];
+                }
+                return n;
+            }
+
+            // Adds one frame's level: the whole thing, for callers
+            // outside the envelope's loops.
+            inline void add(float level) {
+                track(m_state, level);
+            }
+
+            inline block_state state() const { return m_state; }
+            inline void set_state(const block_state& s) { m_state = s; }
+
+            // One frame's level into s, and a point out when it
+            // completes a block. Inline, for the envelope's loops.
+            inline void track(block_state& s, const float level) {
+                if (level < s.lo) s.lo = level;
+                if (level > s.hi) s.hi = level;
+                if (++s.count == m_block) {
+                    push(s.lo, s.hi, level);
+                    reset(s);
+                }
+            }
+
+            // n frames at once, over which the level moves
+            // monotonically: what the envelope does over a constant
+            // input. level_at(k) gives the level after frame k (1 to
+            // n), and is only asked for at the ends of each block.
+            template <typename F>
+            inline void track_monotonic(size_t n, const F& level_at) {
+                size_t done = 0;
+                while (done < n) {
+                    size_t take = m_block - m_state.count;
+                    if (take > n - done) take = n - done;
+                    const float a = level_at(done + 1);
+                    const float b = level_at(done + take);
+                    if (a < m_state.lo) m_state.lo = a;
+                    if (a > m_state.hi) m_state.hi = a;
+                    if (b < m_state.lo) m_state.lo = b;
+                    if (b > m_state.hi) m_state.hi = b;
+                    m_state.count += take;
+                    done += take;
+                    if (m_state.count == m_block) {
+                        push(m_state.lo, m_state.hi, b);
+                        reset(m_state);
+                    }
+                }
+            }
+
+            private:
+            static inline void reset(block_state& s) {
+                s.lo = 1e30f;
+                s.hi = -1e30f;
+                s.count = 0;
+            }
+
+            inline void push(float lo, float hi, float last) {
+                if (m_ring.empty()) return;
+                point& p = m_ring[m_head];
+                p.lo = lo;
+                p.hi = hi;
+                p.last = last;
+                if (++m_head == m_ring.size()) m_head = 0;
+                if (m_size < m_ring.size()) ++m_size;
+                ++m_total;
+            }
+
+            std::vector<point> m_ring;
+            size_t m_head; // where the next point goes
+            size_t m_size;
+            size_t m_total;
+            size_t m_block;
+            block_state m_state;
+        };
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_HISTORY_HPP
@@ -0,0 +1,484 @@
+/*/
+ * Loudness, as EBU R128 (ITU-R BS.1770) measures it, in LUFS.
+ *
+ * normalize_buffer() makes the loudest sample full scale, which says
+ * little about how loud anything sounds; delivery specs want so many
+ * LUFS instead (-23 for EBU R128 broadcast, -24 for ATSC A/85, -14 or
+ * -16 for most streaming). loudness_meter takes interleaved shorts or
+ * floats, in blocks of any size, and gives the three R128 figures:
+ *
+    my::cpp98::audio::loudness_meter m(48000, 2);
+    m.add(begin, end); // ... as often as there's more
+    const double lufs = m.integrated();
+ *
+ * Each channel goes through the K-weighting filter (a high shelf and a
+ * high pass, two biquads) and has its square summed over 100ms steps.
+ * Momentary loudness is the last 400ms of those, short-term the last
+ * 3s. Integrated loudness is over every 400ms block (75% overlapped)
+ * that passes two gates: -70 LUFS, absolutely, then 10 LU under the
+ * loudness of the blocks that passed the first.
+ *
+ * Storing every block for the gating would grow with the programme.
+ * Instead, a block goes into one of a fixed number of 0.1 LU bins
+ * (-70 to +10 LUFS), which keep a count and a sum of energies: the
+ * gates are applied bin by bin, and the bins' sums add up to the same
+ * mean the blocks would have. The only approximation is the bin the
+ * relative gate falls in, taken whole. Memory is the same for a second
+ * as for a week.
+ *
+ * The filters run in doubles, channels side by side in SIMD registers
+ * (simd::biquad2_sumsq()): the same bits whatever the SIMD level. (Let
+ * the compiler fuse multiply-adds, as GCC does with -march=native on
+ * anything with FMA, and the scalar loop fuses differently: then it's
+ * the same to within rounding.)
+ *
+ * normalize_loudness() is normalize_buffer() with a LUFS target.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_LOUDNESS_HPP
+#define CPP_98_AUDIO_LOUDNESS_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        class loudness_meter {
+            public:
+            enum {
+                STEPS_MOMENTARY = 4, // 100ms steps: 400ms
+                STEPS_SHORT_TERM = 30, // 3s
+                HISTOGRAM_BINS = 800 // 0.1 LU each, from -70 LUFS
+            };
+
+            loudness_meter(int samplerate, int nch)
+                : m_samplerate(samplerate)
+                , m_nch(nch)
+                , m_weights((size_t)nch, 1.0)
+                , m_z((size_t)nch * 4)
+                , m_sumsq((size_t)nch) {
+                assert(samplerate > 0 && nch > 0);
+                const double step = samplerate / 10.0;
+                m_step_frames = step < 1.0 ? 1 : (size_t)(step + 0.5);
+                k_weighting(samplerate, m_coeffs_float);
+                // Shorts are scaled to +/-1 by the first section's b's:
+                // the filter's linear, so it's the same thing, free.
+                for (int i = 0; i < 10; ++i) {
+                    m_coeffs_short[i] = m_coeffs_float[i];
+                }
+                for (int i = 0; i < 3; ++i) {
+                    m_coeffs_short[i] /= 32768.0;
+                }
+                // BS.1770's weights, in the WAVE/SMPTE order: L R C
+                // LFE Ls Rs (and whatever's after that, surround too).
+                // Mono to 5.0 (no LFE) have no more than 3 fronts.
+                if (nch == 5) {
+                    m_weights[3] = m_weights[4] = 1.41;
+                } else if (nch >= 6) {
+                    m_weights[3] = 0.0;
+                    for (int ch = 4; ch < nch; ++ch) m_weights[ch] = 1.41;
+                }
+                reset();
+            }
+
+            // Back to nothing measured (the channel weights stay).
+            inline void reset() {
+                std::fill(m_z.begin(), m_z.end(), 0.0);
+                std::fill(m_sumsq.begin(), m_sumsq.end(), 0.0);
+                std::fill(m_steps, m_steps + STEPS_SHORT_TERM, 0.0);
+                std::fill(m_bin_blocks, m_bin_blocks + HISTOGRAM_BINS,
+                    (u64_t)0);
+                std::fill(m_bin_energy, m_bin_energy + HISTOGRAM_BINS, 0.0);
+                m_step_pos = 0;
+                m_nsteps = 0;
+            }
+
+            // A channel's share of the sum: 1.0 for fronts, 1.41 for
+            // surrounds, 0 to leave it out (the LFE always is).
+            inline void set_channel_weight(int ch, double w) {
+                assert(ch >= 0 && ch < m_nch);
+                m_weights[(size_t)ch] = w;
+            }
+            inline double channel_weight(int ch) const {
+                return m_weights[(size_t)ch];
+            }
+
+            // Interleaved frames, whole ones. Shorts are full scale at
+            // 32768, floats at 1.0; they can be mixed.
+            inline void add(const short* begin, const short* end) {
+                add_samples(begin, end, m_coeffs_short);
+            }
+            inline void add(const float* begin, const float* end) {
+                add_samples(begin, end, m_coeffs_float);
+            }
+
+            // LUFS over the last 400ms; -infinity until there's been
+            // that much.
+            inline double momentary() const {
+                return loudness(mean_steps(STEPS_MOMENTARY));
+            }
+
+            // ...and over the last 3s.
+            inline double short_term() const {
+                return loudness(mean_steps(STEPS_SHORT_TERM));
+            }
+
+            // Gated, over everything so far: -infinity if nothing has
+            // got past the -70 LUFS gate.
+            inline double integrated() const {
+                u64_t n = 0;
+                double sum = 0;
+                for (int i = 0; i < HISTOGRAM_BINS; ++i) {
+                    n += m_bin_blocks[i];
+                    sum += m_bin_energy[i];
+                }
+                if (!n) return loudness(0.0);
+                const int gate = bin(loudness(sum / (double)n) - 10.0);
+                n = 0;
+                sum = 0;
+                for (int i = gate < 0 ? 0 : gate; i < HISTOGRAM_BINS; ++i) {
+                    n += m_bin_blocks[i];
+                    sum += m_bin_energy[i];
+                }
+                return loudness(sum / (double)n);
+            }
+
+            // 400ms blocks past the absolute gate, so far.
+            inline u64_t gated_blocks() const {
+                u64_t n = 0;
+                for (int i = 0; i < HISTOGRAM_BINS; ++i) {
+                    n += m_bin_blocks[i];
+                }
+                return n;
+            }
+
+            inline int channels() const { return m_nch; }
+            inline int samplerate() const { return m_samplerate; }
+
+            // Mean square (channel weighted) <-> LUFS.
+            static inline double loudness(double energy) {
+                if (!(energy > 0.0)) {
+                    return -std::numeric_limits<double>::infinity();
+                }
+                return -0.691 + 10.0 * log10(energy);
+            }
+            static inline double energy(double lufs) {
+                return pow(10.0, (lufs + 0.691) / 10.0);
+            }
+
+            // BS.1770's two K-weighting sections at any rate (its
+            // tables give 48kHz only): b0 b1 b2 a1 a2, twice.
+            static inline void k_weighting(int samplerate, double* c) {
+                const double pi = 3.14159265358979323846;
+                // high shelf, +4dB from about 1.5kHz up
+                double f0 = 1681.974450955533;
+                double q = 0.7071752369554196;
+                double k = tan(pi * f0 / samplerate);
+                const double vh = pow(10.0, 3.999843853973347 / 20.0);
+                const double vb = pow(vh, 0.4996667741545416);
+                double a0 = 1.0 + k / q + k * k;
+                c[0] = (vh + vb * k / q + k * k) / a0;
+                c[1] = 2.0 * (k * k - vh) / a0;
+                c[2] = (vh - vb * k / q + k * k) / a0;
+                c[3] = 2.0 * (k * k - 1.0) / a0;
+                c[4] = (1.0 - k / q + k * k) / a0;
+                // high pass at 38Hz (the "RLB" curve)
+                f0 = 38.13547087602444;
+                q = 0.5003270373238773;
+                k = tan(pi * f0 / samplerate);
+                a0 = 1.0 + k / q + k * k;
+                c[5] = 1.0;
+                c[6] = -2.0;
+                c[7] = 1.0;
+                c[8] = 2.0 * (k * k - 1.0) / a0;
+                c[9] = (1.0 - k / q + k * k) / a0;
+            }
+
+            private:
+            template <typename T>
+            inline void add_samples(
+                const T* begin, const T* end, const double* c) {
+                const size_t nch = (size_t)m_nch;
+                assert((size_t)(end - begin) % nch == 0);
+                size_t frames = (size_t)(end - begin) / nch;
+                while (frames) {
+                    const size_t n
+                        = my::min(frames, m_step_frames - m_step_pos);
+                    simd::biquad2_sumsq(
+                        begin, n, m_nch, c, &m_z[0], &m_sumsq[0]);
+                    begin += n * nch;
+                    frames -= n;
+                    m_step_pos += n;
+                    if (m_step_pos == m_step_frames) end_step();
+                }
+                // A filter ringing down in silence heads for denormals,
+                // which are slow, and inaudible long before.
+                for (size_t i = 0; i < m_z.size(); ++i) {
+                    if (fabs(m_z[i]) < 1e-30) m_z[i] = 0.0;
+                }
+            }
+
+            // 100ms done: its energy into the ring, and (from the
+            // 4th on) the 400ms block ending here into the histogram.
+            inline void end_step() {
+                double e = 0;
+                for (size_t ch = 0; ch < m_sumsq.size(); ++ch) {
+                    e += m_weights[ch] * m_sumsq[ch];
+                    m_sumsq[ch] = 0.0;
+                }
+                m_steps[m_nsteps % STEPS_SHORT_TERM]
+                    = e / (double)m_step_frames;
+                ++m_nsteps;
+                m_step_pos = 0;
+                if (m_nsteps < STEPS_MOMENTARY) return;
+                const double block = mean_steps(STEPS_MOMENTARY);
+                const double lufs = loudness(block);
+                if (!(lufs > -70.0)) return;
+                const int i = my::min(bin(lufs), (int)HISTOGRAM_BINS - 1);
+                ++m_bin_blocks[i];
+                m_bin_energy[i] += block;
+            }
+
+            // The mean of the last n steps' energies; 0 if there
+            // haven't been n yet.
+            inline double mean_steps(int n) const {
+                if (m_nsteps < (u64_t)n) return 0.0;
+                double sum = 0;
+                for (int i = 1; i <= n; ++i) {
+                    sum += m_steps[(m_nsteps - (u64_t)i) % STEPS_SHORT_TERM];
+                }
+                return sum / n;
+            }
+
+            // Which 0.1 LU bin: negative under -70 LUFS.
+            static inline int bin(double lufs) {
+                return (int)floor((lufs + 70.0) * 10.0);
+            }
+
+            int m_samplerate;
+            int m_nch;
+            size_t m_step_frames; // 100ms
+            size_t m_step_pos; // frames into the current step
+            u64_t m_nsteps; // completed
+            double m_coeffs_float[10];
+            double m_coeffs_short[10];
+            std::vector<double> m_weights;
+            std::vector<double> m_z; // see simd::biquad2_sumsq()
+            std::vector<double> m_sumsq; // this step's, per channel
+            double m_steps[STEPS_SHORT_TERM]; // a ring of step energies
+            u64_t m_bin_blocks[HISTOGRAM_BINS];
+            double m_bin_energy[HISTOGRAM_BINS];
+        };
+
+        // Scales the buffer so its integrated loudness is target_lufs,
+        // saturating rather than wrapping, like normalize_buffer().
+        // With peak_limit, the gain stops where the loudest sample
+        // hits full scale, and the result is quieter than the target:
+        // compare the gain with 10^((target - *measured) / 20). The
+        // loudness before is put in *measured. Returns the gain
+        // applied: 1.0 if nothing got past the -70 LUFS gate.
+        // Shorts or floats, interleaved.
+        template <typename T>
+        inline float normalize_loudness(T* begin, T* end, int nch,
+            int samplerate, double target_lufs = -23.0,
+            bool peak_limit = true, double* measured = NULL) {
+            loudness_meter m(samplerate, nch);
+            m.add((const T*)begin, (const T*)end);
+            const double lufs = m.integrated();
+            if (measured) *measured = lufs;
+            if (!(lufs > -70.0)) return 1.0f;
+            double gain = pow(10.0, (target_lufs - lufs) / 20.0);
+            double lo, hi;
+            detail::full_scale(T(), lo, hi);
+            if (peak_limit) {
+                const double peak
+                    = detail::peak_abs((const T*)begin, (const T*)end);
+                if (peak * gain > hi) gain = hi / peak;
+            }
+            detail::apply_gain(begin, end, gain, lo, hi);
+            return (float)gain;
+        }
+
+        namespace test {
+            namespace detail {
+                // A 997Hz sine, the same on every channel, amplitude
+                // in dBFS, appended to v.
+                inline void add_sine(std::vector<float>& v, int sr,
+                    int nch, double seconds, double dbfs) {
+                    const double a = pow(10.0, dbfs / 20.0);
+                    const size_t n = (size_t)(seconds * sr);
+                    const double w = 2.0 * 3.14159265358979323846 * 997.0
+                        / (double)sr;
+                    for (size_t i = 0; i < n; ++i) {
+                        const float x = (float)(a * sin(w * (double)i));
+                        for (int ch = 0; ch < nch; ++ch) v.push_back(x);
+                    }
+                }
+            } // namespace detail
+
+            inline void check_loudness() {
+                // EBU Tech 3341's first cases: a stereo 997Hz sine at
+                // -23dBFS measures -23 LUFS (momentary, short-term and
+                // integrated), at 48kHz and 44.1kHz alike.
+                for (int r = 0; r < 2; ++r) {
+                    const int sr = r ? 44100 : 48000;
+                    std::vector<float> v;
+                    detail::add_sine(v, sr, 2, 20.0, -23.0);
+                    loudness_meter m(sr, 2);
+                    m.add(&v[0], &v[0] + v.size());
+                    assert(fabs(m.integrated() + 23.0) < 0.1);
+                    assert(fabs(m.momentary() + 23.0) < 0.1);
+                    assert(fabs(m.short_term() + 23.0) < 0.1);
+                    // 400ms blocks every 100ms: 197 in 20s
+                    assert(m.gated_blocks() == 197);
+                }
+
+                // The gates (Tech 3341 case 3, then 10s under the
+                // absolute gate): 10s at -36, 60s at -23, 10s at -36.
+                // The relative gate is about -34.2, so it's -23 again.
+                {
+                    std::vector<float> v;
+                    detail::add_sine(v, 48000, 2, 10.0, -36.0);
+                    detail::add_sine(v, 48000, 2, 60.0, -23.0);
+                    detail::add_sine(v, 48000, 2, 10.0, -36.0);
+                    detail::add_sine(v, 48000, 2, 10.0, -72.0);
+                    loudness_meter m(48000, 2);
+                    m.add(&v[0], &v[0] + v.size());
+                    assert(fabs(m.integrated() + 23.0) < 0.1);
+                    assert(m.momentary() < -70.0);
+                    // ...and nothing at all
+                    loudness_meter q(48000, 2);
+                    std::vector<float> z(48000 * 2 * 5);
+                    q.add(&z[0], &z[0] + z.size());
+                    assert(q.integrated() < -1e300 && !q.gated_blocks());
+                }
+
+                // 5.1: the LFE doesn't count, surrounds do, more.
+                {
+                    const int nch = 6;
+                    std::vector<float> s;
+                    detail::add_sine(s, 48000, 1, 10.0, -23.0);
+                    std::vector<float> v(s.size() * nch);
+                    for (size_t i = 0; i < s.size(); ++i) {
+                        v[i * nch + 3] = s[i]; // LFE alone
+                    }
+                    loudness_meter m(48000, nch);
+                    m.add(&v[0], &v[0] + v.size());
+                    assert(!m.gated_blocks());
+                    for (size_t i = 0; i < s.size(); ++i) {
+                        v[i * nch + 3] = 0;
+                        v[i * nch + 4] = s[i]; // Ls alone
+                    }
+                    m.reset();
+                    m.add(&v[0], &v[0] + v.size());
+                    // mono is 3dB under stereo; 1.41 is +1.5dB
+                    const double want
+                        = -23.0 - 10.0 * log10(2.0) + 10.0 * log10(1.41);
+                    assert(fabs(m.integrated() - want) < 0.1);
+                    (void)want;
+                }
+
+                // The same bits at every SIMD level, however it's
+                // chunked, for every channel count up to 8 (so every
+                // mix of 4, 2 and 1 channel paths); shorts measure
+                // what the same floats do.
+                unsigned int seed = 7;
+                for (int nch = 1; nch <= 8; ++nch) {
+                    const size_t frames = 48000 * 2;
+                    std::vector<short> in(frames * nch);
+                    std::vector<float> fl(in.size());
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        in[i] = (short)((int)(seed >> 16) % 24000 - 12000);
+                        fl[i] = in[i] / 32768.0f;
+                    }
+                    double ref = 0;
+                    const int was = simd::simd_level();
+                    for (int level = simd::SIMD_SCALAR;
+                         level <= simd::detected_simd_level(); ++level) {
+                        simd::set_simd_level(level);
+                        loudness_meter m(48000, nch);
+                        const short* p = &in[0];
+                        const short* const e = p + in.size();
+                        while (p < e) {
+                            seed = seed * 1103515245u + 12345u;
+                            const size_t n = my::min((size_t)(e - p),
+                                (1 + (size_t)(seed >> 18)) * nch);
+                            m.add(p, p + n);
+                            p += n;
+                        }
+                        const double l = m.integrated();
+                        if (level == simd::SIMD_SCALAR) {
+                            ref = l;
+                        } else {
+#if defined(__FMA__)
+                            assert(fabs(l - ref) < 1e-9);
+#else
+                            assert(l == ref);
+#endif
+                        }
+                        loudness_meter f(48000, nch);
+                        f.add(&fl[0], &fl[0] + fl.size());
+                        assert(fabs(f.integrated() - l) < 1e-6);
+                        assert(f.short_term() < -1e300); // under 3s
+                    }
+                    simd::set_simd_level(was);
+                    (void)ref;
+                }
+
+                // normalize_loudness(): to the target, or as near as
+                // the peak allows.
+                {
+                    std::vector<float> v;
+                    detail::add_sine(v, 48000, 2, 10.0, -30.0);
+                    std::vector<short> s(v.size());
+                    for (size_t i = 0; i < v.size(); ++i) {
+                        s[i] = (short)(v[i] * 32767.0f);
+                    }
+                    double before = 0;
+                    float g = normalize_loudness(&v[0], &v[0] + v.size(), 2,
+                        48000, -23.0, true, &before);
+                    assert(fabs(before + 30.0) < 0.1);
+                    assert(fabs(g - pow(10.0, 7.0 / 20.0)) < 0.05);
+                    loudness_meter m(48000, 2);
+                    m.add(&v[0], &v[0] + v.size());
+                    assert(fabs(m.integrated() + 23.0) < 0.01);
+
+                    g = normalize_loudness(
+                        &s[0], &s[0] + s.size(), 2, 48000, -23.0);
+                    m.reset();
+                    m.add(&s[0], &s[0] + s.size());
+                    assert(fabs(m.integrated() + 23.0) < 0.02);
+
+                    // +3 LUFS would need a sine peaking over 0dBFS:
+                    // stopped at full scale instead.
+                    g = normalize_loudness(
+                        &v[0], &v[0] + v.size(), 2, 48000, 3.0);
+                    assert(g < pow(10.0, 26.0 / 20.0));
+                    float pk = 0;
+                    for (size_t i = 0; i < v.size(); ++i) {
+                        pk = my::max(pk, (float)fabs(v[i]));
+                    }
+                    assert(pk <= 1.0f && pk > 0.999f);
+                    (void)g;
+                    (void)pk;
+                }
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_LOUDNESS_HPP
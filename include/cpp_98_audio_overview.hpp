@@ -0,0 +1,603 @@
+/*/
+ * A peak/RMS overview of 16-bit audio (what a DAW keeps in its peak
+ * files), to answer "how loud is [t0, t1)?" or "where does it first get
+ * above -40dB?" without going back to the samples.
+ *
+ * Level 0 has, for every base_block() frames and every channel, the
+ * lowest and highest sample and the sum of their squares. Each level
+ * above summarises fan() blocks of the one below, up to a single block
+ * for the lot. Building it is one pass over the samples (add() them in
+ * whatever pieces they come in); the levels above are built from level
+ * 0. A query then looks at no more than 2 * fan() blocks per level:
+ * O(log n), whatever the range.
+ *
+ * Queries are in frames, and work in whole base blocks: a range that
+ * doesn't start and end on a block boundary is widened to one (the end
+ * of the audio is always a boundary). ch -1 means every channel.
+ *
+ * save() / load() keep it in a file next to the audio, stamped with the
+ * audio file's size and modification time: load() refuses a file whose
+ * stamp doesn't match any more. load_or_build_overview() does the lot
+ * for a WAV.
+ *
+ * normalize_buffer(begin, end, nch, overview) takes its peak from here
+ * and skips its scan.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_OVERVIEW_HPP
+#define CPP_98_AUDIO_OVERVIEW_HPP
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_wav.hpp"
+
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        // Size and modification time of a file, to tell whether it
+        // has changed. false if it can't be looked at.
+        inline bool file_stamp(const char* path, u64_t& size, u64_t& mtime) {
+#if defined(_WIN32)
+            WIN32_FILE_ATTRIBUTE_DATA fad;
+            if (!GetFileAttributesExA(path, GetFileExInfoStandard, &fad)) {
+                return false;
+            }
+            size = ((u64_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+            mtime = ((u64_t)fad.ftLastWriteTime.dwHighDateTime << 32)
+                | fad.ftLastWriteTime.dwLowDateTime;
+#else
+            struct stat st;
+            if (stat(path, &st) != 0) return false;
+            size = (u64_t)st.st_size;
+            mtime = (u64_t)st.st_mtime * 1000000000u;
+#if defined(__linux__)
+            mtime += (u64_t)st.st_mtim.tv_nsec;
+#endif
+#endif
+            return true;
+        }
+
+        class overview {
+            public:
+            enum { DEFAULT_BASE_BLOCK = 256, DEFAULT_FAN = 8 };
+
+            overview(int nch = 1, size_t base_block = DEFAULT_BASE_BLOCK,
+                size_t fan = DEFAULT_FAN) {
+                reset(nch, base_block, fan);
+            }
+
+            // Empties it, ready for add()ing audio with nch channels.
+            inline void reset(int nch, size_t base_block = DEFAULT_BASE_BLOCK,
+                size_t fan = DEFAULT_FAN) {
+                assert(nch > 0 && base_block > 0 && fan > 1);
+                m_nch = nch;
+                m_base = base_block;
+                m_fan = fan;
+                m_frames = 0;
+                m_levels.assign(1, level());
+                m_partial = 0;
+                m_cur_lo.assign((size_t)nch, 32767);
+                m_cur_hi.assign((size_t)nch, -32768);
+                m_cur_ss.assign((size_t)nch, 0);
+            }
+
+            // The next whole frames of the audio.
+            inline void add(const short* begin, const short* end) {
+                const size_t nch = (size_t)m_nch;
+                assert((size_t)(end - begin) % nch == 0);
+                const short* p = begin;
+                while (p < end) {
+                    size_t frames = (size_t)(end - p) / nch;
+                    if (frames > m_base - m_partial) {
+                        frames = m_base - m_partial;
+                    }
+                    for (size_t ch = 0; ch < nch; ++ch) {
+                        int lo = m_cur_lo[ch];
+                        int hi = m_cur_hi[ch];
+                        u64_t ss = 0;
+                        const short* s = p + ch;
+                        for (size_t f = 0; f < frames; ++f, s += nch) {
+                            const int v = *s;
+                            if (v < lo) lo = v;
+                            if (v > hi) hi = v;
+                            ss += (u64_t)(v * v);
+                        }
+                        m_cur_lo[ch] = lo;
+                        m_cur_hi[ch] = hi;
+                        m_cur_ss[ch] += ss;
+                    }
+                    p += frames * nch;
+                    m_partial += frames;
+                    m_frames += frames;
+                    if (m_partial == m_base) close_block();
+                }
+            }
+
+            // Call once it's all been add()ed: closes the last
+            // (short) block and builds the levels above.
+            inline void finish() {
+                if (m_partial) close_block();
+                m_levels.resize(1);
+                while (m_levels.back().count > 1) {
+                    const level& below = m_levels.back();
+                    level up;
+                    up.count = (below.count + m_fan - 1) / m_fan;
+                    up.resize(up.count * m_nch);
+                    for (size_t i = 0; i < up.count; ++i) {
+                        const size_t j0 = i * m_fan;
+                        const size_t j1 = my::min(j0 + m_fan, below.count);
+                        for (size_t ch = 0; ch < (size_t)m_nch; ++ch) {
+                            short lo = 32767, hi = -32768;
+                            double ss = 0;
+                            for (size_t j = j0; j < j1; ++j) {
+                                const size_t k = j * m_nch + ch;
+                                lo = my::min(lo, below.lo[k]);
+                                hi = my::max(hi, below.hi[k]);
+                                ss += below.sumsq[k];
+                            }
+                            up.lo[i * m_nch + ch] = lo;
+                            up.hi[i * m_nch + ch] = hi;
+                            up.sumsq[i * m_nch + ch] = ss;
+                        }
+                    }
+                    m_levels.push_back(up);
+                }
+            }
+
+            inline void build(const short* begin, const short* end) {
+                reset(m_nch, m_base, m_fan);
+                add(begin, end);
+                finish();
+            }
+
+            inline int channels() const { return m_nch; }
+            inline size_t base_block() const { return m_base; }
+            inline size_t fan() const { return m_fan; }
+            inline u64_t frames() const { return m_frames; }
+            inline size_t levels() const { return m_levels.size(); }
+            inline size_t blocks(size_t lvl = 0) const {
+                return m_levels[lvl].count;
+            }
+            inline bool empty() const { return m_levels[0].count == 0; }
+
+            // Lowest and highest sample in [f0, f1).
+            inline void min_max(u64_t f0, u64_t f1, int ch, short& lo,
+                short& hi) const {
+                const summary s = query(f0, f1, ch);
+                lo = s.lo;
+                hi = s.hi;
+            }
+
+            // Largest |sample| in [f0, f1), on the short scale
+            // (so -32768 gives 32768).
+            inline int peak(u64_t f0, u64_t f1, int ch = -1) const {
+                const summary s = query(f0, f1, ch);
+                if (s.frames == 0) return 0;
+                return my::max(-(int)s.lo, (int)s.hi);
+            }
+            inline int peak() const { return peak(0, m_frames); }
+
+            // RMS of [f0, f1), as a fraction of full scale (0 - 1).
+            inline double rms(u64_t f0, u64_t f1, int ch = -1) const {
+                const summary s = query(f0, f1, ch);
+                if (s.frames == 0) return 0;
+                const double n
+                    = (double)s.frames * (ch < 0 ? (double)m_nch : 1.0);
+                return sqrt(s.sumsq / n) / 32768.0;
+            }
+
+            // The first frame, from 'from' on, of the first base block
+            // whose peak is at least 'level' (a fraction of full
+            // scale, like the envelope's sentinels). frames() if
+            // there's none.
+            inline u64_t first_above(
+                float level, u64_t from = 0, int ch = -1) const {
+                const int thr = (int)ceil(level * 32768.0f);
+                const size_t top = m_levels.size() - 1;
+                size_t l = 0;
+                size_t i = (size_t)(from / m_base);
+                // Up and along until a block qualifies...
+                while (i < m_levels[l].count && !loud(l, i, ch, thr)) {
+                    if ((i + 1) % m_fan == 0 && l < top) {
+                        i = (i + 1) / m_fan;
+                        ++l;
+                    } else {
+                        ++i;
+                    }
+                }
+                if (i >= m_levels[l].count) return m_frames;
+                // ...then down to the first child that does.
+                while (l > 0) {
+                    --l;
+                    i *= m_fan;
+                    while (!loud(l, i, ch, thr)) ++i;
+                }
+                return (u64_t)i * m_base;
+            }
+
+            // Written raw: only readable where it was written (or on
+            // machines of the same endianness).
+            inline bool save(const char* path, u64_t src_size,
+                u64_t src_mtime) const {
+                FILE* f = fopen(path, "wb");
+                if (!f) return false;
+                file_header h;
+                memset(&h, 0, sizeof(h));
+                memcpy(h.magic, MAGIC(), sizeof(h.magic));
+                h.nch = (unsigned int)m_nch;
+                h.nlevels = (unsigned int)m_levels.size();
+                h.base = m_base;
+                h.fan = m_fan;
+                h.frames = m_frames;
+                h.src_size = src_size;
+                h.src_mtime = src_mtime;
+                bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+                for (size_t l = 0; ok && l < m_levels.size(); ++l) {
+                    const level& lv = m_levels[l];
+                    const u64_t count = lv.count;
+                    const size_t n = lv.lo.size();
+                    ok = fwrite(&count, sizeof(count), 1, f) == 1;
+                    if (!ok || n == 0) continue; // no frames, no blocks
+                    ok = fwrite(&lv.lo[0], sizeof(short), n, f) == n
+                        && fwrite(&lv.hi[0], sizeof(short), n, f) == n
+                        && fwrite(&lv.sumsq[0], sizeof(double), n, f) == n;
+                }
+                return (fclose(f) == 0) && ok;
+            }
+
+            // false (and this left empty) if the file isn't there,
+            // isn't one of ours, or was made from a different version
+            // of the audio.
+            inline bool load(const char* path, u64_t src_size,
+                u64_t src_mtime) {
+                reset(m_nch, m_base, m_fan);
+                FILE* f = fopen(path, "rb");
+                if (!f) return false;
+                file_header h;
+                bool ok = fread(&h, sizeof(h), 1, f) == 1
+                    && memcmp(h.magic, MAGIC(), sizeof(h.magic)) == 0
+                    && h.src_size == src_size && h.src_mtime == src_mtime
+                    && h.nch > 0 && h.base > 0 && h.fan > 1 && h.nlevels > 0
+                    && h.nlevels <= MAX_LEVELS;
+                if (ok) {
+                    reset((int)h.nch, (size_t)h.base, (size_t)h.fan);
+                    m_levels.resize(h.nlevels);
+                }
+                for (size_t l = 0; ok && l < m_levels.size(); ++l) {
+                    level& lv = m_levels[l];
+                    u64_t count = 0;
+                    ok = fread(&count, sizeof(count), 1, f) == 1
+                        && count < ((u64_t)1 << 40);
+                    if (!ok) break;
+                    lv.count = (size_t)count;
+                    const size_t n = lv.count * (size_t)m_nch;
+                    lv.resize(n);
+                    if (n == 0) continue; // an empty file's one level
+                    ok = fread(&lv.lo[0], sizeof(short), n, f) == n
+                        && fread(&lv.hi[0], sizeof(short), n, f) == n
+                        && fread(&lv.sumsq[0], sizeof(double), n, f) == n;
+                }
+                fclose(f);
+                if (!ok) {
+                    reset(m_nch, m_base, m_fan);
+                    return false;
+                }
+                m_frames = h.frames;
+                return true;
+            }
+
+            private:
+            struct level {
+                level() : count(0) {}
+                size_t count; // blocks
+                // [block * nch + ch]
+                std::vector<short> lo, hi;
+                std::vector<double> sumsq;
+                inline void resize(size_t n) {
+                    lo.resize(n);
+                    hi.resize(n);
+                    sumsq.resize(n);
+                }
+            };
+
+            struct summary {
+                short lo, hi;
+                double sumsq;
+                u64_t frames;
+            };
+
+            struct file_header {
+                char magic[8];
+                unsigned int nch;
+                unsigned int nlevels;
+                u64_t base;
+                u64_t fan;
+                u64_t frames;
+                u64_t src_size;
+                u64_t src_mtime;
+            };
+            static inline const char* MAGIC() { return "C98OVW1"; }
+            // Each level has a fan'th of the blocks of the one below
+            // (fan >= 2): 64 covers any 64-bit frame count. More is a
+            // corrupt header, not a reason to allocate.
+            enum { MAX_LEVELS = 64 };
+
+            inline void close_block() {
+                level& l0 = m_levels[0];
+                ++l0.count;
+                for (size_t ch = 0; ch < (size_t)m_nch; ++ch) {
+                    l0.lo.push_back((short)m_cur_lo[ch]);
+                    l0.hi.push_back((short)m_cur_hi[ch]);
+                    l0.sumsq.push_back((double)m_cur_ss[ch]);
+                    m_cur_lo[ch] = 32767;
+                    m_cur_hi[ch] = -32768;
+                    m_cur_ss[ch] = 0;
+                }
+                m_partial = 0;
+            }
+
+            inline bool loud(size_t l, size_t i, int ch, int thr) const {
+                const level& lv = m_levels[l];
+                const size_t c0 = ch < 0 ? 0 : (size_t)ch;
+                const size_t c1 = ch < 0 ? (size_t)m_nch : c0 + 1;
+                for (size_t c = c0; c < c1; ++c) {
+                    const size_t k = i * m_nch + c;
+                    if (-(int)lv.lo[k] >= thr || (int)lv.hi[k] >= thr) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            inline void take(summary& s, size_t l, size_t i, int ch) const {
+                const level& lv = m_levels[l];
+                const size_t c0 = ch < 0 ? 0 : (size_t)ch;
+                const size_t c1 = ch < 0 ? (size_t)m_nch : c0 + 1;
+                for (size_t c = c0; c < c1; ++c) {
+                    const size_t k = i * m_nch + c;
+                    s.lo = my::min(s.lo, lv.lo[k]);
+                    s.hi = my::max(s.hi, lv.hi[k]);
+                    s.sumsq += lv.sumsq[k];
+                }
+            }
+
+            // Blocks [a, b) of level 0, a level at a time: the ragged
+            // ends at each level, then up to the next with what's
+            // left.
+            inline summary query(u64_t f0, u64_t f1, int ch) const {
+                summary s;
+                s.lo = 32767;
+                s.hi = -32768;
+                s.sumsq = 0;
+                s.frames = 0;
+                if (f1 > m_frames) f1 = m_frames;
+                if (empty() || f0 >= f1) return s;
+                size_t a = (size_t)(f0 / m_base);
+                size_t b = (size_t)((f1 + m_base - 1) / m_base);
+                const u64_t last = my::min((u64_t)b * m_base, m_frames);
+                s.frames = last - (u64_t)a * m_base;
+                for (size_t l = 0; a < b; ++l) {
+                    if (l + 1 == m_levels.size() || b - a < m_fan) {
+                        while (a < b) take(s, l, a++, ch);
+                        break;
+                    }
+                    while (a < b && a % m_fan) take(s, l, a++, ch);
+                    while (a < b && b % m_fan && b != m_levels[l].count) {
+                        take(s, l, --b, ch);
+                    }
+                    if (a >= b) break;
+                    a /= m_fan;
+                    b = (b + m_fan - 1) / m_fan;
+                }
+                return s;
+            }
+
+            int m_nch;
+            size_t m_base, m_fan;
+            u64_t m_frames;
+            std::vector<level> m_levels;
+            size_t m_partial; // frames in the block being built
+            std::vector<int> m_cur_lo, m_cur_hi;
+            std::vector<u64_t> m_cur_ss;
+        };
+
+        // Where the overview of 'audio_path' lives: next to it.
+        inline std::string overview_path_for(const char* audio_path) {
+            return std::string(audio_path) + ".ovw";
+        }
+
+        // Loads the overview of a 16-bit WAV from its cache file, or
+        // (if there isn't one, or it's out of date) builds it from the
+        // mapped samples and saves it. false if the WAV can't be read.
+        inline bool load_or_build_overview(overview& ov,
+            const char* wav_path,
+            size_t base_block = overview::DEFAULT_BASE_BLOCK,
+            size_t fan = overview::DEFAULT_FAN) {
+            u64_t size = 0, mtime = 0;
+            if (!file_stamp(wav_path, size, mtime)) return false;
+            const std::string cache = overview_path_for(wav_path);
+            if (ov.load(cache.c_str(), size, mtime)) return true;
+
+            wav_file wav;
+            if (!wav.open(wav_path)) return false;
+            const wav_file& cwav = wav;
+            my::iterator::ptrs<const short> s = cwav.shorts();
+            if (s.size() == 0 && wav.data_bytes() != 0) return false;
+            ov.reset(wav.channels(), base_block, fan);
+            const short* b = s.begin();
+            const size_t whole
+                = s.size() - s.size() % (size_t)wav.channels();
+            ov.add(b, b + whole);
+            ov.finish();
+            ov.save(cache.c_str(), size, mtime);
+            return true;
+        }
+
+        // normalize_buffer(), with the peak from an overview of these
+        // very samples rather than a pass over them. Falls back to the
+        // scan if the overview doesn't cover them.
+        inline float normalize_buffer(
+            short* begin, short* end, int nch, const overview& ov) {
+            if (ov.channels() != nch
+                || ov.frames() * (u64_t)nch != (u64_t)(end - begin)) {
+                return normalize_buffer(begin, end, nch);
+            }
+            const double gain
+                = detail::normalize_gain(short(), (double)ov.peak());
+            if (gain != 1.0) {
+                double lo, hi;
+                detail::full_scale(short(), lo, hi);
+                detail::apply_gain(begin, end, gain, lo, hi);
+            }
+            return (float)gain;
+        }
+
+        namespace test {
+
+            // Every query against brute force over the samples, for
+            // aligned and ragged ranges; then the cache file.
+            inline void check_overview(const char* wav_path) {
+                const int nch = 2;
+                const size_t nframes = 100003;
+                std::vector<short> in(nframes * nch);
+                unsigned int seed = 8080;
+                for (size_t i = 0; i < in.size(); ++i) {
+                    seed = seed * 1103515245u + 12345u;
+                    const int shift = 4 + (int)((i / nch / 5000) % 8);
+                    in[i] = (short)((short)(seed >> 16) >> shift);
+                }
+                in[77777 * nch + 1] = -30000;
+
+                overview ov(nch, 64, 4);
+                // in uneven pieces
+                ov.add(&in[0], &in[0] + 1001 * nch);
+                ov.add(&in[0] + 1001 * nch, &in[0] + in.size());
+                ov.finish();
+                assert(ov.frames() == nframes && ov.levels() > 3);
+
+                const u64_t ranges[][2] = { { 0, nframes },
+                    { 64, 64 * 700 }, { 3, 99999 }, { 77700, 77800 },
+                    { 100000, 100003 }, { 5000, 5001 } };
+                for (size_t r = 0; r < 6; ++r) {
+                    for (int ch = -1; ch < nch; ++ch) {
+                        const size_t a = (size_t)ranges[r][0] / 64 * 64;
+                        const size_t b = my::min(
+                            ((size_t)ranges[r][1] + 63) / 64 * 64, nframes);
+                        int pk = 0;
+                        double ss = 0;
+                        size_t n = 0;
+                        for (size_t f = a; f < b; ++f) {
+                            for (int c = 0; c < nch; ++c) {
+                                if (ch >= 0 && c != ch) continue;
+                                const int v = in[f * nch + c];
+                                pk = my::max(pk, v < 0 ? -v : v);
+                                ss += (double)v * v;
+                                ++n;
+                            }
+                        }
+                        assert(ov.peak(ranges[r][0], ranges[r][1], ch) == pk);
+                        const double rms = sqrt(ss / (double)n) / 32768.0;
+                        assert(fabs(ov.rms(ranges[r][0], ranges[r][1], ch)
+                                   - rms) <= 1e-9);
+                        (void)pk;
+                        (void)rms;
+                    }
+                }
+                assert(ov.peak() == 30000);
+
+                // first_above against a linear scan of the blocks
+                const float levels[] = { 0.001f, 0.05f, 0.2f, 0.9f, 0.5f };
+                for (size_t t = 0; t < 5; ++t) {
+                    for (u64_t from = 0; from < nframes; from += 33333) {
+                        const int thr = (int)ceil(levels[t] * 32768.0f);
+                        u64_t want = nframes;
+                        for (size_t f = (size_t)from / 64 * 64; f < nframes;
+                             f += 64) {
+                            if (ov.peak(f, f + 64) >= thr) {
+                                want = f;
+                                break;
+                            }
+                        }
+                        assert(ov.first_above(levels[t], from) == want);
+                        (void)thr;
+                        (void)want;
+                    }
+                }
+
+                // the cache: good, then stale
+                {
+                    wav_file w;
+                    const bool ok
+                        = w.create(wav_path, 44100, nch, 16, nframes);
+                    assert(ok);
+                    (void)ok;
+                    std::copy(
+                        in.begin(), in.end(), (short*)w.shorts().begin());
+                }
+                const std::string cache = overview_path_for(wav_path);
+                remove(cache.c_str());
+                overview built, loaded;
+                bool ok = load_or_build_overview(built, wav_path, 64, 4);
+                assert(ok);
+                u64_t size = 0, mtime = 0;
+                file_stamp(wav_path, size, mtime);
+                ok = loaded.load(cache.c_str(), size, mtime);
+                assert(ok);
+                assert(loaded.frames() == nframes);
+                assert(loaded.levels() == ov.levels());
+                assert(loaded.peak(3, 99999, 1) == ov.peak(3, 99999, 1));
+                assert(loaded.rms(0, nframes) == ov.rms(0, nframes));
+                ok = loaded.load(cache.c_str(), size + 1, mtime);
+                assert(!ok && loaded.empty());
+                (void)ok;
+
+                // and normalize_buffer() takes its peak from it
+                std::vector<short> a(in), b(in);
+                const float g1
+                    = normalize_buffer(&a[0], &a[0] + a.size(), nch);
+                const float g2
+                    = normalize_buffer(&b[0], &b[0] + b.size(), nch, ov);
+                assert(g1 == g2 && a == b);
+                (void)g1;
+                (void)g2;
+
+                remove(cache.c_str());
+                remove(wav_path);
+
+                // An empty data chunk: an empty overview, cached (and
+                // loaded back, not rebuilt, next time).
+                {
+                    wav_file w;
+                    ok = w.create(wav_path, 44100, nch, 16, 0);
+                    assert(ok);
+                }
+                overview empty;
+                ok = load_or_build_overview(empty, wav_path, 64, 4);
+                assert(ok && empty.frames() == 0 && empty.peak() == 0);
+                file_stamp(wav_path, size, mtime);
+                ok = loaded.load(cache.c_str(), size, mtime);
+                assert(ok && loaded.frames() == 0);
+                remove(cache.c_str());
+                remove(wav_path);
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_OVERVIEW_HPP
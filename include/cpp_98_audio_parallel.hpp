@@ -0,0 +1,310 @@
+/*/
+ * envelope_shorts() and normalize_buffer() over very long buffers, on
+ * several cores.
+ *
+ * The envelope is a recursive filter, so in principle sample n depends
+ * on every sample before it. In practice it forgets: two envelopes fed
+ * the same samples, whatever levels they started at, agree to within
+ * 'tolerance' after envelope::settle_frames(tolerance) frames (about
+ * 6.9 release times for SIXTY_DB_DOWN()).
+ *
+ * So the buffer is cut into one chunk per thread. Each chunk's envelope
+ * starts (from silence) settle_frames() before the chunk, "warming up"
+ * over samples it then ignores, and by the time it reaches its own
+ * chunk it is tracking what the sequential envelope would be doing.
+ *
+ * Error bound: every level (and so operator()()) is within
+ * 'tolerance' (of full scale) of the sequential result at every chunk
+ * start, and the difference only shrinks from there. A sentinel can
+ * therefore only fire at a different place if the sequential level
+ * passes within 'tolerance' of it there. The first chunk is exact.
+ *
+ * Worth it for buffers of many seconds. Shorter ones, or ones where
+ * the warm-up would be a large part of each chunk, just run
+ * sequentially. All chunks run to their end even if an earlier one
+ * already fired: if you expect a sentinel early, envelope_shorts()
+ * itself is the better choice.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_PARALLEL_HPP
+#define CPP_98_AUDIO_PARALLEL_HPP
+
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_thread.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        namespace detail {
+            struct envelope_chunk {
+                envelope_chunk()
+                    : env(0)
+                    , warm(0)
+                    , begin(0)
+                    , end(0)
+                    , sentinel_attack(0)
+                    , sentinel_release(0)
+                    , result(0)
+                    , hit(false) {}
+
+                envelope* env;
+                const short* warm;
+                const short* begin;
+                const short* end;
+                const float* sentinel_attack;
+                const float* sentinel_release;
+                const short* result;
+                bool hit;
+
+                void run() {
+                    if (warm < begin) env->envelope_shorts(warm, begin);
+                    result = env->envelope_shorts(begin, end,
+                        sentinel_attack, sentinel_release, &hit);
+                }
+            };
+        } // namespace detail
+
+        // As env.envelope_shorts(), split over nthreads threads (0:
+        // one per core). env ends up as envelope_shorts() would have
+        // left it, to within the bound above.
+        inline const short* parallel_envelope_shorts(envelope& env,
+            const short* begin, const short* end,
+            const float* const sentinel_attack = NULL,
+            const float* const sentinel_release = NULL,
+            int nthreads = 0, float tolerance = SIXTY_DB_DOWN(),
+            bool* const phit = NULL) {
+
+            if (nthreads <= 0) nthreads = threads::hardware_threads();
+            const size_t nch = (size_t)env.channels();
+            const size_t nframes = (size_t)(end - begin) / nch;
+            const size_t warm_frames = env.settle_frames(tolerance);
+
+            // Chunks at least 4x their warm-up, or it's not worth it.
+            // A history has to be recorded in order, so that's
+            // sequential too.
+            size_t nchunks = (size_t)nthreads;
+            if (warm_frames > nframes / 4 || env.history().enabled()) {
+                nchunks = 1;
+            }
+            while (nchunks > 1 && nframes / nchunks < 4 * warm_frames) {
+                --nchunks;
+            }
+            if (nchunks <= 1) {
+                return env.envelope_shorts(begin, end, sentinel_attack,
+                    sentinel_release, phit);
+            }
+
+            std::vector<envelope> envs(nchunks, env);
+            std::vector<detail::envelope_chunk> chunks(nchunks);
+            const size_t chunk_frames = nframes / nchunks;
+            for (size_t i = 0; i < nchunks; ++i) {
+                detail::envelope_chunk& c = chunks[i];
+                c.env = &envs[i];
+                c.begin = begin + i * chunk_frames * nch;
+                c.end = (i + 1 == nchunks)
+                    ? end
+                    : begin + (i + 1) * chunk_frames * nch;
+                c.warm = c.begin;
+                if (i > 0) {
+                    c.warm = c.begin - warm_frames * nch;
+                    envs[i].set_envelope_to(0);
+                }
+                c.sentinel_attack = sentinel_attack;
+                c.sentinel_release = sentinel_release;
+            }
+
+            threads::run_all(&chunks[0], nchunks, nthreads);
+
+            size_t last = nchunks - 1;
+            for (size_t i = 0; i < nchunks; ++i) {
+                if (chunks[i].hit) {
+                    last = i;
+                    break;
+                }
+            }
+            env = envs[last];
+            if (phit) *phit = chunks[last].hit;
+            return chunks[last].hit ? chunks[last].result : end;
+        }
+
+        namespace detail {
+            template <typename T> struct peak_task {
+                const T* begin;
+                const T* end;
+                double peak;
+                void run() { peak = detail::peak_abs(begin, end); }
+            };
+
+            template <typename T> struct gain_task {
+                T* begin;
+                T* end;
+                double gain, lo, hi;
+                void run() { detail::apply_gain(begin, end, gain, lo, hi); }
+            };
+
+            // Enough samples per thread to be worth starting it, and
+            // chunk edges on 64-sample boundaries so no two threads
+            // ever write to the same cache line.
+            inline size_t normalize_chunks(size_t nsamps, int nthreads) {
+                if (nthreads <= 0) nthreads = threads::hardware_threads();
+                size_t n = (size_t)nthreads;
+                const size_t min_chunk = 256 * 1024;
+                if (nsamps / min_chunk < n) n = nsamps / min_chunk;
+                return n ? n : 1;
+            }
+
+            inline size_t chunk_edge(size_t i, size_t nchunks, size_t n) {
+                if (i >= nchunks) return n;
+                return (n / nchunks * i) & ~(size_t)63;
+            }
+
+            template <typename T>
+            inline float parallel_normalize(T* begin, T* end, double lo,
+                double hi, bool use_type_gain, int nthreads) {
+
+                const size_t n = (size_t)(end - begin);
+                const size_t nchunks = normalize_chunks(n, nthreads);
+
+                std::vector<peak_task<T> > peaks(nchunks);
+                for (size_t i = 0; i < nchunks; ++i) {
+                    peaks[i].begin = begin + chunk_edge(i, nchunks, n);
+                    peaks[i].end = begin + chunk_edge(i + 1, nchunks, n);
+                    peaks[i].peak = 0;
+                }
+                threads::run_all(&peaks[0], nchunks, (int)nchunks);
+                double peak = 0;
+                for (size_t i = 0; i < nchunks; ++i) {
+                    peak = my::max(peak, peaks[i].peak);
+                }
+
+                const double gain = use_type_gain
+                    ? detail::normalize_gain(T(), peak)
+                    : detail::normalize_gain(peak, lo, hi);
+                if (gain == 1.0) return 1.0f;
+
+                std::vector<gain_task<T> > gains(nchunks);
+                for (size_t i = 0; i < nchunks; ++i) {
+                    gains[i].begin = begin + chunk_edge(i, nchunks, n);
+                    gains[i].end = begin + chunk_edge(i + 1, nchunks, n);
+                    gains[i].gain = gain;
+                    gains[i].lo = lo;
+                    gains[i].hi = hi;
+                }
+                threads::run_all(&gains[0], nchunks, (int)nchunks);
+                return (float)gain;
+            }
+        } // namespace detail
+
+        // normalize_buffer(), with both passes split over nthreads
+        // threads (0: one per core). Same result, to the bit.
+        template <typename T>
+        inline float parallel_normalize_buffer(
+            T* begin, T* end, int nch, int nthreads = 0) {
+            (void)nch;
+            double lo, hi;
+            detail::full_scale(T(), lo, hi);
+            return detail::parallel_normalize(
+                begin, end, lo, hi, true, nthreads);
+        }
+
+        inline float parallel_normalize_buffer_24(
+            int* begin, int* end, int nch, int nthreads = 0) {
+            (void)nch;
+            return detail::parallel_normalize(begin, end,
+                (double)min_audio_val_24(), (double)max_audio_val_24(),
+                false, nthreads);
+        }
+
+        namespace test {
+
+            // Threads or not, the same bits come out.
+            inline void check_parallel_normalize() {
+                std::vector<short> a(1000003);
+                std::vector<int> c(1000003);
+                detail::fill_for_normalize(a, 8000.0);
+                detail::fill_for_normalize(c, 2000000.0);
+                std::vector<short> b(a);
+                std::vector<int> d(c);
+                std::vector<int> e(c);
+                std::vector<int> f(c);
+
+                const float g1
+                    = normalize_buffer(&a[0], &a[0] + a.size(), 2);
+                const float g2 = parallel_normalize_buffer(
+                    &b[0], &b[0] + b.size(), 2, 4);
+                assert(g1 == g2 && a == b);
+                const float g3
+                    = normalize_buffer(&c[0], &c[0] + c.size(), 2);
+                const float g4 = parallel_normalize_buffer(
+                    &d[0], &d[0] + d.size(), 2, 4);
+                assert(g3 == g4 && c == d);
+                const float g5
+                    = normalize_buffer_24(&e[0], &e[0] + e.size(), 2);
+                const float g6 = parallel_normalize_buffer_24(
+                    &f[0], &f[0] + f.size(), 2, 4);
+                assert(g5 == g6 && e == f);
+                (void)g1;
+                (void)g2;
+                (void)g3;
+                (void)g4;
+                (void)g5;
+                (void)g6;
+            }
+
+
+            // Parallel must agree with sequential to within the
+            // tolerance, in level and (away from the threshold) in
+            // sentinel position.
+            inline void check_parallel_envelope() {
+                const int nch = 2;
+                const size_t nframes = 44100 * 20;
+                std::vector<short> in(nframes * nch);
+                unsigned int seed = 2024;
+                for (size_t f = 0; f < nframes; ++f) {
+                    // a second of noise at varying levels, then the
+                    // next...
+                    const int shift = 2 + (int)((f / 44100) % 7);
+                    for (int ch = 0; ch < nch; ++ch) {
+                        seed = seed * 1103515245u + 12345u;
+                        in[f * nch + ch] = (short)((short)(seed >> 16)
+                            >> shift);
+                    }
+                }
+                // ...and one loud burst, 14.5 s in.
+                std::fill(in.begin() + 44100 * 29,
+                    in.begin() + 44100 * 29 + 2000, (short)30000);
+                const short* const b = &in[0];
+                const short* const e = b + in.size();
+
+                const float tol = SIXTY_DB_DOWN();
+                envelope seq(44100, nch, 5.0f, 100.0f);
+                envelope par(seq);
+                seq.envelope_shorts(b, e);
+                parallel_envelope_shorts(par, b, e, NULL, NULL, 4, tol);
+                assert(fabsf(seq() - par()) <= tol);
+
+                const float att = 0.8f;
+                envelope seq2(44100, nch, 5.0f, 100.0f);
+                envelope par2(seq2);
+                bool seq_hit = false;
+                bool par_hit = false;
+                const short* ps = seq2.envelope_shorts(
+                    b, e, &att, NULL, &seq_hit);
+                const short* pp = parallel_envelope_shorts(
+                    par2, b, e, &att, NULL, 4, tol, &par_hit);
+                assert(seq_hit && par_hit);
+                assert(ps == pp);
+                assert(fabsf(seq2() - par2()) <= tol);
+                (void)ps;
+                (void)pp;
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_PARALLEL_HPP
@@ -0,0 +1,594 @@
+/*/
+ * Reading a file ahead of whoever's working on it.
+ *
+ * Read a block, envelope it, read the next, envelope that: the disk
+ * waits while the CPU works, and then the CPU waits while the disk
+ * does. block_reader keeps a thread of its own reading the file into
+ * a few blocks ahead of you, so next() usually finds the block it
+ * wants already there, and the two overlap.
+ *
+    block_reader r; // 4 blocks of 1MB
+    if (r.open_wav("in.wav")) {
+        envelope env(r.samplerate(), r.channels());
+        block_reader::block b;
+        while (r.next(b)) {
+            env.envelope_shorts((const short*)b.data,
+                (const short*)(b.data + b.bytes));
+        }
+    }
+ *
+ * (envelope_reader() and peak_reader() are that loop, sentinels and
+ * all.) next() hands back the block it gave out last time, for
+ * reading into again. There are never more than blocks() in memory:
+ * when they're all full, the reader thread sleeps until next() frees
+ * one. That's the backpressure: it never runs further ahead than that,
+ * however slow the consumer is.
+ *
+ * Reads are plain pread() (ReadFile() at an offset, on Windows), one
+ * block each, on the reader thread: it's a second thread doing
+ * ordinary blocking reads, rather than io_uring or overlapped I/O, so
+ * it builds anywhere c++98 and pthreads do, and one sequential reader
+ * is all a streaming analysis needs to keep the disk busy. stats()
+ * says where the time went, on both sides.
+ *
+ * The memory-mapped wav_file is still the better choice when the whole
+ * file is wanted at random, or written to in place.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_READER_HPP
+#define CPP_98_AUDIO_READER_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "cpp_98_audio_buffer.hpp"
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+#include "cpp_98_audio_thread.hpp"
+#include "cpp_98_audio_wav.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        namespace detail {
+            // Seconds, from some fixed point: for timing, nothing else.
+            inline double seconds_now() {
+#if defined(_WIN32)
+                LARGE_INTEGER f, t;
+                QueryPerformanceFrequency(&f);
+                QueryPerformanceCounter(&t);
+                return (double)t.QuadPart / (double)f.QuadPart;
+#else
+                struct timespec ts;
+                clock_gettime(CLOCK_MONOTONIC, &ts);
+                return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+            }
+        } // namespace detail
+
+        // Where the time went.
+        struct reader_stats {
+            reader_stats() { clear(); }
+            inline void clear() {
+                blocks = bytes = 0;
+                read_secs = full_secs = wait_secs = 0;
+            }
+            u64_t blocks, bytes;
+            double read_secs; // the reader thread, reading
+            double full_secs; // the reader thread, every block full
+            double wait_secs; // next(), waiting for a block
+        };
+
+        class block_reader {
+            public:
+            enum {
+                DEFAULT_BLOCK_BYTES = 1 << 20,
+                DEFAULT_BLOCKS = 4
+            };
+
+            // A filled block: valid until the next call to next() (or
+            // close()).
+            struct block {
+                block() : data(0), bytes(0), offset(0) {}
+                const unsigned char* data;
+                size_t bytes;
+                u64_t offset; // from the start of what was opened
+            };
+
+            // nblocks of block_bytes: at least 2, or there's nothing to
+            // overlap.
+            explicit block_reader(size_t block_bytes = DEFAULT_BLOCK_BYTES,
+                size_t nblocks = DEFAULT_BLOCKS)
+                : m_block_bytes(block_bytes)
+                , m_nblocks(nblocks < 2 ? 2 : nblocks) {
+                assert(block_bytes > 0);
+                reset();
+            }
+            ~block_reader() { close(); }
+
+            // length bytes of path from offset (to the end, if
+            // there's less), and starts reading.
+            inline bool open(const char* path, u64_t offset = 0,
+                u64_t length = ~(u64_t)0) {
+                close();
+                if (!open_file(path)) return false;
+                const u64_t size = file_size();
+                m_offset = offset < size ? offset : size;
+                m_length = my::min(length, size - m_offset);
+                return start();
+            }
+
+            // The data chunk of a WAV (or RF64): channels(),
+            // samplerate() and bits_per_sample() say what's in it,
+            // and blocks are whole frames.
+            inline bool open_wav(const char* path) {
+                close();
+                u64_t offset = 0, length = 0, align = 0;
+                {
+                    wav_file w;
+                    if (!w.open(path)) {
+                        m_error = w.error();
+                        return false;
+                    }
+                    m_nch = w.channels();
+                    m_samplerate = w.samplerate();
+                    m_bits = w.bits_per_sample();
+                    m_format = w.format();
+                    offset = w.data_offset();
+                    length = w.data_bytes();
+                    align = w.block_align();
+                }
+                if (align && m_block_bytes % align) {
+                    m_block_bytes -= m_block_bytes % align;
+                    if (m_block_bytes == 0) m_block_bytes = (size_t)align;
+                }
+                const int nch = m_nch, sr = m_samplerate, bits = m_bits;
+                const int format = m_format;
+                if (!open(path, offset, length)) return false;
+                m_nch = nch;
+                m_samplerate = sr;
+                m_bits = bits;
+                m_format = format;
+                return true;
+            }
+
+            // Stops the reader (even mid-file) and closes the file.
+            inline void close() {
+                if (m_thread.joinable()) {
+                    {
+                        threads::scoped_lock lock(m_mutex);
+                        m_stop = true;
+                    }
+                    m_space.notify_all();
+                    m_thread.join();
+                }
+                close_file();
+                const size_t block_bytes = m_block_bytes;
+                reset();
+                m_block_bytes = block_bytes;
+            }
+
+            // The next block, in file order, waiting for it if it's
+            // not in yet. false at the end, or on a read error (then
+            // error() says what).
+            inline bool next(block& b) {
+                const double t0 = detail::seconds_now();
+                threads::scoped_lock lock(m_mutex);
+                if (m_held) {
+                    m_held = false;
+                    m_read_slot = (m_read_slot + 1) % m_nblocks;
+                    m_space.notify_one();
+                }
+                while (m_ready == 0 && !m_done) m_data_ready.wait(m_mutex);
+                m_stats.wait_secs += detail::seconds_now() - t0;
+                if (m_ready == 0) return false;
+                --m_ready;
+                m_held = true;
+                const slot& s = m_slots[m_read_slot];
+                b.data = m_buffers.data() + m_read_slot * m_block_bytes;
+                b.bytes = s.bytes;
+                b.offset = s.offset;
+                return true;
+            }
+
+#if defined(_WIN32)
+            inline bool is_open() const {
+                return m_file != INVALID_HANDLE_VALUE;
+            }
+#else
+            inline bool is_open() const { return m_fd >= 0; }
+#endif
+            inline const char* error() const { return m_error; }
+            inline u64_t length() const { return m_length; }
+            inline size_t block_bytes() const { return m_block_bytes; }
+            inline size_t blocks() const { return m_nblocks; }
+
+            // open_wav() only (0 otherwise).
+            inline int channels() const { return m_nch; }
+            inline int samplerate() const { return m_samplerate; }
+            inline int bits_per_sample() const { return m_bits; }
+            inline int format() const { return m_format; }
+
+            // Safe once next() has returned false. open() and close()
+            // start them again.
+            inline reader_stats stats() const { return m_stats; }
+
+            private:
+            block_reader(const block_reader&);
+            block_reader& operator=(const block_reader&);
+
+            struct slot {
+                slot() : bytes(0), offset(0) {}
+                size_t bytes;
+                u64_t offset;
+            };
+
+            inline void reset() {
+#if defined(_WIN32)
+                m_file = INVALID_HANDLE_VALUE;
+#else
+                m_fd = -1;
+#endif
+                m_error = "";
+                m_offset = m_length = 0;
+                m_nch = m_samplerate = m_bits = m_format = 0;
+                m_read_slot = m_write_slot = m_ready = 0;
+                // done until start() says otherwise: next() on a
+                // reader that isn't reading returns false, not waits
+                m_done = true;
+                m_held = m_stop = false;
+                m_stats.clear();
+            }
+
+            inline bool start() {
+                m_buffers.reset(m_block_bytes * m_nblocks, (unsigned char)0);
+                m_slots.assign(m_nblocks, slot());
+                if (m_length == 0) return true;
+                m_done = false;
+                if (!m_thread.start(&block_reader::entry, this)) {
+                    m_error = "can't start the reader thread";
+                    m_done = true;
+                    close_file();
+                    return false;
+                }
+                return true;
+            }
+
+            static void entry(void* p) {
+                static_cast<block_reader*>(p)->read_all();
+            }
+
+            // The reader thread.
+            void read_all() {
+                u64_t pos = 0;
+                while (pos < m_length) {
+                    {
+                        const double t0 = detail::seconds_now();
+                        threads::scoped_lock lock(m_mutex);
+                        while (!m_stop
+                            && m_ready + (m_held ? 1 : 0) == m_nblocks) {
+                            m_space.wait(m_mutex);
+                        }
+                        m_stats.full_secs += detail::seconds_now() - t0;
+                        if (m_stop) break;
+                    }
+                    // this slot is ours until it's counted in m_ready
+                    const size_t want = (size_t)my::min(
+                        (u64_t)m_block_bytes, m_length - pos);
+                    unsigned char* d
+                        = m_buffers.data() + m_write_slot * m_block_bytes;
+                    const double t0 = detail::seconds_now();
+                    const bool ok = read_at(d, want, m_offset + pos);
+                    const double t1 = detail::seconds_now();
+
+                    threads::scoped_lock lock(m_mutex);
+                    m_stats.read_secs += t1 - t0;
+                    if (!ok) {
+                        m_error = "read failed";
+                        break;
+                    }
+                    m_slots[m_write_slot].bytes = want;
+                    m_slots[m_write_slot].offset = pos;
+                    m_write_slot = (m_write_slot + 1) % m_nblocks;
+                    ++m_ready;
+                    ++m_stats.blocks;
+                    m_stats.bytes += want;
+                    pos += want;
+                    m_data_ready.notify_one();
+                }
+                threads::scoped_lock lock(m_mutex);
+                m_done = true;
+                m_data_ready.notify_all();
+            }
+
+#if defined(_WIN32)
+            inline bool open_file(const char* path) {
+                m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ,
+                    NULL, OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                if (m_file == INVALID_HANDLE_VALUE) {
+                    m_error = "can't open file";
+                    return false;
+                }
+                return true;
+            }
+            inline u64_t file_size() const {
+                LARGE_INTEGER li;
+                if (!GetFileSizeEx(m_file, &li)) return 0;
+                return (u64_t)li.QuadPart;
+            }
+            inline void close_file() {
+                if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+                m_file = INVALID_HANDLE_VALUE;
+            }
+            // All of it, or false.
+            inline bool read_at(unsigned char* d, size_t n, u64_t at) {
+                while (n) {
+                    OVERLAPPED o;
+                    memset(&o, 0, sizeof(o));
+                    o.Offset = (DWORD)(at & 0xffffffffu);
+                    o.OffsetHigh = (DWORD)(at >> 32);
+                    DWORD got = 0;
+                    const DWORD want
+                        = (DWORD)my::min(n, (size_t)(1u << 30));
+                    if (!ReadFile(m_file, d, want, &got, &o) || got == 0) {
+                        return false;
+                    }
+                    d += got;
+                    n -= got;
+                    at += got;
+                }
+                return true;
+            }
+#else
+            inline bool open_file(const char* path) {
+                m_fd = ::open(path, O_RDONLY);
+                if (m_fd < 0) {
+                    m_error = "can't open file";
+                    return false;
+                }
+#if defined(POSIX_FADV_SEQUENTIAL)
+                posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+                return true;
+            }
+            inline u64_t file_size() const {
+                struct stat st;
+                if (fstat(m_fd, &st) != 0) return 0;
+                return (u64_t)st.st_size;
+            }
+            inline void close_file() {
+                if (m_fd >= 0) ::close(m_fd);
+                m_fd = -1;
+            }
+            inline bool read_at(unsigned char* d, size_t n, u64_t at) {
+                while (n) {
+                    const ssize_t got = pread(m_fd, d, n, (off_t)at);
+                    if (got <= 0) return false;
+                    d += got;
+                    n -= (size_t)got;
+                    at += (u64_t)got;
+                }
+                return true;
+            }
+#endif
+
+#if defined(_WIN32)
+            HANDLE m_file;
+#else
+            int m_fd;
+#endif
+            size_t m_block_bytes;
+            const size_t m_nblocks;
+            const char* m_error;
+            u64_t m_offset, m_length;
+            int m_nch, m_samplerate, m_bits, m_format;
+
+            audio_buffer<unsigned char> m_buffers; // m_nblocks blocks
+            std::vector<slot> m_slots;
+            threads::thread m_thread;
+
+            // All below: m_mutex's. A slot is the reader's to fill
+            // from m_write_slot until it's counted in m_ready, then
+            // next()'s until it's handed back.
+            threads::mutex m_mutex;
+            threads::condition m_data_ready; // m_ready went up
+            threads::condition m_space; // a slot came free, or m_stop
+            size_t m_read_slot, m_write_slot, m_ready;
+            bool m_held, m_done, m_stop;
+            reader_stats m_stats;
+        };
+
+        // env.envelope_shorts() over everything r has to give (16-bit
+        // data). Returns the frames enveloped: all of them, or up to
+        // and including the one a sentinel fired in (*phit).
+        inline u64_t envelope_reader(envelope& env, block_reader& r,
+            const float* const sentinel_attack = NULL,
+            const float* const sentinel_release = NULL,
+            bool* const phit = NULL) {
+            const size_t nch = (size_t)env.channels();
+            if (phit) *phit = false;
+            u64_t samples = 0;
+            block_reader::block b;
+            while (r.next(b)) {
+                const short* s = (const short*)b.data;
+                const short* e = s + b.bytes / sizeof(short);
+                bool hit = false;
+                const short* at = env.envelope_shorts(
+                    s, e, sentinel_attack, sentinel_release, &hit);
+                samples += (u64_t)(at - s);
+                if (hit) {
+                    if (phit) *phit = true;
+                    break;
+                }
+            }
+            return samples / nch;
+        }
+
+        // The largest |sample| in r's (16-bit) data, 0 .. 32768: the
+        // first half of normalize_buffer(), without mapping the file.
+        inline int peak_reader(block_reader& r) {
+            int peak = 0;
+            block_reader::block b;
+            while (r.next(b)) {
+                const short* s = (const short*)b.data;
+                peak = my::max(peak,
+                    simd::peak_abs(s, s + b.bytes / sizeof(short)));
+            }
+            return peak;
+        }
+
+        namespace test {
+
+            inline void check_block_reader(const char* path) {
+                const int nch = 2;
+                const u64_t nframes = 100000;
+                {
+                    wav_file w;
+                    const bool ok = w.create(path, 44100, nch, 16, nframes);
+                    assert(ok);
+                    (void)ok;
+                    my::iterator::ptrs<short> s = w.shorts();
+                    for (size_t i = 0; i < s.size(); ++i) {
+                        s[i] = (short)((int)(i * 7 % 3001) - 1500);
+                    }
+                    // a loud patch 3/4 of the way in, for the sentinel
+                    for (size_t i = 0; i < 2000; ++i) {
+                        s[s.size() * 3 / 4 + i] = (i & 1) ? -31000 : 30000;
+                    }
+                    const bool flushed = w.flush();
+                    assert(flushed);
+                    (void)flushed;
+                }
+                wav_file w;
+                const bool ok = w.open(path);
+                assert(ok);
+                (void)ok;
+                const wav_file& cw = w;
+                my::iterator::ptrs<const short> all = cw.shorts();
+
+                // Every byte, in order, through a handful of blocks
+                // (an odd size: rounded down to whole frames).
+                {
+                    block_reader r(1001, 3);
+                    const bool opened = r.open_wav(path);
+                    assert(opened);
+                    (void)opened;
+                    assert(r.channels() == nch && r.samplerate() == 44100);
+                    assert(r.block_bytes() == 1000);
+                    assert(r.length() == nframes * nch * 2);
+                    block_reader::block b;
+                    u64_t pos = 0;
+                    while (r.next(b)) {
+                        assert(b.offset == pos);
+                        assert(b.bytes % 4 == 0);
+                        assert(memcmp(b.data, all.begin() + pos / 2,
+                                   b.bytes)
+                            == 0);
+                        pos += b.bytes;
+                    }
+                    assert(pos == r.length() && *r.error() == 0);
+                    const reader_stats st = r.stats();
+                    assert(st.bytes == pos && st.blocks == (pos + 999) / 1000);
+                    (void)st;
+                }
+
+                // The same envelope, and peak, as on the mapped file.
+                {
+                    envelope a(44100, nch, 1.0f, 50.0f);
+                    a.envelope_shorts(all.begin(), all.end());
+                    block_reader r(4096, 4);
+                    bool opened = r.open_wav(path);
+                    assert(opened);
+                    envelope b(44100, nch, 1.0f, 50.0f);
+                    const u64_t frames = envelope_reader(b, r);
+                    assert(frames == nframes);
+                    assert(a() == b());
+
+                    opened = r.open_wav(path);
+                    assert(opened);
+                    const int peak = peak_reader(r);
+                    assert(peak == 31000);
+                    (void)opened;
+                    (void)frames;
+                    (void)peak;
+                }
+
+                // A sentinel: stops where envelope_shorts() does, and
+                // close() stops the reader part way through.
+                {
+                    const float att = 0.5f;
+                    envelope a(44100, nch, 1.0f, 50.0f);
+                    const short* at = a.envelope_shorts(
+                        all.begin(), all.end(), &att);
+                    block_reader r(4096, 2);
+                    const bool opened = r.open_wav(path);
+                    assert(opened);
+                    (void)opened;
+                    envelope b(44100, nch, 1.0f, 50.0f);
+                    bool hit = false;
+                    const u64_t f = envelope_reader(b, r, &att, NULL, &hit);
+                    assert(hit);
+                    assert(f == (u64_t)(at - all.begin()) / nch);
+                    r.close();
+                    assert(!r.is_open());
+                    (void)at;
+                    (void)f;
+                }
+
+                // Part of a file, and nothing at all.
+                {
+                    block_reader r(512, 2);
+                    bool ok = r.open(path, 44, 1000);
+                    assert(ok);
+                    block_reader::block b;
+                    size_t bytes = 0;
+                    while (r.next(b)) bytes += b.bytes;
+                    assert(bytes == 1000);
+                    ok = r.open(path, 1u << 30);
+                    assert(ok);
+                    bool more = r.next(b);
+                    assert(!more && r.length() == 0);
+                    ok = r.open("/nonexistent/dir/x.wav");
+                    assert(!ok && *r.error() != 0);
+                    // nothing to read: next() says so, and doesn't wait
+                    more = r.next(b);
+                    assert(!more);
+                    ok = r.open_wav("/nonexistent/dir/x.wav");
+                    assert(!ok);
+                    more = r.next(b);
+                    assert(!more);
+                    r.close();
+                    more = r.next(b);
+                    assert(!more);
+                    block_reader never;
+                    more = never.next(b);
+                    assert(!more);
+                    (void)ok;
+                    (void)more;
+                }
+                w.close();
+                remove(path);
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_READER_HPP
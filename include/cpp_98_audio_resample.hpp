@@ -0,0 +1,466 @@
+/*/
+ * Sample rate conversion: polyphase, windowed sinc, streaming.
+ *
+ * Any rational ratio: out_rate / in_rate is reduced to up / down (48000
+ * / 44100 is 160 / 147), and output frame k is taken at input position
+ * k * down / up. That lands between input frames at one of 'up'
+ * fractional offsets, the phases; each phase has its own set of taps,
+ * worked out once up front: a sinc, cut off at the lower of the two
+ * Nyquist frequencies, under a Kaiser window. An output sample is then
+ * one dot product (SIMD: simd::dot()) of the taps with the input around
+ * it, per channel.
+ *
+ * Input and output are interleaved, shorts or floats, as everywhere
+ * else here. Give process() the input a block at a time, as it comes;
+ * each call writes out what the input so far makes, which is at most
+ * max_out_frames() frames. An output frame needs taps() / 2 input
+ * frames after it, so the last few wait for the next call, or for
+ * flush() at the end of the stream. Altogether, n frames in make
+ * ceil(n * up / down) out.
+ *
+    resampler rs(96000, 44100, 2);
+    std::vector<short> out(rs.max_out_frames(n) * 2);
+    size_t got = rs.process(in, n, &out[0]);
+ *
+ * The same rate in and out is an exact copy. envelope_resampled() runs
+ * an envelope on the converted stream, for sources at rates it can't
+ * (or shouldn't) take directly.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_RESAMPLE_HPP
+#define CPP_98_AUDIO_RESAMPLE_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include "cpp_98_audio_buffer.hpp"
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        namespace detail {
+            inline size_t gcd(size_t a, size_t b) {
+                while (b) {
+                    const size_t t = a % b;
+                    a = b;
+                    b = t;
+                }
+                return a;
+            }
+
+            // The modified Bessel function I0, for the Kaiser window.
+            inline double bessel_i0(double x) {
+                double sum = 1, term = 1;
+                const double q = x * x / 4;
+                for (int k = 1; k < 50 && term > sum * 1e-17; ++k) {
+                    term *= q / ((double)k * (double)k);
+                    sum += term;
+                }
+                return sum;
+            }
+
+            inline void load_sample(short s, float& f) {
+                f = (float)s / 32768.0f;
+            }
+            inline void load_sample(float s, float& f) { f = s; }
+            // As simd::floats_to_shorts(), at 32768: so a copy is a
+            // copy.
+            inline void store_sample(float f, short& s) {
+                f *= 32768.0f;
+                if (f > 32767.0f) f = 32767.0f;
+                if (f < -32768.0f) f = -32768.0f;
+                s = (short)f;
+            }
+            inline void store_sample(float f, float& s) { s = f; }
+        } // namespace detail
+
+        class resampler {
+            public:
+            enum {
+                DEFAULT_TAPS = 32, // per phase, when not downsampling
+                BLOCK = 1024 // input frames per pass
+            };
+
+            // taps: the filter's length in input frames (a multiple of
+            // 8; more is sharper, and slower). Downsampling stretches
+            // it by down / up, to keep as many zero crossings.
+            resampler(int in_rate, int out_rate, int nch,
+                int taps = DEFAULT_TAPS, double kaiser_beta = 8.0)
+                : m_in_rate(in_rate), m_out_rate(out_rate), m_nch(nch) {
+                assert(in_rate > 0 && out_rate > 0 && nch > 0);
+                assert(taps >= 8 && taps % 8 == 0);
+                const size_t g = detail::gcd((size_t)in_rate, (size_t)out_rate);
+                m_up = (size_t)out_rate / g;
+                m_down = (size_t)in_rate / g;
+                size_t t = (size_t)taps;
+                if (m_down > m_up) {
+                    t = (size_t)ceil((double)taps * (double)m_down
+                        / (double)m_up);
+                    t = (t + 7) / 8 * 8;
+                }
+                m_taps = t;
+                make_taps(kaiser_beta);
+                m_cap = m_taps + BLOCK;
+                m_hist.reset(m_cap * (size_t)nch, 0.0f);
+                reset();
+            }
+
+            // Back to the start of a stream: no input yet.
+            inline void reset() {
+                const size_t half = m_taps / 2;
+                std::fill(m_hist.begin(), m_hist.end(), 0.0f);
+                m_len = half - 1; // the zeros before the first frame
+                m_pos = half - 1;
+                m_real_end = m_len;
+                m_phase = 0;
+                m_in = m_out = 0;
+            }
+
+            inline int in_rate() const { return m_in_rate; }
+            inline int out_rate() const { return m_out_rate; }
+            inline int channels() const { return m_nch; }
+            inline size_t up() const { return m_up; }
+            inline size_t down() const { return m_down; }
+            inline size_t taps() const { return m_taps; }
+            inline u64_t frames_in() const { return m_in; }
+            inline u64_t frames_out() const { return m_out; }
+
+            // The most process() can write for in_frames frames in.
+            inline size_t max_out_frames(size_t in_frames) const {
+                return (size_t)(((u64_t)in_frames * m_up + m_down - 1)
+                           / m_down)
+                    + 1;
+            }
+            // The most flush() can write.
+            inline size_t max_flush_frames() const {
+                return max_out_frames(m_taps / 2);
+            }
+
+            // in_frames frames in; returns how many frames out.
+            inline size_t process(
+                const short* in, size_t in_frames, short* out) {
+                return run(in, in_frames, out);
+            }
+            inline size_t process(
+                const float* in, size_t in_frames, float* out) {
+                return run(in, in_frames, out);
+            }
+
+            // The end of the stream: the last frames out. reset() to
+            // start another.
+            inline size_t flush(short* out) { return drain(out); }
+            inline size_t flush(float* out) { return drain(out); }
+
+            private:
+            resampler(const resampler&);
+            resampler& operator=(const resampler&);
+
+            void make_taps(const double beta) {
+                const size_t half = m_taps / 2;
+                // cycles per input frame: the lower Nyquist, a little
+                // inside it (none of that for a straight copy)
+                double fc = 0.5;
+                if (m_up != m_down) {
+                    fc *= 0.94 * my::min(1.0, (double)m_up / (double)m_down);
+                }
+                const double pi = 3.14159265358979323846;
+                const double i0b = detail::bessel_i0(beta);
+                m_coefs.reset(m_up * m_taps, 0.0f);
+                std::vector<double> h(m_taps);
+                for (size_t p = 0; p < m_up; ++p) {
+                    const double frac = (double)p / (double)m_up;
+                    double sum = 0;
+                    for (size_t j = 0; j < m_taps; ++j) {
+                        // from the output's position to this tap's frame
+                        const double u
+                            = (double)j - (double)(half - 1) - frac;
+                        const double x = 2 * fc * u;
+                        double s = 2 * fc;
+                        if (u != 0) s = sin(pi * x) / (pi * u);
+                        // a copy's taps are exactly 0 but one
+                        if (fc == 0.5 && frac == 0 && u != 0) s = 0;
+                        const double r = u / (double)half;
+                        const double w = r * r < 1
+                            ? detail::bessel_i0(beta * sqrt(1 - r * r)) / i0b
+                            : 0;
+                        h[j] = s * w;
+                        sum += h[j];
+                    }
+                    // unity gain at DC, in every phase
+                    for (size_t j = 0; j < m_taps; ++j) {
+                        m_coefs[p * m_taps + j] = (float)(h[j] / sum);
+                    }
+                }
+            }
+
+            template <typename T>
+            size_t run(const T* in, size_t in_frames, T* out) {
+                const size_t nch = (size_t)m_nch;
+                size_t n_out = 0;
+                while (in_frames) {
+                    const size_t n = my::min(in_frames, (size_t)BLOCK);
+                    // into the history, a channel at a time
+                    for (size_t ch = 0; ch < nch; ++ch) {
+                        float* h = m_hist.data() + ch * m_cap + m_len;
+                        const T* s = in + ch;
+                        for (size_t i = 0; i < n; ++i, s += nch) {
+                            detail::load_sample(*s, h[i]);
+                        }
+                    }
+                    m_len += n;
+                    m_real_end = m_len;
+                    m_in += n;
+                    in += n * nch;
+                    in_frames -= n;
+                    n_out += produce(out + n_out * nch);
+                }
+                return n_out;
+            }
+
+            template <typename T> size_t drain(T* out) {
+                const size_t nch = (size_t)m_nch;
+                const size_t real_end = m_real_end;
+                // enough zeros after the end for the last frame out
+                const size_t n = m_taps / 2;
+                for (size_t ch = 0; ch < nch; ++ch) {
+                    float* h = m_hist.data() + ch * m_cap + m_len;
+                    std::fill(h, h + n, 0.0f);
+                }
+                m_len += n;
+                m_real_end = real_end;
+                return produce(out);
+            }
+
+            // Every frame out the history allows, then drops what no
+            // frame to come needs.
+            template <typename T> size_t produce(T* out) {
+                const size_t nch = (size_t)m_nch;
+                const size_t half = m_taps / 2;
+                const float* const hist = m_hist.data();
+                const float* const coefs = m_coefs.data();
+                size_t n = 0;
+                while (m_pos + half < m_len && m_pos < m_real_end) {
+                    const float* c = coefs + m_phase * m_taps;
+                    const float* x = hist + (m_pos + 1 - half);
+                    for (size_t ch = 0; ch < nch; ++ch) {
+                        detail::store_sample(
+                            simd::dot(x + ch * m_cap, c, m_taps), *out++);
+                    }
+                    ++n;
+                    m_phase += m_down;
+                    m_pos += m_phase / m_up;
+                    m_phase %= m_up;
+                }
+                const size_t drop = my::min(m_pos + 1 - half, m_len);
+                if (drop) {
+                    for (size_t ch = 0; ch < nch; ++ch) {
+                        float* h = m_hist.data() + ch * m_cap;
+                        memmove(h, h + drop, (m_len - drop) * sizeof(float));
+                    }
+                    m_len -= drop;
+                    m_pos -= drop;
+                    m_real_end -= my::min(drop, m_real_end);
+                }
+                m_out += n;
+                return n;
+            }
+
+            int m_in_rate, m_out_rate, m_nch;
+            size_t m_up, m_down, m_taps;
+            audio_buffer<float> m_coefs; // [phase][tap]
+            // Planar, m_cap frames a channel: the frames the next
+            // output needs, on.
+            audio_buffer<float> m_hist;
+            size_t m_cap;
+            size_t m_len; // frames in the history
+            size_t m_pos; // the next output's frame, in the history
+            size_t m_real_end; // where the input ends (flush() pads)
+            size_t m_phase; // and its phase, of up()
+            u64_t m_in, m_out;
+        };
+
+        // env.envelope_shorts() on the input converted to env's rate,
+        // block by block, without converting all of it first. rs must
+        // convert to env.samplerate(), with env.channels(). Returns
+        // where a sentinel fired, as the input frame nearest the
+        // output frame it fired in (or end): rs will have read ahead
+        // of that, to the end of the block, so reset() it before
+        // carrying on from there.
+        inline const short* envelope_resampled(envelope& env,
+            resampler& rs, const short* begin, const short* end,
+            const float* const sentinel_attack = NULL,
+            const float* const sentinel_release = NULL,
+            bool* const phit = NULL) {
+            assert(rs.out_rate() == env.samplerate());
+            assert(rs.channels() == env.channels());
+            const size_t nch = (size_t)rs.channels();
+            assert((size_t)(end - begin) % nch == 0);
+            const size_t block = resampler::BLOCK;
+            std::vector<short> out(rs.max_out_frames(block) * nch);
+            if (phit) *phit = false;
+            const short* p = begin;
+            // whole frames only: a part frame left over would make no
+            // progress (n == 0) for ever
+            while ((size_t)(end - p) >= nch) {
+                const size_t n = my::min((size_t)(end - p) / nch, block);
+                const u64_t out0 = rs.frames_out();
+                const size_t got = rs.process(p, n, &out[0]);
+                bool hit = false;
+                const short* at = env.envelope_shorts(&out[0],
+                    &out[0] + got * nch, sentinel_attack, sentinel_release,
+                    &hit);
+                if (hit) {
+                    if (phit) *phit = true;
+                    const u64_t k = out0 + (u64_t)(at - &out[0]) / nch;
+                    const u64_t f = (k * rs.down() + rs.up() / 2) / rs.up();
+                    const size_t nf = (size_t)(end - begin) / nch;
+                    return begin + my::min((size_t)f, nf) * nch;
+                }
+                p += n * nch;
+            }
+            return end;
+        }
+
+        namespace test {
+
+            namespace detail {
+                // What streaming rs over in, in chunks of 'chunk'
+                // frames, makes.
+                template <typename T>
+                inline std::vector<T> resample_all(resampler& rs,
+                    const std::vector<T>& in, size_t chunk) {
+                    const size_t nch = (size_t)rs.channels();
+                    const size_t frames = in.size() / nch;
+                    std::vector<T> out(
+                        (rs.max_out_frames(frames) + rs.max_flush_frames())
+                        * nch);
+                    size_t got = 0;
+                    for (size_t f = 0; f < frames; f += chunk) {
+                        const size_t n = my::min(chunk, frames - f);
+                        got += rs.process(
+                            &in[f * nch], n, &out[got * nch]);
+                    }
+                    got += rs.flush(&out[got * nch]);
+                    out.resize(got * nch);
+                    return out;
+                }
+            } // namespace detail
+
+            inline void check_resampler() {
+                const double pi = 3.14159265358979323846;
+
+                // The same rate: a copy, exactly.
+                {
+                    std::vector<short> in(3001 * 2);
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        in[i] = (short)(i * 7919 % 65536 - 32768);
+                    }
+                    resampler rs(44100, 44100, 2);
+                    assert(detail::resample_all(rs, in, 500) == in);
+                }
+
+                // 44.1k -> 48k, 48k -> 44.1k, 96k -> 44.1k: a 1kHz
+                // tone comes out a 1kHz tone, the right length.
+                const int rates[][2] = { { 44100, 48000 },
+                    { 48000, 44100 }, { 96000, 44100 }, { 8000, 11025 } };
+                for (int r = 0; r < 4; ++r) {
+                    const int fin = rates[r][0];
+                    const int fout = rates[r][1];
+                    const size_t n = (size_t)fin / 4;
+                    std::vector<float> in(n);
+                    for (size_t i = 0; i < n; ++i) {
+                        in[i] = 0.5f * (float)sin(2 * pi * 1000.0 * i / fin);
+                    }
+                    resampler rs(fin, fout, 1);
+                    const std::vector<float> out
+                        = detail::resample_all(rs, in, 777);
+                    const size_t want = (size_t)(((u64_t)n * rs.up()
+                                            + rs.down() - 1)
+                        / rs.down());
+                    assert(out.size() == want);
+                    double worst = 0;
+                    // away from the ends, where the filter runs off
+                    for (size_t k = rs.taps(); k + rs.taps() < want; ++k) {
+                        const double ideal
+                            = 0.5 * sin(2 * pi * 1000.0 * k / fout);
+                        worst = my::max(worst, fabs(out[k] - ideal));
+                    }
+                    assert(worst < 2e-4);
+                    (void)worst;
+                }
+
+                // Down to 44.1k, a 30kHz tone (over the new Nyquist)
+                // is all but gone, not aliased down to 14.1kHz.
+                {
+                    const int fin = 96000;
+                    std::vector<float> in(fin / 4);
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        in[i] = 0.5f * (float)sin(2 * pi * 30000.0 * i / fin);
+                    }
+                    resampler rs(fin, 44100, 1);
+                    const std::vector<float> out
+                        = detail::resample_all(rs, in, 1000);
+                    float pk = 0;
+                    for (size_t k = rs.taps(); k + rs.taps() < out.size();
+                         ++k) {
+                        pk = my::max(pk, (float)fabs(out[k]));
+                    }
+                    assert(pk < 0.5f * 0.001f);
+                    (void)pk;
+                }
+
+                // However it's chunked, and at every SIMD level: the
+                // same bits.
+                {
+                    std::vector<short> in(20000 * 2);
+                    unsigned int seed = 11;
+                    for (size_t i = 0; i < in.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        in[i] = (short)((short)(seed >> 16) >> 1);
+                    }
+                    resampler ref_rs(48000, 44100, 2);
+                    const std::vector<short> ref
+                        = detail::resample_all(ref_rs, in, 20000);
+                    const int was = simd::simd_level();
+                    for (int level = simd::SIMD_SCALAR;
+                         level <= simd::detected_simd_level(); ++level) {
+                        simd::set_simd_level(level);
+                        resampler rs(48000, 44100, 2);
+                        assert(detail::resample_all(rs, in, 333) == ref);
+                    }
+                    simd::set_simd_level(was);
+
+                    // and an envelope on it, straight through
+                    envelope a(44100, 2, 1.0f, 50.0f);
+                    a.set_fast_forward(false);
+                    a.envelope_shorts(&ref[0], &ref[0] + ref.size());
+                    envelope b(44100, 2, 1.0f, 50.0f);
+                    b.set_fast_forward(false);
+                    resampler rs(48000, 44100, 2);
+                    envelope_resampled(b, rs, &in[0], &in[0] + in.size());
+                    // b hasn't had the flush()ed tail
+                    assert(fabs(a() - b()) < 0.05f);
+                    const float up = 2.0f * a();
+                    bool hit = true;
+                    rs.reset();
+                    envelope_resampled(b, rs, &in[0], &in[0] + in.size(),
+                        &up, NULL, &hit);
+                    assert(!hit);
+                }
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_RESAMPLE_HPP
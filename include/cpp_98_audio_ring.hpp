@@ -0,0 +1,351 @@
+/*/
+ * A lock-free, wait-free ring of interleaved samples, for exactly one
+ * thread writing (capture, say) and one other reading (analysis).
+ *
+ * Neither side ever waits for, locks against or allocates because of
+ * the other: each owns one index, publishes it with a release store and
+ * reads the other's with an acquire load. The two indices live on cache
+ * lines of their own, so the threads don't fight over one line, and each
+ * side keeps its own copy of the other's index, going back for a fresh
+ * one only when the copy says it's full (or empty).
+ *
+ * Everything is in whole frames. The free (or filled) part of the ring
+ * is at most two contiguous runs, because it may wrap round the end:
+ * write_regions() / read_regions() hand them out as my::iterator::ptrs
+ * spans to write into or read from in place, and commit_write() /
+ * commit_read() then publish how much was done. write() / read() are
+ * the copying versions.
+ *
+ * envelope_ring() runs envelope_shorts() on the readable regions where
+ * they lie, and consumes them: one copy (into the ring) in all.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_RING_HPP
+#define CPP_98_AUDIO_RING_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+#include "cpp_98_audio_buffer.hpp"
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_thread.hpp"
+#include "my_iterator.h"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        template <typename T> class spsc_ring {
+            public:
+            typedef my::iterator::ptrs<T> span_t;
+
+            // At most two spans: the second is empty unless the run
+            // wraps round the end of the ring.
+            struct regions {
+                regions()
+                    : first((T*)0, (T*)0), second((T*)0, (T*)0), nch(1) {}
+                span_t first, second;
+                int nch;
+                inline size_t frames() const {
+                    return (first.size() + second.size()) / (size_t)nch;
+                }
+            };
+
+            enum { CACHE_LINE = 64 };
+
+            // Room for at least capacity_frames frames (rounded up
+            // to a power of two) of nch channels. This is the only
+            // allocation the ring ever makes.
+            spsc_ring(size_t capacity_frames, int nch = 1)
+                : m_nch(nch)
+                , m_capacity(1)
+                , m_write(0)
+                , m_read_cache(0)
+                , m_read(0)
+                , m_write_cache(0) {
+                assert(nch > 0 && capacity_frames > 0);
+                while (m_capacity < capacity_frames) m_capacity <<= 1;
+                m_mask = m_capacity - 1;
+                m_buf.reset(m_capacity * (size_t)nch, T());
+            }
+
+            inline int channels() const { return m_nch; }
+            inline size_t capacity() const { return m_capacity; }
+
+            // Producer side ------------------------------------------
+
+            // Frames that can be written now.
+            inline size_t write_available() {
+                size_t free = m_capacity - (m_write - m_read_cache);
+                if (free == 0) {
+                    m_read_cache = threads::load_acquire(&m_read);
+                    free = m_capacity - (m_write - m_read_cache);
+                }
+                return free;
+            }
+
+            // Where up to max_frames frames can be written, in place.
+            // Nothing is published until commit_write().
+            inline regions write_regions(size_t max_frames = size_t(-1)) {
+                m_read_cache = threads::load_acquire(&m_read);
+                const size_t n = my::min(
+                    max_frames, m_capacity - (m_write - m_read_cache));
+                return regions_at(m_write, n);
+            }
+
+            // Publishes frames written into write_regions().
+            inline void commit_write(size_t frames) {
+                assert(frames <= m_capacity - (m_write - m_read_cache));
+                threads::store_release(&m_write, m_write + frames);
+            }
+
+            // Copies in as many of the frames at src as fit (whole
+            // frames: nframes * channels() samples), and returns how
+            // many that was.
+            inline size_t write(const T* src, size_t nframes) {
+                const regions r = write_regions(nframes);
+                T* d1 = r.first.begin();
+                T* d2 = r.second.begin();
+                std::copy(src, src + r.first.size(), d1);
+                std::copy(src + r.first.size(),
+                    src + r.first.size() + r.second.size(), d2);
+                const size_t n = r.frames();
+                commit_write(n);
+                return n;
+            }
+
+            // Consumer side ------------------------------------------
+
+            // Frames that can be read now.
+            inline size_t read_available() {
+                size_t filled = m_write_cache - m_read;
+                if (filled == 0) {
+                    m_write_cache = threads::load_acquire(&m_write);
+                    filled = m_write_cache - m_read;
+                }
+                return filled;
+            }
+
+            // Where up to max_frames readable frames are, in place.
+            // They stay put until commit_read().
+            inline regions read_regions(size_t max_frames = size_t(-1)) {
+                m_write_cache = threads::load_acquire(&m_write);
+                const size_t n
+                    = my::min(max_frames, m_write_cache - m_read);
+                return regions_at(m_read, n);
+            }
+
+            // Hands frames from read_regions() back to the producer.
+            inline void commit_read(size_t frames) {
+                assert(frames <= m_write_cache - m_read);
+                threads::store_release(&m_read, m_read + frames);
+            }
+
+            // Copies out up to nframes frames, and returns how many.
+            inline size_t read(T* dst, size_t nframes) {
+                const regions r = read_regions(nframes);
+                dst = std::copy(r.first.begin(), r.first.end(), dst);
+                std::copy(r.second.begin(), r.second.end(), dst);
+                const size_t n = r.frames();
+                commit_read(n);
+                return n;
+            }
+
+            private:
+            spsc_ring(const spsc_ring&);
+            spsc_ring& operator=(const spsc_ring&);
+
+            // n frames from position pos (a frame count that only
+            // ever goes up: the mask finds it in the ring).
+            inline regions regions_at(size_t pos, size_t n) const {
+                regions r;
+                r.nch = m_nch;
+                T* const base = const_cast<T*>(m_buf.data());
+                const size_t at = pos & m_mask;
+                const size_t n1 = my::min(n, m_capacity - at);
+                const size_t nch = (size_t)m_nch;
+                r.first = span_t(base + at * nch, base + (at + n1) * nch);
+                r.second = span_t(base, base + (n - n1) * nch);
+                return r;
+            }
+
+            // Set up once, then only read.
+            int m_nch;
+            size_t m_capacity, m_mask;
+            audio_buffer<T> m_buf;
+
+            // The producer's line: its index, and its copy of the
+            // consumer's.
+            char m_pad0[CACHE_LINE];
+            volatile size_t m_write;
+            size_t m_read_cache;
+            char m_pad1[CACHE_LINE - 2 * sizeof(size_t)];
+            // The consumer's.
+            volatile size_t m_read;
+            size_t m_write_cache;
+            char m_pad2[CACHE_LINE - 2 * sizeof(size_t)];
+        };
+
+        // env.envelope_shorts() over what's readable in the ring (up
+        // to max_frames frames), in place, consuming it. A sentinel
+        // stops it, as it would envelope_shorts(): only the frames up
+        // to and including the one it fired in are consumed. Returns
+        // the frames consumed.
+        inline size_t envelope_ring(envelope& env, spsc_ring<short>& ring,
+            const float* const sentinel_attack = NULL,
+            const float* const sentinel_release = NULL,
+            bool* const phit = NULL, size_t max_frames = size_t(-1)) {
+
+            assert(env.channels() == ring.channels());
+            if (phit) *phit = false;
+            const spsc_ring<short>::regions r = ring.read_regions(max_frames);
+            const size_t nch = (size_t)ring.channels();
+            size_t done = 0;
+            const spsc_ring<short>::span_t* spans[2]
+                = { &r.first, &r.second };
+            for (int i = 0; i < 2; ++i) {
+                if (spans[i]->size() == 0) continue;
+                const short* b = spans[i]->begin();
+                const short* e = spans[i]->end();
+                bool hit = false;
+                const short* at = env.envelope_shorts(
+                    b, e, sentinel_attack, sentinel_release, &hit);
+                done += (size_t)(at - b) / nch;
+                if (hit) {
+                    if (phit) *phit = true;
+                    break;
+                }
+            }
+            ring.commit_read(done);
+            return done;
+        }
+
+        namespace test {
+
+            namespace detail {
+                inline short ring_sample(size_t i) {
+                    return (short)((i * 2654435761u) >> 16);
+                }
+
+                struct ring_producer {
+                    spsc_ring<short>* ring;
+                    size_t nframes;
+
+                    static void run(void* p) {
+                        ring_producer* self = static_cast<ring_producer*>(p);
+                        spsc_ring<short>& ring = *self->ring;
+                        const size_t nch = (size_t)ring.channels();
+                        unsigned int seed = 42;
+                        size_t i = 0; // samples so far
+                        std::vector<short> chunk(3000 * nch);
+                        while (i < self->nframes * nch) {
+                            seed = seed * 1103515245u + 12345u;
+                            size_t want = 1 + (seed >> 16) % 3000;
+                            want = my::min(want, self->nframes - i / nch);
+                            if (seed & 0x100) {
+                                // in place
+                                const spsc_ring<short>::regions r
+                                    = ring.write_regions(want);
+                                short* w = r.first.begin();
+                                for (size_t k = 0; k < r.first.size(); ++k) {
+                                    w[k] = ring_sample(i + k);
+                                }
+                                w = r.second.begin();
+                                for (size_t k = 0; k < r.second.size(); ++k) {
+                                    w[k] = ring_sample(
+                                        i + r.first.size() + k);
+                                }
+                                ring.commit_write(r.frames());
+                                i += r.frames() * nch;
+                            } else {
+                                for (size_t k = 0; k < want * nch; ++k) {
+                                    chunk[k] = ring_sample(i + k);
+                                }
+                                i += ring.write(&chunk[0], want) * nch;
+                            }
+                            if (ring.write_available() == 0) {
+                                threads::yield();
+                            }
+                        }
+                    }
+                };
+            } // namespace detail
+
+            // Samples come out as they went in, whatever the chunking
+            // and wrapping, and the envelope run on the ring matches
+            // one run on the whole stream.
+            inline void check_spsc_ring() {
+                const int nch = 2;
+                const size_t nframes = 300000;
+                spsc_ring<short> ring(1000, nch);
+                assert(ring.capacity() == 1024);
+
+                detail::ring_producer prod = { &ring, nframes };
+                threads::thread t;
+                if (!t.start(&detail::ring_producer::run, &prod)) {
+                    assert(!"no thread");
+                    return;
+                }
+
+                envelope env(44100, nch, 1.0f, 50.0f);
+                env.set_fast_forward(false);
+                size_t got = 0; // frames
+                unsigned int seed = 7;
+                while (got < nframes) {
+                    seed = seed * 1103515245u + 12345u;
+                    const size_t want = 1 + (seed >> 16) % 700;
+                    // check what's there, then envelope exactly that
+                    const spsc_ring<short>::regions r
+                        = ring.read_regions(want);
+                    const size_t n = r.frames();
+                    for (size_t k = 0; k < r.first.size(); ++k) {
+                        assert(r.first[k]
+                            == detail::ring_sample(got * nch + k));
+                    }
+                    for (size_t k = 0; k < r.second.size(); ++k) {
+                        assert(r.second[k]
+                            == detail::ring_sample(
+                                got * nch + r.first.size() + k));
+                    }
+                    const size_t used
+                        = envelope_ring(env, ring, NULL, NULL, NULL, n);
+                    assert(used == n);
+                    got += used;
+                    if (n == 0) threads::yield();
+                }
+                t.join();
+                assert(ring.read_available() == 0);
+
+                std::vector<short> all(nframes * nch);
+                for (size_t i = 0; i < all.size(); ++i) {
+                    all[i] = detail::ring_sample(i);
+                }
+                envelope whole(44100, nch, 1.0f, 50.0f);
+                whole.set_fast_forward(false);
+                whole.envelope_shorts(&all[0], &all[0] + all.size());
+                assert(whole() == env());
+
+                // and a sentinel consumes only up to where it fired
+                spsc_ring<short> r2(64, 1);
+                std::vector<short> step(40, 0);
+                std::fill(step.begin() + 30, step.end(), (short)32000);
+                r2.write(&step[0], 40);
+                r2.read(&step[0], 20);
+                r2.write(&step[0], 40);
+                envelope e2(44100, 1, 0.01f, 50.0f);
+                const float att = 0.5f;
+                bool hit = false;
+                const size_t used = envelope_ring(e2, r2, &att, NULL, &hit);
+                assert(hit && used == 11 && r2.read_available() == 49);
+                (void)used;
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_RING_HPP
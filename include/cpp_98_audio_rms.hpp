@@ -0,0 +1,349 @@
+/*/
+ * An RMS level detector, to go alongside the (peak) envelope.
+ *
+ * envelope follows |x|: right for catching peaks, wrong for ducking or
+ * anything else that should follow how loud it sounds. rms_envelope
+ * follows the root mean square over a sliding window of window_ms, and
+ * smooths that with the same attack and release as envelope does. It
+ * takes the same calls, sentinels and all:
+ *
+    my::cpp98::audio::rms_envelope rms(44100, 2, 300.0f, 10.0f, 100.0f);
+    const float duck = THIRTY_DB_DOWN();
+    const short* p = rms.envelope_shorts(begin, end, &duck);
+ *
+ * The window is a ring of squares, and a running sum of them: a sample
+ * in, the one it pushes out of the window out, O(1) however long the
+ * window is. Adding and taking away floating point values doesn't
+ * quite cancel, though, and over hours the sum would drift (below zero,
+ * even, after loud then silent). So each time the ring goes round, the
+ * sum is worked out again from scratch: O(1) a sample still, spread
+ * out, and the drift can never build up over more than one window.
+ *
+ * The channel modes, here:
+ * MIXED       : the mean of the channels' squares: their power,
+ *               averaged, as a loudness meter has it.
+ * PER_CHANNEL : a window per channel. operator()() and the sentinels
+ *               see the loudest.
+ * LINKED      : the loudest channel's square, frame by frame.
+ * Times are real times in all three.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_RMS_HPP
+#define CPP_98_AUDIO_RMS_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "cpp_98_audio_envelope.hpp"
+#include "cpp_98_audio_simd.hpp"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        class rms_envelope {
+            public:
+            typedef envelope::channel_mode_t channel_mode_t;
+
+            // envelope_shorts() converts this many frames at a time.
+            enum { STREAM_BLOCK_FRAMES = 2048 };
+
+            rms_envelope(int samplerate, int nch, float window_ms = 300.0f,
+                float attms = 10.0f, float relms = 100.0f,
+                channel_mode_t mode = envelope::MIXED)
+                : m_samplerate((float)samplerate)
+                , m_nch(nch)
+                , m_mode(mode)
+                , m_window_ms(window_ms)
+                , m_attms(attms)
+                , m_relms(relms)
+                , m_ga(envelope::time_coef(m_samplerate, attms))
+                , m_gr(envelope::time_coef(m_samplerate, relms)) {
+                assert(nch > 0 && samplerate > 0);
+                double w = (double)window_ms * (double)samplerate / 1000.0;
+                m_window = w < 1.0 ? 1 : (size_t)(w + 0.5);
+                m_nwin = mode == envelope::PER_CHANNEL ? (size_t)nch : 1;
+                m_squares.resize(m_window * m_nwin);
+                m_sums.resize(m_nwin);
+                m_env.resize(m_nwin);
+                reset();
+            }
+
+            // Back to silence.
+            inline void reset() {
+                std::fill(m_squares.begin(), m_squares.end(), 0.0f);
+                std::fill(m_sums.begin(), m_sums.end(), 0.0);
+                std::fill(m_env.begin(), m_env.end(), 0.0f);
+                m_pos = 0;
+            }
+
+            // The smoothed RMS level (the loudest channel's, in
+            // PER_CHANNEL).
+            inline float operator()() const {
+                return *std::max_element(m_env.begin(), m_env.end());
+            }
+            // One channel's, in PER_CHANNEL; else the one level.
+            inline float channel_level(int ch) const {
+                return m_nwin == 1 ? m_env[0] : m_env[(size_t)ch];
+            }
+            // The RMS over the window right now, before smoothing.
+            inline float rms(int ch = 0) const {
+                return window_rms(m_nwin == 1 ? 0 : (size_t)ch);
+            }
+
+            inline channel_mode_t mode() const { return m_mode; }
+            inline int channels() const { return m_nch; }
+            inline int samplerate() const { return (int)m_samplerate; }
+            inline float window_ms() const { return m_window_ms; }
+            inline size_t window_frames() const { return m_window; }
+            inline float attack_ms() const { return m_attms; }
+            inline float release_ms() const { return m_relms; }
+            inline void set_attack_ms(float millisecs) {
+                m_attms = millisecs;
+                m_ga = envelope::time_coef(m_samplerate, millisecs);
+            }
+            inline void set_release_ms(float millisecs) {
+                m_relms = millisecs;
+                m_gr = envelope::time_coef(m_samplerate, millisecs);
+            }
+
+            // One whole frame (channels() samples). Returns what
+            // operator()() would.
+            inline float update_frame(const float* frame) {
+                push(frame);
+                return smooth();
+            }
+
+            // As envelope_shorts(): whole frames; returns where a
+            // sentinel fired (just past the frame), or end. phit
+            // tells a hit in the last frame from none.
+            const short* envelope_shorts(const short* begin,
+                const short* end,
+                const float* const sentinel_attack = NULL,
+                const float* const sentinel_release = NULL,
+                bool* const phit = NULL) {
+                assert((end - begin) % m_nch == 0);
+                if (phit) *phit = false;
+                const ptrdiff_t block
+                    = (ptrdiff_t)STREAM_BLOCK_FRAMES * m_nch;
+                m_conversion_buffer.resize((size_t)block);
+                float* const buf = &m_conversion_buffer[0];
+                while (begin < end) {
+                    const ptrdiff_t n = my::min(end - begin, block);
+                    simd::shorts_to_floats(begin, begin + n, buf);
+                    bool hit = false;
+                    const float* at = envelope_floats(buf, buf + n,
+                        sentinel_attack, sentinel_release, &hit);
+                    if (hit) {
+                        if (phit) *phit = true;
+                        return begin + (at - buf);
+                    }
+                    begin += n;
+                }
+                return end;
+            }
+
+            // The same, on floats (full scale +/-1).
+            const float* envelope_floats(const float* begin,
+                const float* end,
+                const float* const sentinel_attack = NULL,
+                const float* const sentinel_release = NULL,
+                bool* const phit = NULL) {
+                assert((end - begin) % m_nch == 0);
+                const float inf = std::numeric_limits<float>::infinity();
+                const float att = sentinel_attack ? *sentinel_attack : inf;
+                const float rel
+                    = sentinel_release ? *sentinel_release : -inf;
+                if (phit) *phit = false;
+                while (begin < end) {
+                    push(begin);
+                    begin += m_nch;
+                    const float level = smooth();
+                    if (level >= att || level <= rel) {
+                        if (phit) *phit = true;
+                        return begin;
+                    }
+                }
+                return end;
+            }
+
+            private:
+            // One frame's squares into the window(s).
+            inline void push(const float* frame) {
+                const size_t nch = (size_t)m_nch;
+                float* const sq = &m_squares[m_pos * m_nwin];
+                if (m_mode == envelope::PER_CHANNEL) {
+                    for (size_t ch = 0; ch < nch; ++ch) {
+                        const float s = frame[ch] * frame[ch];
+                        m_sums[ch] += (double)s - (double)sq[ch];
+                        sq[ch] = s;
+                    }
+                } else {
+                    float s = 0;
+                    if (m_mode == envelope::LINKED) {
+                        for (size_t ch = 0; ch < nch; ++ch) {
+                            s = my::max(s, frame[ch] * frame[ch]);
+                        }
+                    } else {
+                        for (size_t ch = 0; ch < nch; ++ch) {
+                            s += frame[ch] * frame[ch];
+                        }
+                        s /= (float)m_nch;
+                    }
+                    m_sums[0] += (double)s - (double)sq[0];
+                    sq[0] = s;
+                }
+                if (++m_pos == m_window) {
+                    m_pos = 0;
+                    resum();
+                }
+            }
+
+            // The drift stops here: the sums, from the squares.
+            inline void resum() {
+                for (size_t k = 0; k < m_nwin; ++k) {
+                    double sum = 0;
+                    for (size_t i = 0; i < m_window; ++i) {
+                        sum += (double)m_squares[i * m_nwin + k];
+                    }
+                    m_sums[k] = sum;
+                }
+            }
+
+            inline float window_rms(size_t k) const {
+                const double ms = m_sums[k] / (double)m_window;
+                return ms > 0 ? (float)sqrt(ms) : 0.0f;
+            }
+
+            inline float smooth() {
+                float loudest = 0;
+                for (size_t k = 0; k < m_nwin; ++k) {
+                    const float r = window_rms(k);
+                    float& env = m_env[k];
+                    env = r + (env < r ? m_ga : m_gr) * (env - r);
+                    loudest = my::max(loudest, env);
+                }
+                return loudest;
+            }
+
+            float m_samplerate;
+            int m_nch;
+            channel_mode_t m_mode;
+            float m_window_ms, m_attms, m_relms, m_ga, m_gr;
+            size_t m_window; // frames
+            size_t m_nwin; // windows: channels, or 1
+            std::vector<float> m_squares; // [frame][window]
+            std::vector<double> m_sums;
+            std::vector<float> m_env;
+            size_t m_pos; // next frame in the ring
+            std::vector<float> m_conversion_buffer;
+        };
+
+        namespace test {
+
+            // Against the O(N*W) loop it replaces, then the drift.
+            inline void check_rms_envelope() {
+                const int nch = 2;
+                const int sr = 8000;
+                std::vector<short> in((size_t)sr * 3 * nch);
+                unsigned int seed = 99;
+                for (size_t i = 0; i < in.size(); ++i) {
+                    seed = seed * 1103515245u + 12345u;
+                    const int shift = (i / nch / 3000) % 2 ? 1 : 5;
+                    in[i] = (short)((short)(seed >> 16) >> shift);
+                }
+                std::vector<float> f(in.size());
+                simd::shorts_to_floats(&in[0], &in[0] + in.size(), &f[0]);
+
+                const envelope::channel_mode_t modes[]
+                    = { envelope::MIXED, envelope::PER_CHANNEL,
+                          envelope::LINKED };
+                for (int m = 0; m < 3; ++m) {
+                    // no smoothing: just the window
+                    rms_envelope r(sr, nch, 50.0f, 0.0f, 0.0f, modes[m]);
+                    const size_t w = r.window_frames();
+                    assert(w == 400);
+                    for (size_t fr = 0; fr < f.size() / nch; ++fr) {
+                        const float level = r.update_frame(&f[fr * nch]);
+                        if (fr % 97) continue;
+                        double want = 0;
+                        for (int ch = 0; ch < nch; ++ch) {
+                            double sum = 0, mix = 0, pk = 0;
+                            for (size_t k = 0; k < w && k <= fr; ++k) {
+                                const double s = f[(fr - k) * nch + ch];
+                                const double o
+                                    = f[(fr - k) * nch + (1 - ch)];
+                                sum += s * s;
+                                mix += (s * s + o * o) / 2;
+                                pk += my::max(s * s, o * o);
+                            }
+                            const double v = modes[m] == envelope::MIXED
+                                ? mix
+                                : modes[m] == envelope::LINKED ? pk : sum;
+                            want = my::max(want, sqrt(v / (double)w));
+                        }
+                        assert(std::fabs(level - want) < 1e-5);
+                        (void)level;
+                    }
+                }
+
+                // A sine's RMS is its peak over root 2.
+                {
+                    rms_envelope r(sr, 1, 100.0f, 5.0f, 5.0f);
+                    std::vector<float> s((size_t)sr);
+                    for (size_t i = 0; i < s.size(); ++i) {
+                        s[i] = 0.5f * (float)sin((double)i * 0.3);
+                    }
+                    r.envelope_floats(&s[0], &s[0] + s.size());
+                    assert(std::fabs(r() - 0.5f / sqrt(2.0f)) < 2e-3f);
+                }
+
+                // The block call, sentinels and all, does what frame
+                // by frame does, however it's chunked.
+                {
+                    const float up = 0.1f;
+                    rms_envelope a(sr, nch, 30.0f, 20.0f, 50.0f);
+                    rms_envelope b(sr, nch, 30.0f, 20.0f, 50.0f);
+                    size_t want = 0;
+                    while (a.update_frame(&f[want * nch]) < up) ++want;
+                    ++want;
+                    bool hit = false;
+                    const short* p = &in[0];
+                    while (!hit) {
+                        p = b.envelope_shorts(p, p + 2 * 333, &up, NULL,
+                            &hit);
+                    }
+                    assert((size_t)(p - &in[0]) == want * nch);
+                    assert(a() == b());
+                }
+
+                // Hours of loud, then silence: it gets back to exactly
+                // nothing, rather than drifting off.
+                {
+                    rms_envelope r(sr, 1, 10.0f, 0.0f, 0.0f);
+                    std::vector<float> loud((size_t)sr * 60);
+                    for (size_t i = 0; i < loud.size(); ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        loud[i] = (float)(short)(seed >> 16) / 32768.0f;
+                    }
+                    for (int k = 0; k < 60; ++k) {
+                        r.envelope_floats(&loud[0], &loud[0] + loud.size());
+                    }
+                    std::vector<float> quiet(r.window_frames() * 2, 0.0f);
+                    r.envelope_floats(&quiet[0], &quiet[0] + quiet.size());
+                    assert(r.rms() == 0.0f && r() == 0.0f);
+                }
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_RMS_HPP
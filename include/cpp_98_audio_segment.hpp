@@ -0,0 +1,332 @@
+/*/
+ * Every loud and quiet stretch of a stream, in one pass.
+ *
+ * envelope_shorts() stops at the first sentinel; finding every loud
+ * segment of a file with it means calling it again and again. segmenter
+ * drives the envelope through the whole input once, noting each time
+ * the level goes up to on_level (the start of a segment) or down to
+ * off_level (its end). off_level below on_level is the hysteresis:
+ * a level hovering around one threshold doesn't chatter.
+ *
+ * Two rules tidy up the result:
+ *  - a quiet gap shorter than min_gap_frames doesn't end the segment;
+ *  - a segment (gaps bridged) shorter than min_segment_frames is
+ *    dropped.
+ *
+ * Segments come out as pairs of events (start, end) in an array the
+ * caller owns, in frames from the start of the stream. As a segment
+ * can't be judged until it's over, its events come out when it is.
+ *
+    segment_event ev[64];
+    size_t n = 0;
+    segmenter seg(env, segment_rules(THIRTY_DB_DOWN(), FORTY_DB_DOWN()));
+    const short* p = begin;
+    while (p < end) {
+        p = seg.process(p, end, ev, 64, n);
+        use(ev, n);
+    }
+    n = seg.finish(ev, 64);
+    use(ev, n);
+ *
+ * trim_silence() is the simple case: where the sound starts and stops.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_SEGMENT_HPP
+#define CPP_98_AUDIO_SEGMENT_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "cpp_98_audio_envelope.hpp"
+#include "my_iterator.h"
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        struct segment_rules {
+            segment_rules(float on = THIRTY_DB_DOWN(),
+                float off = FORTY_DB_DOWN(), size_t min_segment = 0,
+                size_t min_gap = 0)
+                : on_level(on)
+                , off_level(off)
+                , min_segment_frames(min_segment)
+                , min_gap_frames(min_gap) {}
+
+            float on_level; // a segment starts when the level gets here
+            float off_level; // and ends when it's down to here
+            size_t min_segment_frames;
+            size_t min_gap_frames;
+        };
+
+        struct segment_event {
+            u64_t frame; // where the level crossed the threshold
+            bool start; // a start (on_level), else an end (off_level)
+        };
+
+        class segmenter {
+            public:
+            segmenter(envelope& env, const segment_rules& rules)
+                : m_env(env), m_rules(rules) {
+                assert(rules.off_level < rules.on_level);
+                reset();
+            }
+
+            // Back to the start of a stream (the envelope is left as
+            // it is).
+            inline void reset() {
+                m_above = false;
+                m_frames = 0;
+                m_open = false;
+                m_have_end = false;
+                m_start = m_end = 0;
+            }
+
+            // The next part of the stream, whole frames. Writes up to
+            // max events to out (at least 2), and their number to
+            // nout. Returns end, or where it stopped because out was
+            // full: carry on from there.
+            inline const short* process(const short* begin,
+                const short* end, segment_event* out, size_t max,
+                size_t& nout) {
+                assert(max >= 2);
+                nout = 0;
+                sink s = { this, begin, out, max, &nout };
+                const short* at = m_env.crossings_shorts(begin, end,
+                    m_rules.on_level, m_rules.off_level, m_above, s);
+                m_frames += (u64_t)((at - begin) / m_env.channels());
+                // A gap that's already long enough ends its segment
+                // now, rather than when the next one starts.
+                if (m_have_end && m_frames - m_end >= m_rules.min_gap_frames
+                    && max - nout >= 2) {
+                    close(m_end, out, nout);
+                }
+                return at;
+            }
+
+            // The end of the stream: out gets what's left (at most 2
+            // events). A segment still going ends here.
+            inline size_t finish(segment_event* out, size_t max) {
+                assert(max >= 2);
+                (void)max;
+                size_t nout = 0;
+                if (m_open) {
+                    close(m_have_end ? m_end : m_frames, out, nout);
+                }
+                return nout;
+            }
+
+            // Frames process()ed so far.
+            inline u64_t frames() const { return m_frames; }
+            // In a segment (or a gap in one) right now?
+            inline bool in_segment() const { return m_open; }
+
+            private:
+            // What crossings_shorts() calls back.
+            struct sink {
+                segmenter* self;
+                const short* base;
+                segment_event* out;
+                size_t max;
+                size_t* nout;
+                inline bool operator()(const short* where, bool above) {
+                    const u64_t frame = self->m_frames
+                        + (u64_t)((where - base) / self->m_env.channels())
+                        - 1;
+                    self->crossing(frame, above, out, *nout);
+                    // Every crossing has room to close a segment: stop
+                    // before one mightn't.
+                    return max - *nout >= 2;
+                }
+            };
+            friend struct sink;
+
+            inline void crossing(const u64_t frame, const bool above,
+                segment_event* out, size_t& nout) {
+                if (!above) {
+                    m_have_end = true;
+                    m_end = frame;
+                    return;
+                }
+                if (m_have_end) {
+                    if (frame - m_end < m_rules.min_gap_frames) {
+                        m_have_end = false; // bridged
+                        return;
+                    }
+                    close(m_end, out, nout);
+                }
+                m_open = true;
+                m_start = frame;
+            }
+
+            inline void close(const u64_t end, segment_event* out,
+                size_t& nout) {
+                if (end - m_start >= m_rules.min_segment_frames) {
+                    emit(m_start, end, out, nout);
+                }
+                m_open = false;
+                m_have_end = false;
+            }
+
+            inline void emit(const u64_t start, const u64_t end,
+                segment_event* out, size_t& nout) {
+                out[nout].frame = start;
+                out[nout].start = true;
+                out[nout + 1].frame = end;
+                out[nout + 1].start = false;
+                nout += 2;
+            }
+
+            envelope& m_env;
+            segment_rules m_rules;
+            bool m_above;
+            u64_t m_frames;
+            bool m_open, m_have_end;
+            u64_t m_start, m_end;
+
+            segmenter(const segmenter&);
+            segmenter& operator=(const segmenter&);
+        };
+
+        // The part of [begin, end) from the first frame with a sample
+        // at or above 'threshold' (of full scale) to the last: all
+        // frames. An empty span at end if it's all below.
+        template <typename T>
+        inline my::iterator::ptrs<T> trim_silence(T* begin, T* end,
+            int nch, float threshold = SIXTY_DB_DOWN()) {
+            double lo, hi;
+            detail::full_scale(T(), lo, hi);
+            const double thr = (double)threshold * hi;
+            const size_t n = (size_t)(end - begin);
+            const size_t fr = (size_t)nch;
+            size_t first = n;
+            for (size_t i = 0; i < n; ++i) {
+                const double v = (double)begin[i];
+                if (v >= thr || -v >= thr) {
+                    first = i;
+                    break;
+                }
+            }
+            if (first == n) return my::iterator::ptrs<T>(end, end);
+            size_t last = first;
+            for (size_t i = n; i-- > first;) {
+                const double v = (double)begin[i];
+                if (v >= thr || -v >= thr) {
+                    last = i;
+                    break;
+                }
+            }
+            size_t stop = (last / fr + 1) * fr;
+            if (stop > n) stop = n;
+            return my::iterator::ptrs<T>(
+                begin + first / fr * fr, begin + stop);
+        }
+
+        namespace test {
+
+            // The one pass must find exactly the crossings that calling
+            // envelope_shorts() again and again does; then the rules.
+            inline void check_segmenter() {
+                const int nch = 2;
+                const size_t sec = 44100;
+                std::vector<short> in(sec * 6 * nch, 0);
+                unsigned int seed = 5150;
+                // bursts of noise: [start, length] in ms
+                const int bursts[][2] = { { 200, 800 }, { 1150, 400 },
+                    { 2500, 20 }, { 3000, 1500 }, { 5700, 300 } };
+                for (int b = 0; b < 5; ++b) {
+                    const size_t f0 = sec * bursts[b][0] / 1000;
+                    const size_t f1 = f0 + sec * bursts[b][1] / 1000;
+                    for (size_t i = f0 * nch; i < f1 * nch; ++i) {
+                        seed = seed * 1103515245u + 12345u;
+                        in[i] = (short)((short)(seed >> 16) >> 2);
+                    }
+                }
+                const short* const b = &in[0];
+                const short* const e = b + in.size();
+                const float on = 0.1f;
+                const float off = 0.01f;
+
+                // the old way
+                std::vector<u64_t> want;
+                {
+                    envelope env(44100, nch, 1.0f, 30.0f, envelope::LINKED);
+                    bool above = false;
+                    const short* p = b;
+                    for (;;) {
+                        bool hit = false;
+                        p = env.envelope_shorts(p, e, above ? NULL : &on,
+                            above ? &off : NULL, &hit);
+                        if (!hit) break;
+                        want.push_back((u64_t)((p - b) / nch) - 1);
+                        above = !above;
+                    }
+                    // the last burst runs to the end
+                    want.push_back(in.size() / nch);
+                }
+                assert(want.size() == 10);
+
+                // one pass, with room for just one segment at a time
+                for (int ff = 0; ff < 2; ++ff) {
+                    envelope env(44100, nch, 1.0f, 30.0f, envelope::LINKED);
+                    env.set_fast_forward(ff != 0);
+                    segmenter seg(env, segment_rules(on, off));
+                    std::vector<u64_t> got;
+                    segment_event ev[2];
+                    size_t n = 0;
+                    const short* p = b;
+                    while (p < e) {
+                        p = seg.process(p, e, ev, 2, n);
+                        for (size_t i = 0; i < n; ++i) {
+                            assert(ev[i].start == (got.size() % 2 == 0));
+                            got.push_back(ev[i].frame);
+                        }
+                    }
+                    n = seg.finish(ev, 2);
+                    for (size_t i = 0; i < n; ++i) got.push_back(ev[i].frame);
+                    assert(got == want);
+                }
+
+                // a 100ms minimum gap joins the first two bursts (the
+                // level takes about 100ms to fall from one to off); a
+                // 200ms minimum length drops the 20ms one.
+                {
+                    envelope env(44100, nch, 1.0f, 30.0f, envelope::LINKED);
+                    segmenter seg(env,
+                        segment_rules(on, off, sec / 5, sec / 10));
+                    segment_event ev[32];
+                    size_t n = 0;
+                    const short* p = seg.process(b, e, ev, 32, n);
+                    assert(p == e);
+                    n += seg.finish(ev + n, 32 - n);
+                    assert(n == 6);
+                    assert(ev[0].frame == want[0] && ev[1].frame == want[3]);
+                    assert(ev[2].frame == want[6] && ev[3].frame == want[7]);
+                    assert(ev[4].frame == want[8] && ev[5].frame == want[9]);
+                    (void)p;
+                }
+
+                my::iterator::ptrs<short> t
+                    = trim_silence(&in[0], &in[0] + in.size(), nch);
+                assert((short*)t.begin() == &in[sec * 200 / 1000 * nch]);
+                assert((short*)t.end() == &in[0] + in.size());
+                std::vector<short> quiet(1000, 3);
+                t = trim_silence(&quiet[0], &quiet[0] + 1000, nch);
+                assert(t.size() == 0);
+                std::vector<float> f(1001, 0.0f);
+                f[501] = -0.5f;
+                my::iterator::ptrs<float> tf
+                    = trim_silence(&f[0], &f[0] + 1001, 1, 0.1f);
+                assert(tf.size() == 1 && (float*)tf.begin() == &f[501]);
+                (void)tf;
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_SEGMENT_HPP
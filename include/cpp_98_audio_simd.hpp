@@ -0,0 +1,1282 @@
+/*/
+ * SSE2 / AVX2 kernels for the widest sample loops (format conversion,
+ * peak scanning, gain, (de)interleaving), with a scalar fallback.
+ *
+ * The kernel actually used is picked at runtime from what the CPU says
+ * it can do, so one binary runs (fast) everywhere. Old compilers, or
+ * non-x86 targets, just get the scalar loops: the C++98 build is
+ * unaffected.
+ *
+ * Define CPP98AUDIO_NO_SIMD to compile the vector paths out entirely.
+ *
+ * All paths are bit-exact with the scalar ones in
+ * cpp_98_audio_envelope.hpp (see test::check_simd_conversions_bit_exact()
+ * and test::check_normalize_buffer()) for every finite input. NaN is
+ * not: don't feed it NaN.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_SIMD_HPP
+#define CPP_98_AUDIO_SIMD_HPP
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#if !defined(CPP98AUDIO_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CPP98AUDIO_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled in per-function (no -mavx2 needed), and only
+// ever called if cpuid says so.
+#if defined(CPP98AUDIO_HAVE_SSE2)
+#if defined(__clang__) \
+    || (defined(__GNUC__) && (__GNUC__ >= 5))
+#define CPP98AUDIO_HAVE_AVX2 1
+#define CPP98AUDIO_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (_MSC_VER >= 1700)
+#define CPP98AUDIO_HAVE_AVX2 1
+#define CPP98AUDIO_TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+#endif
+#endif // CPP98AUDIO_NO_SIMD
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+        namespace simd {
+
+            enum simd_level_t {
+                SIMD_SCALAR = 0,
+                SIMD_SSE2 = 1,
+                SIMD_AVX2 = 2
+            };
+
+            // What this machine (and this build) can do.
+            inline int detected_simd_level() {
+                static int level = -1;
+                if (level >= 0) return level;
+                level = SIMD_SCALAR;
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                level = SIMD_SSE2;
+#endif
+#if defined(CPP98AUDIO_HAVE_AVX2)
+#if defined(_MSC_VER) && !defined(__clang__)
+                int info[4] = { 0, 0, 0, 0 };
+                __cpuid(info, 0);
+                if (info[0] >= 7) {
+                    __cpuid(info, 1);
+                    const bool osxsave = (info[2] & (1 << 27)) != 0;
+                    const bool avx = (info[2] & (1 << 28)) != 0;
+                    if (osxsave && avx
+                        && (_xgetbv(0) & 6) == 6) {
+                        __cpuidex(info, 7, 0);
+                        if (info[1] & (1 << 5)) level = SIMD_AVX2;
+                    }
+                }
+#else
+                __builtin_cpu_init();
+                if (__builtin_cpu_supports("avx2")) {
+                    level = SIMD_AVX2;
+                }
+#endif
+#endif
+                return level;
+            }
+
+            namespace detail {
+                inline int& simd_level_ref() {
+                    static int level = detected_simd_level();
+                    return level;
+                }
+            } // namespace detail
+
+            // The level the kernels below dispatch on.
+            inline int simd_level() { return detail::simd_level_ref(); }
+
+            // Mostly for tests and benchmarks: you can go down, but
+            // never above what the machine can do. Returns the level
+            // actually set.
+            inline int set_simd_level(int level) {
+                if (level > detected_simd_level()) {
+                    level = detected_simd_level();
+                }
+                if (level < SIMD_SCALAR) level = SIMD_SCALAR;
+                detail::simd_level_ref() = level;
+                return level;
+            }
+
+            namespace detail {
+
+                inline void scalar_shorts_to_floats(
+                    const short* s, const short* const e, float* d) {
+                    while (s < e) {
+                        float val = (float)*s++;
+                        val /= 32768.0f;
+                        *d++ = val;
+                    }
+                }
+
+                inline void scalar_floats_to_shorts(const float* s,
+                    const float* const e, short* d, const float mult) {
+                    while (s < e) {
+                        float val = *s++ * mult;
+                        if (val > 32767.0f) val = 32767.0f;
+                        if (val < -32768.0f) val = -32768.0f;
+                        *d++ = (short)val;
+                    }
+                }
+
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                // 1/32768 is a power of two, so multiplying by it is
+                // bit-identical to the scalar divide.
+                inline void sse2_shorts_to_floats(
+                    const short* s, const short* const e, float* d) {
+                    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+                    while (e - s >= 8) {
+                        const __m128i x = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s));
+                        const __m128i lo
+                            = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+                        const __m128i hi
+                            = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+                        _mm_storeu_ps(
+                            d, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+                        _mm_storeu_ps(
+                            d + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+                        s += 8;
+                        d += 8;
+                    }
+                    scalar_shorts_to_floats(s, e, d);
+                }
+
+                // Clamp first, then truncate, then saturating pack:
+                // clamping first keeps cvtt away from its 0x80000000
+                // "out of range" answer.
+                inline void sse2_floats_to_shorts(const float* s,
+                    const float* const e, short* d, const float mult) {
+                    const __m128 m = _mm_set1_ps(mult);
+                    const __m128 hi = _mm_set1_ps(32767.0f);
+                    const __m128 lo = _mm_set1_ps(-32768.0f);
+                    while (e - s >= 8) {
+                        __m128 a = _mm_mul_ps(_mm_loadu_ps(s), m);
+                        __m128 b = _mm_mul_ps(_mm_loadu_ps(s + 4), m);
+                        a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+                        b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+                        const __m128i packed = _mm_packs_epi32(
+                            _mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+                        _mm_storeu_si128(
+                            reinterpret_cast<__m128i*>(d), packed);
+                        s += 8;
+                        d += 8;
+                    }
+                    scalar_floats_to_shorts(s, e, d, mult);
+                }
+#endif
+
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_shorts_to_floats(
+                    const short* s, const short* const e, float* d) {
+                    const __m256 scale
+                        = _mm256_set1_ps(1.0f / 32768.0f);
+                    while (e - s >= 16) {
+                        const __m128i x0 = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s));
+                        const __m128i x1 = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s + 8));
+                        const __m256 f0 = _mm256_cvtepi32_ps(
+                            _mm256_cvtepi16_epi32(x0));
+                        const __m256 f1 = _mm256_cvtepi32_ps(
+                            _mm256_cvtepi16_epi32(x1));
+                        _mm256_storeu_ps(d, _mm256_mul_ps(f0, scale));
+                        _mm256_storeu_ps(
+                            d + 8, _mm256_mul_ps(f1, scale));
+                        s += 16;
+                        d += 16;
+                    }
+                    scalar_shorts_to_floats(s, e, d);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_floats_to_shorts(const float* s,
+                    const float* const e, short* d, const float mult) {
+                    const __m256 m = _mm256_set1_ps(mult);
+                    const __m256 hi = _mm256_set1_ps(32767.0f);
+                    const __m256 lo = _mm256_set1_ps(-32768.0f);
+                    while (e - s >= 16) {
+                        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(s), m);
+                        __m256 b
+                            = _mm256_mul_ps(_mm256_loadu_ps(s + 8), m);
+                        a = _mm256_max_ps(_mm256_min_ps(a, hi), lo);
+                        b = _mm256_max_ps(_mm256_min_ps(b, hi), lo);
+                        // packs works per 128-bit lane: put the
+                        // quadwords back in order afterwards.
+                        __m256i packed = _mm256_packs_epi32(
+                            _mm256_cvttps_epi32(a),
+                            _mm256_cvttps_epi32(b));
+                        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(d), packed);
+                        s += 16;
+                        d += 16;
+                    }
+                    scalar_floats_to_shorts(s, e, d, mult);
+                }
+#endif
+            } // namespace detail
+
+            // Interleaving doesn't matter to any of these: they
+            // treat the buffer as one long run of samples.
+
+            // short -> float in [-1, 1): x / 32768.
+            inline void shorts_to_floats(
+                const short* begin, const short* end, float* dest) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    detail::avx2_shorts_to_floats(begin, end, dest);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    detail::sse2_shorts_to_floats(begin, end, dest);
+                    return;
+                }
+#endif
+                detail::scalar_shorts_to_floats(begin, end, dest);
+            }
+
+            // float -> short: scale by mult, then clip (saturate) to
+            // the range of a short, truncating toward zero.
+            inline void floats_to_shorts(const float* begin,
+                const float* end, short* dest,
+                const float mult = 32767.0f) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    detail::avx2_floats_to_shorts(
+                        begin, end, dest, mult);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    detail::sse2_floats_to_shorts(
+                        begin, end, dest, mult);
+                    return;
+                }
+#endif
+                detail::scalar_floats_to_shorts(begin, end, dest, mult);
+            }
+
+            namespace detail {
+                inline size_t scalar_constant_run(
+                    const short* b, const short* const e, const short v) {
+                    const short* p = b;
+                    while (p < e && *p == v) ++p;
+                    return (size_t)(p - b);
+                }
+
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                inline size_t sse2_constant_run(
+                    const short* b, const short* const e, const short v) {
+                    const __m128i vv = _mm_set1_epi16(v);
+                    const short* p = b;
+                    while (e - p >= 8) {
+                        const __m128i x = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(p));
+                        if (_mm_movemask_epi8(_mm_cmpeq_epi16(x, vv))
+                            != 0xFFFF) {
+                            break;
+                        }
+                        p += 8;
+                    }
+                    return (size_t)(p - b) + scalar_constant_run(p, e, v);
+                }
+#endif
+
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                CPP98AUDIO_TARGET_AVX2
+                inline size_t avx2_constant_run(
+                    const short* b, const short* const e, const short v) {
+                    const __m256i vv = _mm256_set1_epi16(v);
+                    const short* p = b;
+                    while (e - p >= 16) {
+                        const __m256i x = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(p));
+                        if ((unsigned int)_mm256_movemask_epi8(
+                                _mm256_cmpeq_epi16(x, vv))
+                            != 0xFFFFFFFFu) {
+                            break;
+                        }
+                        p += 16;
+                    }
+                    return (size_t)(p - b) + scalar_constant_run(p, e, v);
+                }
+#endif
+            } // namespace detail
+
+            // How many samples from 'begin' on are all equal to
+            // *begin. Digital silence, DC, clipped runs...
+            inline size_t constant_run(
+                const short* begin, const short* end) {
+                if (begin >= end) return 0;
+                const short v = *begin;
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    return detail::avx2_constant_run(begin, end, v);
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    return detail::sse2_constant_run(begin, end, v);
+                }
+#endif
+                return detail::scalar_constant_run(begin, end, v);
+            }
+
+            namespace detail {
+                inline int scalar_peak_abs(
+                    const short* s, const short* const e) {
+                    int hi = 0;
+                    int lo = 0;
+                    while (s < e) {
+                        const int v = *s++;
+                        hi = v > hi ? v : hi;
+                        lo = v < lo ? v : lo;
+                    }
+                    return hi > -lo ? hi : -lo;
+                }
+
+                inline float scalar_peak_abs(
+                    const float* s, const float* const e) {
+                    float pk = 0;
+                    while (s < e) {
+                        const float v = fabsf(*s++);
+                        pk = v > pk ? v : pk;
+                    }
+                    return pk;
+                }
+
+                // x * gain, clamped to [lo, hi], truncated: exactly
+                // what normalize_buffer() always did per sample.
+                inline void scalar_scale_shorts(
+                    short* s, short* const e, const float gain) {
+                    while (s < e) {
+                        float f = (float)*s * gain;
+                        if (f > 32767.0f) f = 32767.0f;
+                        if (f < -32768.0f) f = -32768.0f;
+                        *s++ = (short)f;
+                    }
+                }
+
+                inline void scalar_scale_floats(float* s, float* const e,
+                    const float gain, const float lo, const float hi) {
+                    while (s < e) {
+                        float f = *s * gain;
+                        if (f > hi) f = hi;
+                        if (f < lo) f = lo;
+                        *s++ = f;
+                    }
+                }
+
+                // d = clamp(s * g * scale, lo, hi), a gain per sample.
+                inline void scalar_apply_gains(const float* s,
+                    const float* const e, const float* g, const float scale,
+                    const float lo, const float hi, float* d) {
+                    while (s < e) {
+                        float f = (*s++ * *g++) * scale;
+                        if (f > hi) f = hi;
+                        if (f < lo) f = lo;
+                        *d++ = f;
+                    }
+                }
+
+                // The 8 partial sums every dot() keeps (lane i gets
+                // terms i, i + 8, ...), added up in one fixed order:
+                // so the SIMD versions, which keep them in registers,
+                // give the scalar bits exactly.
+                inline float sum_lanes(const float* l) {
+                    return ((l[0] + l[1]) + (l[2] + l[3]))
+                        + ((l[4] + l[5]) + (l[6] + l[7]));
+                }
+
+                inline void scalar_dot_lanes(const float* a,
+                    const float* b, size_t n, float* lanes) {
+                    for (size_t i = 0; i < n; ++i) {
+                        lanes[i & 7] += a[i] * b[i];
+                    }
+                }
+
+                inline float scalar_dot(
+                    const float* a, const float* b, size_t n) {
+                    float lanes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+                    scalar_dot_lanes(a, b, n, lanes);
+                    return sum_lanes(lanes);
+                }
+
+                // ...and truncated into a short (lo and hi within its
+                // range).
+                inline void scalar_apply_gains(const float* s,
+                    const float* const e, const float* g, const float scale,
+                    const float lo, const float hi, short* d) {
+                    while (s < e) {
+                        float f = (*s++ * *g++) * scale;
+                        if (f > hi) f = hi;
+                        if (f < lo) f = lo;
+                        *d++ = (short)f;
+                    }
+                }
+
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                // max and min kept apart: |-32768| doesn't fit.
+                inline int sse2_peak_abs(
+                    const short* s, const short* const e) {
+                    __m128i hi = _mm_setzero_si128();
+                    __m128i lo = _mm_setzero_si128();
+                    while (e - s >= 8) {
+                        const __m128i x = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s));
+                        hi = _mm_max_epi16(hi, x);
+                        lo = _mm_min_epi16(lo, x);
+                        s += 8;
+                    }
+                    short h[8];
+                    short l[8];
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(h), hi);
+                    _mm_storeu_si128(reinterpret_cast<__m128i*>(l), lo);
+                    int pk = scalar_peak_abs(s, e);
+                    for (int i = 0; i < 8; ++i) {
+                        pk = h[i] > pk ? h[i] : pk;
+                        pk = -l[i] > pk ? -l[i] : pk;
+                    }
+                    return pk;
+                }
+
+                inline float sse2_peak_abs(
+                    const float* s, const float* const e) {
+                    const __m128 sign = _mm_set1_ps(-0.0f);
+                    __m128 pk4 = _mm_setzero_ps();
+                    while (e - s >= 4) {
+                        pk4 = _mm_max_ps(
+                            pk4, _mm_andnot_ps(sign, _mm_loadu_ps(s)));
+                        s += 4;
+                    }
+                    float p[4];
+                    _mm_storeu_ps(p, pk4);
+                    float pk = scalar_peak_abs(s, e);
+                    for (int i = 0; i < 4; ++i) pk = p[i] > pk ? p[i] : pk;
+                    return pk;
+                }
+
+                inline void sse2_scale_shorts(
+                    short* s, short* const e, const float gain) {
+                    const __m128 g = _mm_set1_ps(gain);
+                    const __m128 hi = _mm_set1_ps(32767.0f);
+                    const __m128 lo = _mm_set1_ps(-32768.0f);
+                    while (e - s >= 8) {
+                        const __m128i x = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s));
+                        __m128 a = _mm_cvtepi32_ps(
+                            _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+                        __m128 b = _mm_cvtepi32_ps(
+                            _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+                        a = _mm_max_ps(_mm_min_ps(_mm_mul_ps(a, g), hi), lo);
+                        b = _mm_max_ps(_mm_min_ps(_mm_mul_ps(b, g), hi), lo);
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(s),
+                            _mm_packs_epi32(
+                                _mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+                        s += 8;
+                    }
+                    scalar_scale_shorts(s, e, gain);
+                }
+
+                inline void sse2_scale_floats(float* s, float* const e,
+                    const float gain, const float lo, const float hi) {
+                    const __m128 g = _mm_set1_ps(gain);
+                    const __m128 h = _mm_set1_ps(hi);
+                    const __m128 l = _mm_set1_ps(lo);
+                    while (e - s >= 4) {
+                        const __m128 x = _mm_mul_ps(_mm_loadu_ps(s), g);
+                        _mm_storeu_ps(s, _mm_max_ps(_mm_min_ps(x, h), l));
+                        s += 4;
+                    }
+                    scalar_scale_floats(s, e, gain, lo, hi);
+                }
+
+                inline void sse2_apply_gains(const float* s,
+                    const float* const e, const float* g, const float scale,
+                    const float lo, const float hi, float* d) {
+                    const __m128 k = _mm_set1_ps(scale);
+                    const __m128 h = _mm_set1_ps(hi);
+                    const __m128 l = _mm_set1_ps(lo);
+                    while (e - s >= 4) {
+                        const __m128 x = _mm_mul_ps(
+                            _mm_mul_ps(_mm_loadu_ps(s), _mm_loadu_ps(g)), k);
+                        _mm_storeu_ps(d, _mm_max_ps(_mm_min_ps(x, h), l));
+                        s += 4;
+                        g += 4;
+                        d += 4;
+                    }
+                    scalar_apply_gains(s, e, g, scale, lo, hi, d);
+                }
+
+                inline float sse2_dot(
+                    const float* a, const float* b, size_t n) {
+                    __m128 lo = _mm_setzero_ps();
+                    __m128 hi = _mm_setzero_ps();
+                    size_t i = 0;
+                    for (; i + 8 <= n; i += 8) {
+                        lo = _mm_add_ps(lo,
+                            _mm_mul_ps(
+                                _mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                        hi = _mm_add_ps(hi,
+                            _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+                                _mm_loadu_ps(b + i + 4)));
+                    }
+                    float lanes[8];
+                    _mm_storeu_ps(lanes, lo);
+                    _mm_storeu_ps(lanes + 4, hi);
+                    scalar_dot_lanes(a + i, b + i, n - i, lanes);
+                    return sum_lanes(lanes);
+                }
+
+                inline void sse2_apply_gains(const float* s,
+                    const float* const e, const float* g, const float scale,
+                    const float lo, const float hi, short* d) {
+                    const __m128 k = _mm_set1_ps(scale);
+                    const __m128 h = _mm_set1_ps(hi);
+                    const __m128 l = _mm_set1_ps(lo);
+                    while (e - s >= 8) {
+                        __m128 a = _mm_mul_ps(
+                            _mm_mul_ps(_mm_loadu_ps(s), _mm_loadu_ps(g)), k);
+                        __m128 b = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(s + 4),
+                                                  _mm_loadu_ps(g + 4)),
+                            k);
+                        a = _mm_max_ps(_mm_min_ps(a, h), l);
+                        b = _mm_max_ps(_mm_min_ps(b, h), l);
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(d),
+                            _mm_packs_epi32(
+                                _mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+                        s += 8;
+                        g += 8;
+                        d += 8;
+                    }
+                    scalar_apply_gains(s, e, g, scale, lo, hi, d);
+                }
+#endif
+
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                CPP98AUDIO_TARGET_AVX2
+                inline int avx2_peak_abs(
+                    const short* s, const short* const e) {
+                    __m256i hi = _mm256_setzero_si256();
+                    __m256i lo = _mm256_setzero_si256();
+                    while (e - s >= 16) {
+                        const __m256i x = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(s));
+                        hi = _mm256_max_epi16(hi, x);
+                        lo = _mm256_min_epi16(lo, x);
+                        s += 16;
+                    }
+                    short h[16];
+                    short l[16];
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(h), hi);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(l), lo);
+                    int pk = scalar_peak_abs(s, e);
+                    for (int i = 0; i < 16; ++i) {
+                        pk = h[i] > pk ? h[i] : pk;
+                        pk = -l[i] > pk ? -l[i] : pk;
+                    }
+                    return pk;
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline float avx2_peak_abs(
+                    const float* s, const float* const e) {
+                    const __m256 sign = _mm256_set1_ps(-0.0f);
+                    __m256 pk8 = _mm256_setzero_ps();
+                    while (e - s >= 8) {
+                        pk8 = _mm256_max_ps(pk8,
+                            _mm256_andnot_ps(sign, _mm256_loadu_ps(s)));
+                        s += 8;
+                    }
+                    float p[8];
+                    _mm256_storeu_ps(p, pk8);
+                    float pk = scalar_peak_abs(s, e);
+                    for (int i = 0; i < 8; ++i) pk = p[i] > pk ? p[i] : pk;
+                    return pk;
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_scale_shorts(
+                    short* s, short* const e, const float gain) {
+                    const __m256 g = _mm256_set1_ps(gain);
+                    const __m256 hi = _mm256_set1_ps(32767.0f);
+                    const __m256 lo = _mm256_set1_ps(-32768.0f);
+                    while (e - s >= 16) {
+                        const __m128i x0 = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s));
+                        const __m128i x1 = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s + 8));
+                        __m256 a = _mm256_cvtepi32_ps(
+                            _mm256_cvtepi16_epi32(x0));
+                        __m256 b = _mm256_cvtepi32_ps(
+                            _mm256_cvtepi16_epi32(x1));
+                        a = _mm256_max_ps(
+                            _mm256_min_ps(_mm256_mul_ps(a, g), hi), lo);
+                        b = _mm256_max_ps(
+                            _mm256_min_ps(_mm256_mul_ps(b, g), hi), lo);
+                        __m256i packed = _mm256_packs_epi32(
+                            _mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+                        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(s), packed);
+                        s += 16;
+                    }
+                    scalar_scale_shorts(s, e, gain);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_scale_floats(float* s, float* const e,
+                    const float gain, const float lo, const float hi) {
+                    const __m256 g = _mm256_set1_ps(gain);
+                    const __m256 h = _mm256_set1_ps(hi);
+                    const __m256 l = _mm256_set1_ps(lo);
+                    while (e - s >= 8) {
+                        const __m256 x
+                            = _mm256_mul_ps(_mm256_loadu_ps(s), g);
+                        _mm256_storeu_ps(
+                            s, _mm256_max_ps(_mm256_min_ps(x, h), l));
+                        s += 8;
+                    }
+                    scalar_scale_floats(s, e, gain, lo, hi);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_apply_gains(const float* s,
+                    const float* const e, const float* g, const float scale,
+                    const float lo, const float hi, float* d) {
+                    const __m256 k = _mm256_set1_ps(scale);
+                    const __m256 h = _mm256_set1_ps(hi);
+                    const __m256 l = _mm256_set1_ps(lo);
+                    while (e - s >= 8) {
+                        const __m256 x = _mm256_mul_ps(
+                            _mm256_mul_ps(
+                                _mm256_loadu_ps(s), _mm256_loadu_ps(g)),
+                            k);
+                        _mm256_storeu_ps(
+                            d, _mm256_max_ps(_mm256_min_ps(x, h), l));
+                        s += 8;
+                        g += 8;
+                        d += 8;
+                    }
+                    scalar_apply_gains(s, e, g, scale, lo, hi, d);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline float avx2_dot(
+                    const float* a, const float* b, size_t n) {
+                    __m256 acc = _mm256_setzero_ps();
+                    size_t i = 0;
+                    for (; i + 8 <= n; i += 8) {
+                        acc = _mm256_add_ps(acc,
+                            _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                _mm256_loadu_ps(b + i)));
+                    }
+                    float lanes[8];
+                    _mm256_storeu_ps(lanes, acc);
+                    scalar_dot_lanes(a + i, b + i, n - i, lanes);
+                    return sum_lanes(lanes);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_apply_gains(const float* s,
+                    const float* const e, const float* g, const float scale,
+                    const float lo, const float hi, short* d) {
+                    const __m256 k = _mm256_set1_ps(scale);
+                    const __m256 h = _mm256_set1_ps(hi);
+                    const __m256 l = _mm256_set1_ps(lo);
+                    while (e - s >= 16) {
+                        __m256 a = _mm256_mul_ps(
+                            _mm256_mul_ps(
+                                _mm256_loadu_ps(s), _mm256_loadu_ps(g)),
+                            k);
+                        __m256 b = _mm256_mul_ps(
+                            _mm256_mul_ps(_mm256_loadu_ps(s + 8),
+                                _mm256_loadu_ps(g + 8)),
+                            k);
+                        a = _mm256_max_ps(_mm256_min_ps(a, h), l);
+                        b = _mm256_max_ps(_mm256_min_ps(b, h), l);
+                        __m256i packed = _mm256_packs_epi32(
+                            _mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+                        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(d), packed);
+                        s += 16;
+                        g += 16;
+                        d += 16;
+                    }
+                    scalar_apply_gains(s, e, g, scale, lo, hi, d);
+                }
+#endif
+            } // namespace detail
+
+            // Largest |sample|: 0 .. 32768.
+            inline int peak_abs(const short* begin, const short* end) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    return detail::avx2_peak_abs(begin, end);
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    return detail::sse2_peak_abs(begin, end);
+                }
+#endif
+                return detail::scalar_peak_abs(begin, end);
+            }
+
+            inline float peak_abs(const float* begin, const float* end) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    return detail::avx2_peak_abs(begin, end);
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    return detail::sse2_peak_abs(begin, end);
+                }
+#endif
+                return detail::scalar_peak_abs(begin, end);
+            }
+
+            // In place: x * gain, saturated to a short.
+            inline void scale_shorts(short* begin, short* end, float gain) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    detail::avx2_scale_shorts(begin, end, gain);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    detail::sse2_scale_shorts(begin, end, gain);
+                    return;
+                }
+#endif
+                detail::scalar_scale_shorts(begin, end, gain);
+            }
+
+            // In place: x * gain, clamped to [lo, hi].
+            inline void scale_floats(float* begin, float* end,
+                float gain, float lo = -1.0f, float hi = 1.0f) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    detail::avx2_scale_floats(begin, end, gain, lo, hi);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    detail::sse2_scale_floats(begin, end, gain, lo, hi);
+                    return;
+                }
+#endif
+                detail::scalar_scale_floats(begin, end, gain, lo, hi);
+            }
+
+            // dest[i] = clamp(src[i] * gains[i] * scale, lo, hi): a
+            // gain for every sample. For a short dest, lo and hi must
+            // be within a short's range, and it's truncated.
+            template <typename D>
+            inline void apply_gains(const float* begin, const float* end,
+                const float* gains, float scale, float lo, float hi,
+                D* dest) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    detail::avx2_apply_gains(
+                        begin, end, gains, scale, lo, hi, dest);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    detail::sse2_apply_gains(
+                        begin, end, gains, scale, lo, hi, dest);
+                    return;
+                }
+#endif
+                detail::scalar_apply_gains(
+                    begin, end, gains, scale, lo, hi, dest);
+            }
+
+            // sum(a[i] * b[i]), i < n: the FIR inner loop. The same
+            // bits at every level (see detail::sum_lanes()).
+            inline float dot(const float* a, const float* b, size_t n) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    return detail::avx2_dot(a, b, n);
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    return detail::sse2_dot(a, b, n);
+                }
+#endif
+                return detail::scalar_dot(a, b, n);
+            }
+
+            namespace detail {
+                // planes: where each channel's run starts, 'plane'
+                // samples apart.
+                template <typename T>
+                inline void scalar_deinterleave(const T* s, size_t frames,
+                    int nch, T* d, size_t plane) {
+                    for (int ch = 0; ch < nch; ++ch) {
+                        const T* p = s + ch;
+                        T* q = d + (size_t)ch * plane;
+                        for (size_t i = 0; i < frames; ++i, p += nch) {
+                            q[i] = *p;
+                        }
+                    }
+                }
+
+                template <typename T>
+                inline void scalar_interleave(const T* s, size_t frames,
+                    int nch, T* d, size_t plane) {
+                    for (int ch = 0; ch < nch; ++ch) {
+                        const T* p = s + (size_t)ch * plane;
+                        T* q = d + ch;
+                        for (size_t i = 0; i < frames; ++i, q += nch) {
+                            *q = p[i];
+                        }
+                    }
+                }
+
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                // Stereo only, the one layout worth a shuffle: the
+                // rest go to the scalar loops.
+                inline void sse2_deinterleave2(
+                    const float* s, size_t frames, float* l, float* r) {
+                    size_t i = 0;
+                    for (; i + 4 <= frames; i += 4, s += 8) {
+                        const __m128 a = _mm_loadu_ps(s);
+                        const __m128 b = _mm_loadu_ps(s + 4);
+                        _mm_storeu_ps(l + i,
+                            _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+                        _mm_storeu_ps(r + i,
+                            _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+                    }
+                    for (; i < frames; ++i, s += 2) {
+                        l[i] = s[0];
+                        r[i] = s[1];
+                    }
+                }
+
+                inline void sse2_interleave2(const float* l,
+                    const float* r, size_t frames, float* d) {
+                    size_t i = 0;
+                    for (; i + 4 <= frames; i += 4, d += 8) {
+                        const __m128 a = _mm_loadu_ps(l + i);
+                        const __m128 b = _mm_loadu_ps(r + i);
+                        _mm_storeu_ps(d, _mm_unpacklo_ps(a, b));
+                        _mm_storeu_ps(d + 4, _mm_unpackhi_ps(a, b));
+                    }
+                    for (; i < frames; ++i, d += 2) {
+                        d[0] = l[i];
+                        d[1] = r[i];
+                    }
+                }
+
+                // Each frame is one 32-bit word, left in the low half:
+                // sign-extend either half, then pack (nothing
+                // saturates, it's all in range already).
+                inline void sse2_deinterleave2(
+                    const short* s, size_t frames, short* l, short* r) {
+                    size_t i = 0;
+                    for (; i + 8 <= frames; i += 8, s += 16) {
+                        const __m128i a = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s));
+                        const __m128i b = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(s + 8));
+                        const __m128i la
+                            = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+                        const __m128i lb
+                            = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(l + i),
+                            _mm_packs_epi32(la, lb));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(r + i),
+                            _mm_packs_epi32(_mm_srai_epi32(a, 16),
+                                _mm_srai_epi32(b, 16)));
+                    }
+                    for (; i < frames; ++i, s += 2) {
+                        l[i] = s[0];
+                        r[i] = s[1];
+                    }
+                }
+
+                inline void sse2_interleave2(const short* l,
+                    const short* r, size_t frames, short* d) {
+                    size_t i = 0;
+                    for (; i + 8 <= frames; i += 8, d += 16) {
+                        const __m128i a = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(l + i));
+                        const __m128i b = _mm_loadu_si128(
+                            reinterpret_cast<const __m128i*>(r + i));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(d),
+                            _mm_unpacklo_epi16(a, b));
+                        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + 8),
+                            _mm_unpackhi_epi16(a, b));
+                    }
+                    for (; i < frames; ++i, d += 2) {
+                        d[0] = l[i];
+                        d[1] = r[i];
+                    }
+                }
+#endif
+
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                // In-lane shuffles, then the 64- or 128-bit pieces put
+                // back in frame order.
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_deinterleave2(
+                    const float* s, size_t frames, float* l, float* r) {
+                    size_t i = 0;
+                    for (; i + 8 <= frames; i += 8, s += 16) {
+                        const __m256 a = _mm256_loadu_ps(s);
+                        const __m256 b = _mm256_loadu_ps(s + 8);
+                        const __m256 lo = _mm256_shuffle_ps(a, b, 0x88);
+                        const __m256 hi = _mm256_shuffle_ps(a, b, 0xDD);
+                        _mm256_storeu_ps(l + i,
+                            _mm256_castpd_ps(_mm256_permute4x64_pd(
+                                _mm256_castps_pd(lo), 0xD8)));
+                        _mm256_storeu_ps(r + i,
+                            _mm256_castpd_ps(_mm256_permute4x64_pd(
+                                _mm256_castps_pd(hi), 0xD8)));
+                    }
+                    sse2_deinterleave2(s, frames - i, l + i, r + i);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_interleave2(const float* l,
+                    const float* r, size_t frames, float* d) {
+                    size_t i = 0;
+                    for (; i + 8 <= frames; i += 8, d += 16) {
+                        const __m256 a = _mm256_loadu_ps(l + i);
+                        const __m256 b = _mm256_loadu_ps(r + i);
+                        const __m256 lo = _mm256_unpacklo_ps(a, b);
+                        const __m256 hi = _mm256_unpackhi_ps(a, b);
+                        _mm256_storeu_ps(
+                            d, _mm256_permute2f128_ps(lo, hi, 0x20));
+                        _mm256_storeu_ps(
+                            d + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+                    }
+                    sse2_interleave2(l + i, r + i, frames - i, d);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_deinterleave2(
+                    const short* s, size_t frames, short* l, short* r) {
+                    size_t i = 0;
+                    for (; i + 16 <= frames; i += 16, s += 32) {
+                        const __m256i a = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(s));
+                        const __m256i b = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(s + 16));
+                        const __m256i la = _mm256_srai_epi32(
+                            _mm256_slli_epi32(a, 16), 16);
+                        const __m256i lb = _mm256_srai_epi32(
+                            _mm256_slli_epi32(b, 16), 16);
+                        const __m256i left = _mm256_permute4x64_epi64(
+                            _mm256_packs_epi32(la, lb), 0xD8);
+                        const __m256i right = _mm256_permute4x64_epi64(
+                            _mm256_packs_epi32(_mm256_srai_epi32(a, 16),
+                                _mm256_srai_epi32(b, 16)),
+                            0xD8);
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(l + i), left);
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(r + i), right);
+                    }
+                    sse2_deinterleave2(s, frames - i, l + i, r + i);
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline void avx2_interleave2(const short* l,
+                    const short* r, size_t frames, short* d) {
+                    size_t i = 0;
+                    for (; i + 16 <= frames; i += 16, d += 32) {
+                        const __m256i a = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(l + i));
+                        const __m256i b = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i*>(r + i));
+                        const __m256i lo = _mm256_unpacklo_epi16(a, b);
+                        const __m256i hi = _mm256_unpackhi_epi16(a, b);
+                        _mm256_storeu_si256(reinterpret_cast<__m256i*>(d),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+                        _mm256_storeu_si256(
+                            reinterpret_cast<__m256i*>(d + 16),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+                    }
+                    sse2_interleave2(l + i, r + i, frames - i, d);
+                }
+#endif
+            } // namespace detail
+
+            // Interleaved (frame by frame) -> planar (channel by
+            // channel): channel ch goes to dest + ch * plane, plane
+            // being at least frames. Shorts or floats.
+            template <typename T>
+            inline void deinterleave(const T* src, size_t frames, int nch,
+                T* dest, size_t plane) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (nch == 2 && simd_level() >= SIMD_AVX2) {
+                    detail::avx2_deinterleave2(
+                        src, frames, dest, dest + plane);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (nch == 2 && simd_level() >= SIMD_SSE2) {
+                    detail::sse2_deinterleave2(
+                        src, frames, dest, dest + plane);
+                    return;
+                }
+#endif
+                detail::scalar_deinterleave(src, frames, nch, dest, plane);
+            }
+
+            // ...and back.
+            template <typename T>
+            inline void interleave(const T* src, size_t frames, int nch,
+                T* dest, size_t plane) {
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (nch == 2 && simd_level() >= SIMD_AVX2) {
+                    detail::avx2_interleave2(
+                        src, src + plane, frames, dest);
+                    return;
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (nch == 2 && simd_level() >= SIMD_SSE2) {
+                    detail::sse2_interleave2(
+                        src, src + plane, frames, dest);
+                    return;
+                }
+#endif
+                detail::scalar_interleave(src, frames, nch, dest, plane);
+            }
+
+            namespace detail {
+                /*/
+                 * Two biquads in series on every channel (direct form
+                 * II transposed, a0 = 1), adding each output squared
+                 * to sumsq[ch]: the K-weighting filter and the energy
+                 * sum of a loudness meter, in one pass.
+                 *
+                 * c is the two sections' b0 b1 b2 a1 a2, in that order;
+                 * z their state, four values a channel, stored
+                 * z[k * nch + ch] so that neighbouring channels'
+                 * state sits together. The recursion can't be spread
+                 * over time, so the SIMD versions spread it over
+                 * channels: 2 (SSE2) or 4 (AVX2) neighbouring channels
+                 * a register, their samples one load a frame. Every
+                 * lane does what the scalar loop does, in the same
+                 * order, so the sums come out the same to the bit
+                 * (unless the compiler fuses multiply-adds).
+                /*/
+                template <typename T>
+                inline void scalar_biquad2_sumsq(const T* s, size_t frames,
+                    int nch, int ch, const double* c, double* z,
+                    double* sumsq) {
+                    for (; ch < nch; ++ch) {
+                        double z0 = z[ch], z1 = z[nch + ch];
+                        double z2 = z[2 * nch + ch], z3 = z[3 * nch + ch];
+                        double acc = sumsq[ch];
+                        const T* p = s + ch;
+                        for (size_t i = 0; i < frames; ++i, p += nch) {
+                            const double x = (double)*p;
+                            const double y = c[0] * x + z0;
+                            z0 = c[1] * x - c[3] * y + z1;
+                            z1 = c[2] * x - c[4] * y;
+                            const double w = c[5] * y + z2;
+                            z2 = c[6] * y - c[8] * w + z3;
+                            z3 = c[7] * y - c[9] * w;
+                            acc += w * w;
+                        }
+                        z[ch] = z0;
+                        z[nch + ch] = z1;
+                        z[2 * nch + ch] = z2;
+                        z[3 * nch + ch] = z3;
+                        sumsq[ch] = acc;
+                    }
+                }
+
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                // Two neighbouring samples, as doubles. (memcpy: a
+                // 64-bit load could read past the end of the buffer.)
+                inline __m128d sse2_load2d(const short* p) {
+                    int v;
+                    memcpy(&v, p, sizeof(v));
+                    const __m128i x = _mm_cvtsi32_si128(v);
+                    return _mm_cvtepi32_pd(
+                        _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+                }
+
+                inline __m128d sse2_load2d(const float* p) {
+                    return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(
+                        reinterpret_cast<const __m128i*>(p))));
+                }
+
+                // Channels ch and ch + 1.
+                template <typename T>
+                inline void sse2_biquad2_sumsq(const T* s, size_t frames,
+                    int nch, int ch, const double* c, double* z,
+                    double* sumsq) {
+                    const __m128d b0 = _mm_set1_pd(c[0]);
+                    const __m128d b1 = _mm_set1_pd(c[1]);
+                    const __m128d b2 = _mm_set1_pd(c[2]);
+                    const __m128d a1 = _mm_set1_pd(c[3]);
+                    const __m128d a2 = _mm_set1_pd(c[4]);
+                    const __m128d d0 = _mm_set1_pd(c[5]);
+                    const __m128d d1 = _mm_set1_pd(c[6]);
+                    const __m128d d2 = _mm_set1_pd(c[7]);
+                    const __m128d e1 = _mm_set1_pd(c[8]);
+                    const __m128d e2 = _mm_set1_pd(c[9]);
+                    __m128d z0 = _mm_loadu_pd(z + ch);
+                    __m128d z1 = _mm_loadu_pd(z + nch + ch);
+                    __m128d z2 = _mm_loadu_pd(z + 2 * nch + ch);
+                    __m128d z3 = _mm_loadu_pd(z + 3 * nch + ch);
+                    __m128d acc = _mm_loadu_pd(sumsq + ch);
+                    const T* p = s + ch;
+                    for (size_t i = 0; i < frames; ++i, p += nch) {
+                        const __m128d x = sse2_load2d(p);
+                        const __m128d y = _mm_add_pd(_mm_mul_pd(b0, x), z0);
+                        z0 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x),
+                                            _mm_mul_pd(a1, y)),
+                            z1);
+                        z1 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+                        const __m128d w = _mm_add_pd(_mm_mul_pd(d0, y), z2);
+                        z2 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(d1, y),
+                                            _mm_mul_pd(e1, w)),
+                            z3);
+                        z3 = _mm_sub_pd(_mm_mul_pd(d2, y), _mm_mul_pd(e2, w));
+                        acc = _mm_add_pd(acc, _mm_mul_pd(w, w));
+                    }
+                    _mm_storeu_pd(z + ch, z0);
+                    _mm_storeu_pd(z + nch + ch, z1);
+                    _mm_storeu_pd(z + 2 * nch + ch, z2);
+                    _mm_storeu_pd(z + 3 * nch + ch, z3);
+                    _mm_storeu_pd(sumsq + ch, acc);
+                }
+#endif
+
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                CPP98AUDIO_TARGET_AVX2
+                inline __m256d avx2_load4d(const short* p) {
+                    const __m128i x = _mm_loadl_epi64(
+                        reinterpret_cast<const __m128i*>(p));
+                    return _mm256_cvtepi32_pd(
+                        _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+                }
+
+                CPP98AUDIO_TARGET_AVX2
+                inline __m256d avx2_load4d(const float* p) {
+                    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+                }
+
+                // Channels ch .. ch + 3.
+                template <typename T>
+                CPP98AUDIO_TARGET_AVX2 inline void avx2_biquad2_sumsq(
+                    const T* s, size_t frames, int nch, int ch,
+                    const double* c, double* z, double* sumsq) {
+                    const __m256d b0 = _mm256_set1_pd(c[0]);
+                    const __m256d b1 = _mm256_set1_pd(c[1]);
+                    const __m256d b2 = _mm256_set1_pd(c[2]);
+                    const __m256d a1 = _mm256_set1_pd(c[3]);
+                    const __m256d a2 = _mm256_set1_pd(c[4]);
+                    const __m256d d0 = _mm256_set1_pd(c[5]);
+                    const __m256d d1 = _mm256_set1_pd(c[6]);
+                    const __m256d d2 = _mm256_set1_pd(c[7]);
+                    const __m256d e1 = _mm256_set1_pd(c[8]);
+                    const __m256d e2 = _mm256_set1_pd(c[9]);
+                    __m256d z0 = _mm256_loadu_pd(z + ch);
+                    __m256d z1 = _mm256_loadu_pd(z + nch + ch);
+                    __m256d z2 = _mm256_loadu_pd(z + 2 * nch + ch);
+                    __m256d z3 = _mm256_loadu_pd(z + 3 * nch + ch);
+                    __m256d acc = _mm256_loadu_pd(sumsq + ch);
+                    const T* p = s + ch;
+                    for (size_t i = 0; i < frames; ++i, p += nch) {
+                        const __m256d x = avx2_load4d(p);
+                        const __m256d y
+                            = _mm256_add_pd(_mm256_mul_pd(b0, x), z0);
+                        z0 = _mm256_add_pd(
+                            _mm256_sub_pd(_mm256_mul_pd(b1, x),
+                                _mm256_mul_pd(a1, y)),
+                            z1);
+                        z1 = _mm256_sub_pd(
+                            _mm256_mul_pd(b2, x), _mm256_mul_pd(a2, y));
+                        const __m256d w
+                            = _mm256_add_pd(_mm256_mul_pd(d0, y), z2);
+                        z2 = _mm256_add_pd(
+                            _mm256_sub_pd(_mm256_mul_pd(d1, y),
+                                _mm256_mul_pd(e1, w)),
+                            z3);
+                        z3 = _mm256_sub_pd(
+                            _mm256_mul_pd(d2, y), _mm256_mul_pd(e2, w));
+                        acc = _mm256_add_pd(acc, _mm256_mul_pd(w, w));
+                    }
+                    _mm256_storeu_pd(z + ch, z0);
+                    _mm256_storeu_pd(z + nch + ch, z1);
+                    _mm256_storeu_pd(z + 2 * nch + ch, z2);
+                    _mm256_storeu_pd(z + 3 * nch + ch, z3);
+                    _mm256_storeu_pd(sumsq + ch, acc);
+                }
+#endif
+            } // namespace detail
+
+            // detail::scalar_biquad2_sumsq() over interleaved shorts
+            // or floats: channels four, then two, at a time as the
+            // SIMD level allows, the odd ones out scalar.
+            template <typename T>
+            inline void biquad2_sumsq(const T* s, size_t frames, int nch,
+                const double* c, double* z, double* sumsq) {
+                int ch = 0;
+#if defined(CPP98AUDIO_HAVE_AVX2)
+                if (simd_level() >= SIMD_AVX2) {
+                    for (; ch + 4 <= nch; ch += 4) {
+                        detail::avx2_biquad2_sumsq(
+                            s, frames, nch, ch, c, z, sumsq);
+                    }
+                }
+#endif
+#if defined(CPP98AUDIO_HAVE_SSE2)
+                if (simd_level() >= SIMD_SSE2) {
+                    for (; ch + 2 <= nch; ch += 2) {
+                        detail::sse2_biquad2_sumsq(
+                            s, frames, nch, ch, c, z, sumsq);
+                    }
+                }
+#endif
+                detail::scalar_biquad2_sumsq(s, frames, nch, ch, c, z, sumsq);
+            }
+
+            // clip_short() over a whole buffer: no scaling.
+            inline void clip_shorts(
+                const float* begin, const float* end, short* dest) {
+                floats_to_shorts(begin, end, dest, 1.0f);
+            }
+
+        } // namespace simd
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_SIMD_HPP
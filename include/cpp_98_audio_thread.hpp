@@ -0,0 +1,276 @@
+/*/
+ * Just enough threading for c++98: start a thread, join it, spread
+ * a batch of tasks over a few of them, a mutex and a condition to wait
+ * on, and acquire / release loads and stores for the odd lock-free
+ * index. pthreads everywhere but
+ * Windows, where it's the Win32 API. (Link with -pthread, or -lpthread,
+ * on unix.)
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_THREAD_HPP
+#define CPP_98_AUDIO_THREAD_HPP
+
+#include <cstddef>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+        namespace threads {
+
+            // How many threads the machine can actually run at once.
+            inline int hardware_threads() {
+#if defined(_WIN32)
+                SYSTEM_INFO si;
+                GetSystemInfo(&si);
+                const int n = (int)si.dwNumberOfProcessors;
+#else
+                const int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+                return n > 0 ? n : 1;
+            }
+
+            // Lets another thread run, if one's waiting.
+            inline void yield() {
+#if defined(_WIN32)
+                Sleep(0);
+#else
+                sched_yield();
+#endif
+            }
+
+            // A load that nothing after it can be moved before, and a
+            // store that nothing before it can be moved after: enough
+            // to hand data from one thread to one other through an
+            // index. c++98 has no atomics, so it's the compiler's.
+            inline size_t load_acquire(const volatile size_t* p) {
+#if defined(_MSC_VER)
+                const size_t v = *p;
+                MemoryBarrier();
+                return v;
+#elif defined(__ATOMIC_ACQUIRE)
+                return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+                const size_t v = *p;
+                __sync_synchronize();
+                return v;
+#endif
+            }
+
+            inline void store_release(volatile size_t* p, size_t v) {
+#if defined(_MSC_VER)
+                MemoryBarrier();
+                *p = v;
+#elif defined(__ATOMIC_RELEASE)
+                __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#else
+                __sync_synchronize();
+                *p = v;
+#endif
+            }
+
+            class thread {
+                public:
+                typedef void (*func_t)(void*);
+
+                thread() : m_func(0), m_arg(0), m_started(false) {}
+                ~thread() { join(); }
+
+                // false if the OS wouldn't give us a thread: the
+                // caller should then just call f(arg) itself.
+                inline bool start(func_t f, void* arg) {
+                    join();
+                    m_func = f;
+                    m_arg = arg;
+#if defined(_WIN32)
+                    m_handle = CreateThread(
+                        NULL, 0, &thread::entry, this, 0, NULL);
+                    m_started = (m_handle != NULL);
+#else
+                    m_started = (pthread_create(
+                                     &m_handle, NULL, &thread::entry, this)
+                        == 0);
+#endif
+                    return m_started;
+                }
+
+                inline void join() {
+                    if (!m_started) return;
+#if defined(_WIN32)
+                    WaitForSingleObject(m_handle, INFINITE);
+                    CloseHandle(m_handle);
+#else
+                    pthread_join(m_handle, NULL);
+#endif
+                    m_started = false;
+                }
+
+                inline bool joinable() const { return m_started; }
+
+                private:
+                thread(const thread&);
+                thread& operator=(const thread&);
+
+#if defined(_WIN32)
+                static DWORD WINAPI entry(LPVOID p) {
+                    thread* self = static_cast<thread*>(p);
+                    self->m_func(self->m_arg);
+                    return 0;
+                }
+                HANDLE m_handle;
+#else
+                static void* entry(void* p) {
+                    thread* self = static_cast<thread*>(p);
+                    self->m_func(self->m_arg);
+                    return NULL;
+                }
+                pthread_t m_handle;
+#endif
+                func_t m_func;
+                void* m_arg;
+                bool m_started;
+            };
+
+            // A plain (non-recursive) mutex, and a scoped lock for it.
+            class mutex {
+                public:
+#if defined(_WIN32)
+                mutex() { InitializeCriticalSection(&m_cs); }
+                ~mutex() { DeleteCriticalSection(&m_cs); }
+                inline void lock() { EnterCriticalSection(&m_cs); }
+                inline void unlock() { LeaveCriticalSection(&m_cs); }
+#else
+                mutex() { pthread_mutex_init(&m_mutex, NULL); }
+                ~mutex() { pthread_mutex_destroy(&m_mutex); }
+                inline void lock() { pthread_mutex_lock(&m_mutex); }
+                inline void unlock() { pthread_mutex_unlock(&m_mutex); }
+#endif
+                private:
+                friend class condition;
+                mutex(const mutex&);
+                mutex& operator=(const mutex&);
+#if defined(_WIN32)
+                CRITICAL_SECTION m_cs;
+#else
+                pthread_mutex_t m_mutex;
+#endif
+            };
+
+            class scoped_lock {
+                public:
+                explicit scoped_lock(mutex& m) : m_mutex(m) { m_mutex.lock(); }
+                ~scoped_lock() { m_mutex.unlock(); }
+
+                private:
+                scoped_lock(const scoped_lock&);
+                scoped_lock& operator=(const scoped_lock&);
+                mutex& m_mutex;
+            };
+
+            // Something to wait for, with a mutex held: wait() lets the
+            // mutex go while it sleeps, and has it again when it wakes.
+            // Wakeups can be spurious, so always wait in a loop on the
+            // thing itself. (Windows: Vista on.)
+            class condition {
+                public:
+#if defined(_WIN32)
+                condition() { InitializeConditionVariable(&m_cv); }
+                ~condition() {}
+                inline void wait(mutex& m) {
+                    SleepConditionVariableCS(&m_cv, &m.m_cs, INFINITE);
+                }
+                inline void notify_one() { WakeConditionVariable(&m_cv); }
+                inline void notify_all() {
+                    WakeAllConditionVariable(&m_cv);
+                }
+#else
+                condition() { pthread_cond_init(&m_cv, NULL); }
+                ~condition() { pthread_cond_destroy(&m_cv); }
+                inline void wait(mutex& m) {
+                    pthread_cond_wait(&m_cv, &m.m_mutex);
+                }
+                inline void notify_one() { pthread_cond_signal(&m_cv); }
+                inline void notify_all() { pthread_cond_broadcast(&m_cv); }
+#endif
+                private:
+                condition(const condition&);
+                condition& operator=(const condition&);
+#if defined(_WIN32)
+                CONDITION_VARIABLE m_cv;
+#else
+                pthread_cond_t m_cv;
+#endif
+            };
+
+            namespace detail {
+                template <typename T> struct strided_tasks {
+                    T* tasks;
+                    size_t ntasks;
+                    size_t first;
+                    size_t stride;
+
+                    static void run(void* p) {
+                        strided_tasks* self = static_cast<strided_tasks*>(p);
+                        for (size_t i = self->first; i < self->ntasks;
+                             i += self->stride) {
+                            self->tasks[i].run();
+                        }
+                    }
+                };
+            } // namespace detail
+
+            // Calls tasks[i].run() for every i, spread over up to
+            // nthreads threads (this one included: 0 means one per
+            // core), and returns when they've all finished. Tasks
+            // go round-robin, so give it more tasks than threads if
+            // they take wildly different times.
+            template <typename T>
+            inline void run_all(T* tasks, size_t ntasks, int nthreads = 0) {
+                if (ntasks == 0) return;
+                if (nthreads <= 0) nthreads = hardware_threads();
+                size_t nt = (size_t)nthreads;
+                if (nt > ntasks) nt = ntasks;
+
+                detail::strided_tasks<T>* parts
+                    = new detail::strided_tasks<T>[nt];
+                thread* workers = new thread[nt];
+                for (size_t t = 0; t < nt; ++t) {
+                    parts[t].tasks = tasks;
+                    parts[t].ntasks = ntasks;
+                    parts[t].first = t;
+                    parts[t].stride = nt;
+                }
+                for (size_t t = 1; t < nt; ++t) {
+                    if (!workers[t].start(
+                            &detail::strided_tasks<T>::run, &parts[t])) {
+                        detail::strided_tasks<T>::run(&parts[t]);
+                    }
+                }
+                detail::strided_tasks<T>::run(&parts[0]);
+                for (size_t t = 1; t < nt; ++t) {
+                    workers[t].join();
+                }
+                delete[] workers;
+                delete[] parts;
+            }
+
+        } // namespace threads
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_THREAD_HPP
@@ -0,0 +1,583 @@
+/*/
+ * WAV and RF64 files, memory-mapped: no reading into (or writing from)
+ * a heap buffer.
+ *
+ * The PCM data chunk is handed out as a my::iterator::ptrs<> range over
+ * the mapped pages themselves, so envelope_shorts(), normalize_buffer(),
+ * reverse_samples() and friends work straight on the file. Writes go
+ * through the mapping too: the OS writes the dirty pages back (or
+ * flush() makes it do so now). A READ_ONLY file only hands out
+ * ptrs<const T>, through a const wav_file&:
+ *
+    my::cpp98::audio::wav_file wav;
+    if (wav.open("in.wav", wav_file::READ_WRITE)) {
+        my::iterator::ptrs<short> s = wav.shorts();
+        my::cpp98::audio::normalize_buffer(
+            (short*)s.begin(), (short*)s.end(), wav.channels());
+    }
+    my::cpp98::audio::wav_file in;
+    if (in.open("in.wav")) {
+        const my::cpp98::audio::wav_file& c = in;
+        my::iterator::ptrs<const short> s = c.shorts();
+    }
+ *
+ * 16-bit, 32-bit int and 32-bit float data map straight onto short, int
+ * and float. Packed 24-bit data has no C++ type to map onto, so
+ * samples<T>() gives an empty range for it (data() still works).
+ *
+ * RF64 (the EBU's 64-bit WAV, for files over 4GB) is read, and
+ * written when the data won't fit a plain WAV, or if asked to.
+ * Little-endian hosts only: that's what WAV is.
+/*/
+#pragma once
+
+#ifndef CPP_98_AUDIO_WAV_HPP
+#define CPP_98_AUDIO_WAV_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "cpp_98_audio_envelope.hpp"
+#include "my_iterator.h"
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace my {
+namespace cpp98 {
+    namespace audio {
+
+        namespace detail {
+            inline unsigned int get_u16(const unsigned char* p) {
+                return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+            }
+            inline unsigned int get_u32(const unsigned char* p) {
+                return get_u16(p) | (get_u16(p + 2) << 16);
+            }
+            inline u64_t get_u64(const unsigned char* p) {
+                return (u64_t)get_u32(p) | ((u64_t)get_u32(p + 4) << 32);
+            }
+            inline void put_u16(unsigned char* p, unsigned int v) {
+                p[0] = (unsigned char)(v & 0xff);
+                p[1] = (unsigned char)((v >> 8) & 0xff);
+            }
+            inline void put_u32(unsigned char* p, unsigned int v) {
+                put_u16(p, v & 0xffff);
+                put_u16(p + 2, (v >> 16) & 0xffff);
+            }
+            inline void put_u64(unsigned char* p, u64_t v) {
+                put_u32(p, (unsigned int)(v & 0xffffffffu));
+                put_u32(p + 4, (unsigned int)(v >> 32));
+            }
+        } // namespace detail
+
+        class wav_file {
+            public:
+            enum open_mode_t { READ_ONLY, READ_WRITE };
+            enum format_t { FORMAT_PCM = 1, FORMAT_FLOAT = 3 };
+
+            wav_file() { reset(); }
+            ~wav_file() { close(); }
+
+            // Maps an existing WAV or RF64 file. false (see error())
+            // if it can't be opened or isn't one we understand.
+            inline bool open(const char* path, open_mode_t mode = READ_ONLY) {
+                close();
+                if (!map_file(path, mode == READ_WRITE, false, 0)) {
+                    return false;
+                }
+                if (!parse()) {
+                    const char* why = m_error;
+                    close();
+                    m_error = why;
+                    return false;
+                }
+                advise_sequential();
+                return true;
+            }
+
+            // Creates (or truncates) path as a WAV of nframes silent
+            // frames, mapped read-write, ready to be filled in.
+            // bits: 16 or 32 with FORMAT_PCM, 32 with FORMAT_FLOAT.
+            // RF64 is used if the data won't fit a WAV, or force_rf64.
+            inline bool create(const char* path, int samplerate, int nch,
+                int bits, u64_t nframes, format_t format = FORMAT_PCM,
+                bool force_rf64 = false) {
+                close();
+                if (nch <= 0 || samplerate <= 0
+                    || (bits != 16 && bits != 24 && bits != 32)
+                    || (format == FORMAT_FLOAT && bits != 32)) {
+                    m_error = "unsupported format";
+                    return false;
+                }
+                const u64_t block_align = (u64_t)nch * (u64_t)(bits / 8);
+                const u64_t data_bytes = nframes * block_align;
+                const bool rf64
+                    = force_rf64 || data_bytes + HEADER_BYTES > 0xffffffffu;
+                // The header is the same size either way: a plain WAV
+                // gets a JUNK chunk where RF64's ds64 goes, so it can
+                // be turned into RF64 in place if it ever has to be.
+                const u64_t total = HEADER_BYTES + data_bytes
+                    + (data_bytes & 1);
+                if (!map_file(path, true, true, total)) return false;
+
+                unsigned char* h = m_base;
+                memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+                detail::put_u32(
+                    h + 4, rf64 ? 0xffffffffu : (unsigned int)(total - 8));
+                memcpy(h + 8, "WAVE", 4);
+                memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+                detail::put_u32(h + 16, 28);
+                if (rf64) {
+                    detail::put_u64(h + 20, total - 8);
+                    detail::put_u64(h + 28, data_bytes);
+                    detail::put_u64(h + 36, nframes);
+                    detail::put_u32(h + 44, 0);
+                } else {
+                    memset(h + 20, 0, 28);
+                }
+                memcpy(h + 48, "fmt ", 4);
+                detail::put_u32(h + 52, 16);
+                detail::put_u16(h + 56, (unsigned int)format);
+                detail::put_u16(h + 58, (unsigned int)nch);
+                detail::put_u32(h + 60, (unsigned int)samplerate);
+                detail::put_u32(
+                    h + 64, (unsigned int)(samplerate * block_align));
+                detail::put_u16(h + 68, (unsigned int)block_align);
+                detail::put_u16(h + 70, (unsigned int)bits);
+                memcpy(h + 72, "data", 4);
+                detail::put_u32(h + 76,
+                    rf64 ? 0xffffffffu : (unsigned int)data_bytes);
+
+                if (!parse()) {
+                    close();
+                    return false;
+                }
+                advise_sequential();
+                return true;
+            }
+
+            // Unmaps (the OS then writes back anything dirty) and
+            // closes. Safe to call twice.
+            inline void close() {
+#if defined(_WIN32)
+                if (m_base) UnmapViewOfFile(m_base);
+                if (m_mapping) CloseHandle(m_mapping);
+                if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+                if (m_base) munmap(m_base, (size_t)m_size);
+                if (m_fd >= 0) ::close(m_fd);
+#endif
+                reset();
+            }
+
+            // Makes the OS write dirty pages back now, and waits.
+            inline bool flush() {
+                if (!m_base || !m_writable) return false;
+#if defined(_WIN32)
+                return FlushViewOfFile(m_base, 0) != 0
+                    && FlushFileBuffers(m_file) != 0;
+#else
+                return msync(m_base, (size_t)m_size, MS_SYNC) == 0;
+#endif
+            }
+
+            // Tell the OS we'll be going through the data front to
+            // back: it reads ahead harder and drops pages behind us.
+            // open() and create() do this for you.
+            inline void advise_sequential() {
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+                if (m_base) {
+                    madvise(m_base, (size_t)m_size, MADV_SEQUENTIAL);
+                }
+#endif
+            }
+
+            inline bool is_open() const { return m_base != 0; }
+            inline bool is_rf64() const { return m_rf64; }
+            inline bool writable() const { return m_writable; }
+            inline const char* error() const { return m_error; }
+
+            inline int channels() const { return m_nch; }
+            inline int samplerate() const { return m_samplerate; }
+            inline int bits_per_sample() const { return m_bits; }
+            inline int format() const { return m_format; }
+            inline u64_t frames() const {
+                return m_block_align ? m_data_bytes / m_block_align : 0;
+            }
+            inline u64_t samples() const {
+                return frames() * (u64_t)m_nch;
+            }
+
+            // The raw data chunk.
+            inline unsigned char* data() { return m_data; }
+            inline const unsigned char* data() const { return m_data; }
+            inline u64_t data_bytes() const { return m_data_bytes; }
+            // Where the data chunk starts in the file, and the bytes
+            // per frame: for reading it some other way (block_reader).
+            inline u64_t data_offset() const {
+                return m_data ? (u64_t)(m_data - m_base) : 0;
+            }
+            inline u64_t block_align() const { return m_block_align; }
+
+            // The data as samples of type T, in place. An empty
+            // range if T isn't what's in the file (or the data isn't
+            // aligned for T, which no sane writer does).
+            //
+            // Only a file opened READ_WRITE (or made by create()) hands
+            // out writable ranges: a READ_ONLY mapping is PROT_READ, so
+            // a write through one would fault. Read through a const
+            // wav_file& instead, which gives ptrs<const T>.
+            template <typename T> my::iterator::ptrs<T> samples_as() {
+                assert((!m_base || m_writable)
+                       && "read-only file: use the const accessors");
+                T* p = m_writable ? const_cast<T*>(first((T*)0)) : NULL;
+                return my::iterator::ptrs<T>(p, p ? p + count((T*)0) : p);
+            }
+            template <typename T>
+            my::iterator::ptrs<const T> samples_as() const {
+                const T* p = first((T*)0);
+                return my::iterator::ptrs<const T>(
+                    p, p ? p + count((T*)0) : p);
+            }
+
+            inline my::iterator::ptrs<short> shorts() {
+                return samples_as<short>();
+            }
+            inline my::iterator::ptrs<int> ints() {
+                return samples_as<int>();
+            }
+            inline my::iterator::ptrs<float> floats() {
+                return samples_as<float>();
+            }
+            inline my::iterator::ptrs<const short> shorts() const {
+                return samples_as<short>();
+            }
+            inline my::iterator::ptrs<const int> ints() const {
+                return samples_as<int>();
+            }
+            inline my::iterator::ptrs<const float> floats() const {
+                return samples_as<float>();
+            }
+
+            private:
+            enum { HEADER_BYTES = 80 };
+
+            wav_file(const wav_file&);
+            wav_file& operator=(const wav_file&);
+
+            // The first sample of type T, or NULL if there's no data
+            // of that type (see samples_as<T>()).
+            template <typename T> const T* first(T*) const {
+                if (holds((T*)0) && m_data
+                    && ((size_t)m_data % sizeof(T)) == 0)
+                    return reinterpret_cast<const T*>(m_data);
+                return NULL;
+            }
+            template <typename T> size_t count(T*) const {
+                return (size_t)(m_data_bytes / sizeof(T));
+            }
+            inline bool holds(short*) const {
+                return m_format == FORMAT_PCM && m_bits == 16;
+            }
+            inline bool holds(int*) const {
+                return m_format == FORMAT_PCM && m_bits == 32;
+            }
+            inline bool holds(float*) const {
+                return m_format == FORMAT_FLOAT && m_bits == 32;
+            }
+
+            inline void reset() {
+#if defined(_WIN32)
+                m_file = INVALID_HANDLE_VALUE;
+                m_mapping = NULL;
+#else
+                m_fd = -1;
+#endif
+                m_base = NULL;
+                m_size = 0;
+                m_writable = false;
+                m_rf64 = false;
+                m_error = "";
+                m_nch = m_samplerate = m_bits = m_format = 0;
+                m_block_align = 0;
+                m_data = NULL;
+                m_data_bytes = 0;
+            }
+
+            inline bool map_file(
+                const char* path, bool writable, bool create, u64_t size) {
+                m_writable = writable;
+#if defined(_WIN32)
+                m_file = CreateFileA(path,
+                    GENERIC_READ | (writable ? GENERIC_WRITE : 0),
+                    FILE_SHARE_READ, NULL,
+                    create ? CREATE_ALWAYS : OPEN_EXISTING,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                if (m_file == INVALID_HANDLE_VALUE) {
+                    m_error = "can't open file";
+                    return false;
+                }
+                if (!create) {
+                    LARGE_INTEGER li;
+                    if (!GetFileSizeEx(m_file, &li)) {
+                        m_error = "can't get file size";
+                        return false;
+                    }
+                    size = (u64_t)li.QuadPart;
+                }
+                if (size == 0) {
+                    m_error = "empty file";
+                    return false;
+                }
+                if (!fits_in_memory(size)) return false;
+                m_mapping = CreateFileMappingA(m_file, NULL,
+                    writable ? PAGE_READWRITE : PAGE_READONLY,
+                    (DWORD)(size >> 32), (DWORD)(size & 0xffffffffu), NULL);
+                if (!m_mapping) {
+                    m_error = "can't map file";
+                    return false;
+                }
+                m_base = static_cast<unsigned char*>(MapViewOfFile(m_mapping,
+                    writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+#else
+                m_fd = ::open(path,
+                    writable ? (O_RDWR | (create ? O_CREAT | O_TRUNC : 0))
+                             : O_RDONLY,
+                    0644);
+                if (m_fd < 0) {
+                    m_error = "can't open file";
+                    return false;
+                }
+                if (create) {
+                    if (!fits_in_memory(size)) return false;
+                    if (ftruncate(m_fd, (off_t)size) != 0) {
+                        m_error = "can't size file";
+                        return false;
+                    }
+                } else {
+                    struct stat st;
+                    if (fstat(m_fd, &st) != 0) {
+                        m_error = "can't get file size";
+                        return false;
+                    }
+                    size = (u64_t)st.st_size;
+                }
+                if (size == 0) {
+                    m_error = "empty file";
+                    return false;
+                }
+                if (!fits_in_memory(size)) return false;
+                void* p = mmap(NULL, (size_t)size,
+                    PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED,
+                    m_fd, 0);
+                m_base = (p == MAP_FAILED) ? NULL
+                                           : static_cast<unsigned char*>(p);
+#endif
+                if (!m_base) {
+                    m_error = "can't map file";
+                    return false;
+                }
+                m_size = size;
+                return true;
+            }
+
+            // A 32-bit build can't map 4GB or more (mmap() would be
+            // handed the size cut down to 32 bits, and parse() would
+            // walk off the end of what it got).
+            inline bool fits_in_memory(u64_t size) {
+                if (size > (u64_t)(size_t)-1) {
+                    m_error = "file too big to map in a 32-bit build";
+                    return false;
+                }
+                return true;
+            }
+
+            // Walks the chunks, filling in the format and finding the
+            // data.
+            inline bool parse() {
+                const unsigned char* p = m_base;
+                if (m_size < 12 || memcmp(p + 8, "WAVE", 4) != 0) {
+                    m_error = "not a WAV file";
+                    return false;
+                }
+                if (memcmp(p, "RF64", 4) == 0) {
+                    m_rf64 = true;
+                } else if (memcmp(p, "RIFF", 4) != 0) {
+                    m_error = "not a WAV file";
+                    return false;
+                }
+
+                u64_t ds64_data_bytes = 0;
+                bool have_fmt = false;
+                u64_t pos = 12;
+                while (pos + 8 <= m_size) {
+                    const unsigned char* c = p + pos;
+                    u64_t len = detail::get_u32(c + 4);
+                    const u64_t body = pos + 8;
+
+                    if (memcmp(c, "ds64", 4) == 0 && len >= 24
+                        && body + 24 <= m_size) {
+                        ds64_data_bytes = detail::get_u64(c + 16);
+                    } else if (memcmp(c, "fmt ", 4) == 0 && len >= 16
+                        && body + 16 <= m_size) {
+                        m_format = (int)detail::get_u16(c + 8);
+                        m_nch = (int)detail::get_u16(c + 10);
+                        m_samplerate = (int)detail::get_u32(c + 12);
+                        m_block_align = detail::get_u16(c + 20);
+                        m_bits = (int)detail::get_u16(c + 22);
+                        // WAVE_FORMAT_EXTENSIBLE: the real format is
+                        // the first two bytes of the sub-format GUID.
+                        if (m_format == 0xfffe && len >= 40
+                            && body + 40 <= m_size) {
+                            m_format = (int)detail::get_u16(c + 32);
+                        }
+                        have_fmt = true;
+                    } else if (memcmp(c, "data", 4) == 0) {
+                        if (m_rf64 && len == 0xffffffffu) {
+                            len = ds64_data_bytes;
+                        }
+                        // A truncated file gets what's actually there.
+                        if (body + len > m_size) len = m_size - body;
+                        m_data = m_base + body;
+                        m_data_bytes = len;
+                        break;
+                    }
+                    pos = body + len + (len & 1);
+                }
+
+                if (!have_fmt || !m_data || m_nch <= 0
+                    || m_block_align == 0) {
+                    m_error = "no fmt or data chunk";
+                    m_data = NULL;
+                    return false;
+                }
+                // frames() goes by the block align, samples_as<T>() by
+                // the sample size: they have to agree.
+                if (m_block_align != (u64_t)m_nch * (u64_t)(m_bits / 8)) {
+                    m_error = "block align doesn't match the format";
+                    m_data = NULL;
+                    return false;
+                }
+                return true;
+            }
+
+#if defined(_WIN32)
+            HANDLE m_file;
+            HANDLE m_mapping;
+#else
+            int m_fd;
+#endif
+            unsigned char* m_base;
+            u64_t m_size;
+            bool m_writable;
+            bool m_rf64;
+            const char* m_error;
+            int m_nch, m_samplerate, m_bits, m_format;
+            u64_t m_block_align;
+            unsigned char* m_data;
+            u64_t m_data_bytes;
+        };
+
+        namespace test {
+
+            // Write a file through the mapping, process it in place,
+            // read it back: plain WAV and RF64.
+            inline void check_wav_file(const char* path) {
+                for (int rf64 = 0; rf64 < 2; ++rf64) {
+                    const u64_t nframes = 44100;
+                    {
+                        wav_file w;
+                        const bool ok = w.create(path, 44100, 2, 16,
+                            nframes, wav_file::FORMAT_PCM, rf64 != 0);
+                        assert(ok && w.is_rf64() == (rf64 != 0));
+                        (void)ok;
+                        my::iterator::ptrs<short> s = w.shorts();
+                        assert(s.size() == nframes * 2);
+                        for (size_t i = 0; i < s.size(); ++i) {
+                            s[i] = (short)((int)(i % 2000) - 1000);
+                        }
+                        // in place, on the mapped pages
+                        const float g = normalize_buffer(
+                            (short*)s.begin(), (short*)s.end(), 2);
+                        assert(g > 30.0f);
+                        (void)g;
+                        const bool flushed = w.flush();
+                        assert(flushed);
+                        (void)flushed;
+                    }
+
+                    wav_file r;
+                    const bool ok = r.open(path);
+                    assert(ok);
+                    (void)ok;
+                    assert(r.is_rf64() == (rf64 != 0));
+                    assert(r.channels() == 2 && r.samplerate() == 44100);
+                    assert(r.bits_per_sample() == 16);
+                    assert(r.frames() == nframes);
+                    assert(!r.writable());
+                    const wav_file& cr = r;
+                    assert(cr.floats().size() == 0);
+                    my::iterator::ptrs<const short> s = cr.shorts();
+                    assert(s.size() == nframes * 2);
+                    assert(*std::max_element(s.begin(), s.end()) > 32000);
+
+                    envelope env(r.samplerate(), r.channels());
+                    const float att = 0.5f;
+                    const short* hit = env.envelope_shorts(
+                        s.begin(), s.end(), &att);
+                    assert(hit != (const short*)s.end());
+                    (void)hit;
+                }
+
+                // A block align that doesn't match channels and bits
+                // is refused, not half believed.
+                {
+                    wav_file w;
+                    bool ok = w.create(path, 44100, 2, 16, 100);
+                    assert(ok);
+                    w.close();
+                    unsigned char h[80]; // all create() writes before data
+                    FILE* f = fopen(path, "r+b");
+                    assert(f);
+                    const size_t got = fread(h, 1, sizeof(h), f);
+                    assert(got == sizeof(h));
+                    (void)got;
+                    size_t fmt = 12;
+                    while (fmt + 4 < sizeof(h) && memcmp(h + fmt, "fmt ", 4)) {
+                        ++fmt;
+                    }
+                    assert(fmt + 24 <= sizeof(h));
+                    h[fmt + 20] = 6; // block align 6 for 2 x 16 bits
+                    fseek(f, 0, SEEK_SET);
+                    fwrite(h, 1, sizeof(h), f);
+                    fclose(f);
+                    ok = w.open(path);
+                    assert(!ok && *w.error() != 0);
+                    (void)ok;
+                }
+                remove(path);
+            }
+
+        } // namespace test
+
+    } // namespace audio
+} // namespace cpp98
+} // namespace my
+
+#endif // CPP_98_AUDIO_WAV_HPP
@@ -5,9 +5,9 @@
  * a dynamic array)).
  *
  * You can iterate forward or backwards over the array, just as if it
- * were, say, a vector. My use-case does not require const_iterator, but if
- * you want to add it, a quick read of the class guts should give you
- * many hints on how to do it.
+ * were, say, a vector: the iterators are the array's own pointers
+ * (const_iterator too). strided<> walks every n'th element instead,
+ * one channel of interleaved audio, say.
  *
  * Example use (in practice the array will probably come from a C library)
  * Iteration is via the 'ptrs' class which implements the iterators.
@@ -33,12 +33,13 @@
 #include <iterator> // iterator, reverse_iterator
 
 #include <cstdio>
+#include <cassert> // assert().
+#include <numeric> // std::accumulate.
+#include <algorithm> // std::reverse, std::sort
+#include <functional> // std::negate
 
 #ifdef _DEBUG
 #include <iostream> // cout & friends.
-#include <cassert> // assert().
-#include <numeric> // std::accumulate.
-#include <algorithm> // std::reverse
 #include <vector>
 #endif
 
@@ -51,172 +52,242 @@ template <> class CompileTimeAssert<true> {
 };
 
 namespace iterator {
-    template <typename T> struct ptrs {
-        /*/
-         * Liberal sprinkling of 'inline' as some old compilers
-         * (and this is for c++98 after all!) really need it.
-         * Source: Stepanov during Amazon lectures on YouTube,
-         * 'Efficient use of components'.
-        /*/
-        inline ptrs(T* beg, T* end) : m_beg(beg), m_end(end) {}
-        inline ptrs(T* beg, size_t sz) : m_beg(beg) { m_end = beg + sz; }
-
-        struct iterator {
-
-            typedef std::random_access_iterator_tag iterator_category;
-            typedef T value_type;
-            typedef int difference_type;
-            typedef T* pointer;
-            typedef T& reference;
-            typedef const T* const_pointer;
-            typedef const T& const_reference;
-            // in MSVC98, ptrdiff_t is not in std namespace? WTF?
-
-            inline iterator() : m_start(), m_end(), m_cur() {}
-            inline iterator(T* b, T* e) : m_start(b), m_end(e), m_cur(b) {}
-            inline iterator(T* b, T* e, T* cur) : m_start(b), m_end(e), m_cur(cur) {}
-
-            inline iterator(const iterator& rhs)
-                : m_start(rhs.m_start), m_end(rhs.m_end), m_cur(rhs.m_cur) {}
-
-            iterator(const T* x) : m_cur(x) {}
-            iterator& operator=(const T* x) {
-                m_cur = x;
-                return *this;
-            }
-            inline iterator& operator++() {
-                m_cur++;
-                return *this;
-            }
-
-            inline iterator operator++(int) const {
-                iterator old = *this;
-                m_cur++;
-                return old;
-            }
-            inline iterator& operator--() {
-                m_cur--;
-                return *this;
-            }
-            inline iterator operator--(int) {
-                iterator old = *this;
-                m_cur--;
-                return old;
-            }
-			inline iterator& operator+=(int n){
-				
-				m_cur+=n;
-				return *this;
-			}
-			inline iterator& operator-=(int n){
-				
-				m_cur-=n;
-				return *this;
-			}
-
-
-
-            // operator T&() const { return m_cur; }
-            operator T*() const { return m_cur; }
-            operator T*() { return m_cur; }
-
-            T* operator->() { return m_cur; }
-
-            iterator operator-(difference_type n) const {
-
-                iterator Tmp = *this;
-                return (Tmp -= n);
-            }
-
-            iterator& operator-=(const iterator& rhs) {
-                m_cur -= rhs.m_cur;
-                return *this; // return the result by reference
-            }
-
-            iterator& operator-=(const difference_type& rhs) {
-                m_cur -= rhs;
-                return *this; // return the result by reference
-            }
-
-            inline bool operator==(const iterator& rhs) const {
-                return m_cur == rhs.m_cur;
-            }
-
-            inline bool operator!=(const iterator& rhs){
-               return (m_cur != rhs.m_cur);
-			}
+    /*/
+     * Every stride'th element, from p on: one channel of an interleaved
+     * buffer (stride = channels), or a column of anything row-major.
+     * Random access, so std algorithms (and reverse_iterator) take it
+     * as they would a pointer. end() is one stride past the last one:
+     * compare with it, never dereference it. (Ordering assumes a
+     * positive stride.)
+    /*/
+    template <typename T> struct strided {
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef T* pointer;
+        typedef T& reference;
 
+        inline strided() : m_p(0), m_stride(1) {}
+        inline strided(T* p, difference_type stride)
+            : m_p(p), m_stride(stride) {}
+        // strided<T> -> strided<const T>
+        template <typename U>
+        inline strided(const strided<U>& rhs)
+            : m_p(rhs.base()), m_stride(rhs.stride()) {}
+
+        inline reference operator*() const { return *m_p; }
+        inline pointer operator->() const { return m_p; }
+        inline reference operator[](difference_type n) const {
+            return m_p[n * m_stride];
+        }
+        inline pointer base() const { return m_p; }
+        inline difference_type stride() const { return m_stride; }
 
-            inline bool operator<(const iterator& rhs) const {
-                return m_cur < rhs.m_cur;
-            };
+        inline strided& operator++() {
+            m_p += m_stride;
+            return *this;
+        }
+        inline strided operator++(int) {
+            strided old = *this;
+            m_p += m_stride;
+            return old;
+        }
+        inline strided& operator--() {
+            m_p -= m_stride;
+            return *this;
+        }
+        inline strided operator--(int) {
+            strided old = *this;
+            m_p -= m_stride;
+            return old;
+        }
+        inline strided& operator+=(difference_type n) {
+            m_p += n * m_stride;
+            return *this;
+        }
+        inline strided& operator-=(difference_type n) {
+            m_p -= n * m_stride;
+            return *this;
+        }
+        inline strided operator+(difference_type n) const {
+            return strided(m_p + n * m_stride, m_stride);
+        }
+        inline strided operator-(difference_type n) const {
+            return strided(m_p - n * m_stride, m_stride);
+        }
+        inline difference_type operator-(const strided& rhs) const {
+            return (m_p - rhs.m_p) / m_stride;
+        }
 
-            inline reference end() { return m_end; }
-            inline reference begin() { return m_start; }
-#ifdef _MSC_VER
+        inline bool operator==(const strided& rhs) const {
+            return m_p == rhs.m_p;
+        }
+        inline bool operator!=(const strided& rhs) const {
+            return m_p != rhs.m_p;
+        }
+        inline bool operator<(const strided& rhs) const {
+            return m_p < rhs.m_p;
+        }
+        inline bool operator>(const strided& rhs) const {
+            return m_p > rhs.m_p;
+        }
+        inline bool operator<=(const strided& rhs) const {
+            return m_p <= rhs.m_p;
+        }
+        inline bool operator>=(const strided& rhs) const {
+            return m_p >= rhs.m_p;
+        }
 
-            typedef std::reverse_iterator<iterator, value_type> reverse_iterator;
+        private:
+        T* m_p;
+        difference_type m_stride;
+    };
 
-#else
-            typedef std::reverse_iterator<iterator> reverse_iterator;
-#endif
-            inline reverse_iterator rbegin() const { return reverse_iterator(end()); }
-            inline reverse_iterator rend() const { return reverse_iterator(begin()); }
+    template <typename T>
+    inline strided<T> operator+(
+        typename strided<T>::difference_type n, const strided<T>& it) {
+        return it + n;
+    }
 
-            private:
-            mutable T* m_start;
-            mutable T* m_end;
-            mutable T* m_cur;
-        };
+    /*/
+     * A range over a C array: two pointers, and nothing else.
+     *
+     * The iterators are plain pointers, as audio_buffer's are: a
+     * pointer is already the random-access iterator every std
+     * algorithm is specialised for, and the one auto-vectorizers see
+     * straight through, so std::transform() or std::max_element() over
+     * a ptrs compiles to exactly what it would over raw pointers.
+     * Distances are ptrdiff_t: good past 2G samples.
+     *
+     * Constness is the range's, not the ptrs object's (it's a view,
+     * like a pointer): ptrs<const T> is the read-only one, and any
+     * ptrs<T> converts to it.
+    /*/
+    template <typename T> struct ptrs {
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef size_t size_type;
+        typedef T* pointer;
+        typedef T& reference;
+        typedef const T* const_pointer;
+        typedef const T& const_reference;
 
-        typedef int difference_type;
+        typedef T* iterator;
+        typedef const T* const_iterator;
 #ifdef _MSC_VER
         typedef std::reverse_iterator<iterator, T> reverse_iterator;
+        typedef std::reverse_iterator<const_iterator, T>
+            const_reverse_iterator;
 #else
         typedef std::reverse_iterator<iterator> reverse_iterator;
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 #endif
-        typedef T value_type;
-        typedef T* pointer;
-        typedef T& reference;
-        typedef const T* const_pointer;
-        typedef const T& const_reference;
+        // Every n'th element: see strided_begin().
+        typedef strided<T> strided_iterator;
+        typedef strided<const T> const_strided_iterator;
 
-        inline reverse_iterator rbegin() const { return reverse_iterator(end()); }
-        inline reverse_iterator rend() const { return reverse_iterator(begin()); }
+        /*/
+         * Liberal sprinkling of 'inline' as some old compilers
+         * (and this is for c++98 after all!) really need it.
+         * Source: Stepanov during Amazon lectures on YouTube,
+         * 'Efficient use of components'.
+        /*/
+        inline ptrs(T* beg, T* end) : m_beg(beg), m_end(end) {}
+        inline ptrs(T* beg, size_t sz) : m_beg(beg), m_end(beg + sz) {}
+        // ptrs<T> -> ptrs<const T>
+        template <typename U>
+        inline ptrs(const ptrs<U>& rhs)
+            : m_beg(rhs.begin()), m_end(rhs.end()) {}
+
+        inline iterator begin() const { return m_beg; }
+        inline iterator end() const { return m_end; }
+        inline const_iterator cbegin() const { return m_beg; }
+        inline const_iterator cend() const { return m_end; }
+        inline reverse_iterator rbegin() const {
+            return reverse_iterator(m_end);
+        }
+        inline reverse_iterator rend() const {
+            return reverse_iterator(m_beg);
+        }
 
-        inline iterator begin() const { return iterator(m_beg, m_end); }
-        inline iterator end() const { return iterator(m_beg, m_end, m_end); }
-        inline iterator begin() { return iterator(m_beg, m_end); }
-        inline iterator end() { return iterator(m_beg, m_end, m_end); }
+        // Every stride'th element from begin() + offset: one channel
+        // of interleaved samples is strided_begin(nch, ch).
+        inline strided_iterator strided_begin(
+            difference_type stride, difference_type offset = 0) const {
+            return strided_iterator(m_beg + offset, stride);
+        }
+        inline strided_iterator strided_end(
+            difference_type stride, difference_type offset = 0) const {
+            const difference_type n = m_end - m_beg - offset;
+            return strided_begin(stride, offset)
+                + (n > 0 ? (n + stride - 1) / stride : 0);
+        }
 
         inline const ptrs& operator*() const { return *this; }
         inline ptrs& operator*() { return *this; }
 
-        inline size_t size() const { return static_cast<size_t>(m_end - m_beg); }
-        inline int isize() const { return static_cast<int>(m_end - m_beg); }
-        inline typename iterator::difference_type ptrdiff_size() const {
-            return std::distance(m_end, m_beg);
+        inline T* data() const { return m_beg; }
+        inline bool empty() const { return m_beg == m_end; }
+        inline size_t size() const {
+            return static_cast<size_t>(m_end - m_beg);
         }
-        T operator[](size_t i) const { return *(m_beg + i); }
-        T& operator[](size_t i) { return *(m_beg + i); }
-
-        // ptrs& operator+=(const ptrs& rhs) {
-        /* addition of rhs to *this takes place here */
-        //   m_cur += rhs.m_cur;
-        //  return *this; // return the result by reference
-        //}
-
-        // ptrs& operator-=(const ptrs& rhs) {
-        /* addition of rhs to *this takes place here */
-        //   m_cur -= rhs.m_cur;
-        //  return *this; // return the result by reference
-        // }
+        inline int isize() const { return static_cast<int>(m_end - m_beg); }
+        inline difference_type ptrdiff_size() const { return m_end - m_beg; }
+        inline T& operator[](size_t i) const { return m_beg[i]; }
 
         private:
-        mutable T* m_beg;
-        mutable T* m_end;
+        T* m_beg;
+        T* m_end;
     };
 
+    namespace test {
+        // my::iterator::ptrs, and its strided walks.
+        inline void check_ptrs_iterators() {
+            typedef my::iterator::ptrs<short> shorts_t;
+            typedef my::iterator::ptrs<const short> cshorts_t;
+            typedef std::iterator_traits<shorts_t::iterator> traits_t;
+            my::CompileTimeAssert<sizeof(traits_t::difference_type)
+                == sizeof(ptrdiff_t)>::Check();
+
+            short a[] = { 5, -3, 9, 1, -7, 2, 8 };
+            const shorts_t s(a, a + 7);
+            const cshorts_t cs = s; // to const
+            assert(s.size() == 7 && s.ptrdiff_size() == 7 && !s.empty());
+            assert(cs.begin() == a && cs.end() == a + 7);
+            assert(*std::max_element(cs.begin(), cs.end()) == 9);
+            assert(s.end() - s.begin() == 7 && s[2] == 9);
+            std::transform(
+                s.begin(), s.end(), s.begin(), std::negate<short>());
+            assert(a[0] == -5 && a[6] == -8);
+            assert(*s.rbegin() == -8 && *(s.rend() - 1) == -5);
+            assert(std::distance(s.rbegin(), s.rend()) == 7);
+
+            // every 3rd from 1: a[1], a[4] (7 isn't a multiple of 3)
+            shorts_t::strided_iterator b = s.strided_begin(3, 1);
+            const shorts_t::strided_iterator e = s.strided_end(3, 1);
+            assert(e - b == 2 && b[1] == a[4] && *(1 + b) == a[4]);
+            assert(b < e && e > b && b <= b && e >= b && b != e);
+            shorts_t::strided_iterator c = b;
+            const short first = *c++;
+            assert(first == a[1] && *c == a[4]);
+            --c;
+            assert(c == b);
+            c += 2;
+            assert(c == e && c - 2 == b);
+            std::sort(b, e); // a[1], a[4] sorted among themselves
+            assert(a[1] == 3 && a[4] == 7);
+            cshorts_t::const_strided_iterator cb = b;
+            const cshorts_t::const_strided_iterator ce = e;
+            assert(std::accumulate(cb, ce, 0) == 10);
+            assert(s.strided_end(2) - s.strided_begin(2) == 4);
+            assert(s.strided_end(8, 7) == s.strided_begin(8, 7));
+            (void)cs;
+            (void)cb;
+            (void)ce;
+            (void)first;
+        }
+    } // namespace test
+
 #ifdef _DEBUG
     namespace test {
         using namespace std;